@@ -77,6 +77,8 @@ class CMakeBuild(build_ext):
                 cmake_args += ['-DPYBIND11_USE_CROSSCOMPILING=TRUE']
 
         cmake_args += [f"-DVERSION_INFO={self.distribution.get_version()}"]
+        # Extra options like "-DCMM_LCMS2_THREADED=ON"
+        cmake_args += [a for a in os.environ.get('CMAKE_ARGS', '').split(' ') if a]
 
         if not os.path.exists(self.build_temp):
             os.makedirs(self.build_temp)
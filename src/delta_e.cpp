@@ -0,0 +1,135 @@
+#include "delta_e.h"
+
+#include <cmath>
+#include <algorithm>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+namespace {
+
+// atan2deg() of Little-CMS: 0 to 360 degrees, 0 for (0, 0).
+inline cmsFloat64Number atan2_degrees(cmsFloat64Number b, cmsFloat64Number a) {
+	cmsFloat64Number h = (a == 0 && b == 0) ? 0 : atan2(b, a) * (180. / M_PI);
+	return h < 0 ? h + 360 : h;
+}
+
+inline cmsFloat64Number radians(cmsFloat64Number deg) {
+	return deg * (M_PI / 180.0);
+}
+
+inline cmsFloat64Number pow7(cmsFloat64Number x) {
+	cmsFloat64Number x2 = x * x;
+	return x2 * x2 * x2 * x;
+}
+
+void delta_e_76_kernel(const DeltaEParams &, const LabChunk &c, size_t n, cmsFloat64Number *d) {
+	for (size_t i = 0; i < n; i++) {
+		cmsFloat64Number dL = c.L1[i] - c.L2[i], da = c.a1[i] - c.a2[i], db = c.b1[i] - c.b2[i];
+		d[i] = sqrt(dL * dL + da * da + db * db);
+	}
+}
+
+void delta_e_94_kernel(const DeltaEParams &, const LabChunk &c, size_t n, cmsFloat64Number *d) {
+	for (size_t i = 0; i < n; i++) {
+		cmsFloat64Number dL = c.L1[i] - c.L2[i], da = c.a1[i] - c.a2[i], db = c.b1[i] - c.b2[i];
+		cmsFloat64Number C1 = sqrt(c.a1[i] * c.a1[i] + c.b1[i] * c.b1[i]);
+		cmsFloat64Number C2 = sqrt(c.a2[i] * c.a2[i] + c.b2[i] * c.b2[i]);
+		cmsFloat64Number dC = C1 - C2;
+		cmsFloat64Number dE = sqrt(dL * dL + da * da + db * db);
+		cmsFloat64Number dhsq = dE * dE - dL * dL - dC * dC;
+		cmsFloat64Number dh = sqrt(std::max(dhsq, 0.0));
+		cmsFloat64Number c12 = sqrt(C1 * C2);
+		cmsFloat64Number sc = 1.0 + 0.048 * c12;
+		cmsFloat64Number sh = 1.0 + 0.014 * c12;
+		d[i] = sqrt(dL * dL + dC * dC / (sc * sc) + dh * dh / (sh * sh));
+	}
+}
+
+void delta_e_cmc_kernel(const DeltaEParams &p, const LabChunk &c, size_t n, cmsFloat64Number *d) {
+	for (size_t i = 0; i < n; i++) {
+		cmsFloat64Number L1 = c.L1[i];
+		cmsFloat64Number dL = c.L2[i] - L1, da = c.a1[i] - c.a2[i], db = c.b1[i] - c.b2[i];
+		cmsFloat64Number C1 = sqrt(c.a1[i] * c.a1[i] + c.b1[i] * c.b1[i]);
+		cmsFloat64Number C2 = sqrt(c.a2[i] * c.a2[i] + c.b2[i] * c.b2[i]);
+		cmsFloat64Number h1 = atan2_degrees(c.b1[i], c.a1[i]);
+		cmsFloat64Number dC = C2 - C1;
+		cmsFloat64Number dE2 = dL * dL + da * da + db * db;
+		cmsFloat64Number dh = sqrt(std::max(dE2 - dL * dL - dC * dC, 0.0));
+		cmsFloat64Number t = (h1 > 164 && h1 < 345)
+			? 0.56 + fabs(0.2 * cos(radians(h1 + 168)))
+			: 0.36 + fabs(0.4 * cos(radians(h1 + 35)));
+		cmsFloat64Number sc = 0.0638 * C1 / (1 + 0.0131 * C1) + 0.638;
+		cmsFloat64Number sl = L1 < 16 ? 0.511 : 0.040975 * L1 / (1 + 0.01765 * L1);
+		cmsFloat64Number C1_4 = C1 * C1 * C1 * C1;
+		cmsFloat64Number f = sqrt(C1_4 / (C1_4 + 1900));
+		cmsFloat64Number sh = sc * (t * f + 1 - f);
+		cmsFloat64Number x = dL / (p.kl * sl), y = dC / (p.kc * sc), z = dh / sh;
+		cmsFloat64Number cmc = sqrt(x * x + y * y + z * z);
+		d[i] = (L1 == 0 && c.L2[i] == 0) ? 0 : cmc;
+	}
+}
+
+void delta_e_2000_kernel(const DeltaEParams &p, const LabChunk &c, size_t n, cmsFloat64Number *d) {
+	const cmsFloat64Number pow25_7 = 6103515625.0;
+	for (size_t i = 0; i < n; i++) {
+		cmsFloat64Number L1 = c.L1[i], a1 = c.a1[i], b1 = c.b1[i];
+		cmsFloat64Number Ls = c.L2[i], as = c.a2[i], bs = c.b2[i];
+		cmsFloat64Number C = sqrt(a1 * a1 + b1 * b1);
+		cmsFloat64Number Cs = sqrt(as * as + bs * bs);
+		cmsFloat64Number mean_C7 = pow7((C + Cs) / 2);
+		cmsFloat64Number G = 0.5 * (1 - sqrt(mean_C7 / (mean_C7 + pow25_7)));
+
+		cmsFloat64Number a_p = (1 + G) * a1;
+		cmsFloat64Number C_p = sqrt(a_p * a_p + b1 * b1);
+		cmsFloat64Number h_p = atan2_degrees(b1, a_p);
+		cmsFloat64Number a_ps = (1 + G) * as;
+		cmsFloat64Number C_ps = sqrt(a_ps * a_ps + bs * bs);
+		cmsFloat64Number h_ps = atan2_degrees(bs, a_ps);
+
+		cmsFloat64Number meanC_p = (C_p + C_ps) / 2;
+		cmsFloat64Number hps_plus_hp = h_ps + h_p;
+		cmsFloat64Number hps_minus_hp = h_ps - h_p;
+		cmsFloat64Number meanh_p = fabs(hps_minus_hp) <= 180.000001 ? hps_plus_hp / 2
+			: hps_plus_hp < 360 ? (hps_plus_hp + 360) / 2 : (hps_plus_hp - 360) / 2;
+		cmsFloat64Number delta_h = hps_minus_hp <= -180.000001 ? hps_minus_hp + 360
+			: hps_minus_hp > 180 ? hps_minus_hp - 360 : hps_minus_hp;
+		cmsFloat64Number delta_L = Ls - L1;
+		cmsFloat64Number delta_C = C_ps - C_p;
+		cmsFloat64Number delta_H = 2 * sqrt(C_ps * C_p) * sin(radians(delta_h) / 2);
+
+		cmsFloat64Number T = 1 - 0.17 * cos(radians(meanh_p - 30))
+			+ 0.24 * cos(radians(2 * meanh_p))
+			+ 0.32 * cos(radians(3 * meanh_p + 6))
+			- 0.2 * cos(radians(4 * meanh_p - 63));
+		cmsFloat64Number mean_L50 = (Ls + L1) / 2 - 50;
+		cmsFloat64Number Sl = 1 + (0.015 * mean_L50 * mean_L50) / sqrt(20 + mean_L50 * mean_L50);
+		cmsFloat64Number Sc = 1 + 0.045 * (C_p + C_ps) / 2;
+		cmsFloat64Number Sh = 1 + 0.015 * ((C_ps + C_p) / 2) * T;
+		cmsFloat64Number ro = (meanh_p - 275) / 25;
+		cmsFloat64Number delta_ro = 30 * exp(-ro * ro);
+		cmsFloat64Number meanC_p7 = pow7(meanC_p);
+		cmsFloat64Number Rc = 2 * sqrt(meanC_p7 / (meanC_p7 + pow25_7));
+		cmsFloat64Number Rt = -sin(2 * radians(delta_ro)) * Rc;
+
+		cmsFloat64Number x = delta_L / (Sl * p.kl), y = delta_C / (Sc * p.kc), z = delta_H / (Sh * p.kh);
+		d[i] = sqrt(x * x + y * y + z * z + Rt * y * z);
+	}
+}
+
+}  // namespace
+
+DeltaEKernel get_delta_e_kernel(DeltaEMethod method) {
+	switch (method) {
+	case DELTA_E_76:
+		return delta_e_76_kernel;
+	case DELTA_E_94:
+		return delta_e_94_kernel;
+	case DELTA_E_CMC:
+		return delta_e_cmc_kernel;
+	default:
+		return delta_e_2000_kernel;
+	}
+}
+
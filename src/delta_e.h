@@ -0,0 +1,30 @@
+// DeltaE kernels of delta_e() and delta_e_transforms(). Built with the flags by which they are
+// vectorized (see CMakeLists.txt), apart from the rest of the module.
+#pragma once
+
+#include <lcms2.h>
+#include <cstddef>
+
+// Color differences of Lab pairs by the formulas of Little-CMS.
+enum DeltaEMethod { DELTA_E_76, DELTA_E_94, DELTA_E_2000, DELTA_E_CMC };
+
+struct DeltaEParams {
+	DeltaEMethod method;
+	cmsFloat64Number kl, kc, kh;  // l and c for CMC
+};
+
+// Pixels of a chunk of the DeltaE kernels, small enough for the cache.
+const size_t DELTA_E_CHUNK = 256;
+
+// Lab pairs of a chunk as structure of arrays, so that the loops of the kernels are vectorized.
+struct LabChunk {
+	cmsFloat64Number L1[DELTA_E_CHUNK], a1[DELTA_E_CHUNK], b1[DELTA_E_CHUNK];
+	cmsFloat64Number L2[DELTA_E_CHUNK], a2[DELTA_E_CHUNK], b2[DELTA_E_CHUNK];
+};
+
+// DeltaE of the first n pairs of a chunk, by the formulas of Little-CMS. The loops have only selects,
+// so 76 and 94 are vectorized by the compiler; CMC and 2000 are bound by the trigonometric functions.
+using DeltaEKernel = void (*)(const DeltaEParams &p, const LabChunk &c, size_t n, cmsFloat64Number *d);
+
+// Chosen once per call, not per pixel.
+DeltaEKernel get_delta_e_kernel(DeltaEMethod method);
@@ -6,656 +6,4818 @@ extern "C" {
 #define CMS_NO_REGISTER_KEYWORD 1
 #include <lcms2.h>
 #include <lcms2_internal.h>
+#ifdef CMM_LCMS2_THREADED
+#include <lcms2_threaded.h>
+#endif
+#ifdef CMM_LCMS2_FAST_FLOAT
+#include <lcms2_fast_float.h>
+#endif
 }
 
+#include "delta_e.h"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <array>
+#include <atomic>
+#include <algorithm>
+#include <list>
+#include <cstring>
+#include <cstdio>
+#include <cmath>
+#include <type_traits>
+#include <limits>
+#include <chrono>
+
+#if defined(__EMSCRIPTEN__) && !defined(__EMSCRIPTEN_PTHREADS__)
+#define CMM_NO_THREADS 1
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define CMM_X86 1
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#include <immintrin.h>
+#endif
+
+// Compiles a function for an ISA which is selected at runtime.
+#if defined(__GNUC__) || defined(__clang__)
+#define CMM_TARGET(isa) __attribute__((target(isa)))
+#else
+#define CMM_TARGET(isa)
+#endif
+
 namespace py = pybind11;
 using namespace pybind11::literals;
 
-template <typename T, typename U>
-void do_transform(cmsHTRANSFORM ht, py::array_t <T> input_buf, py::array_t <U> output_buf, int num_pixel) {
-	py::buffer_info input_bi = input_buf.request();
-	py::buffer_info output_bi = output_buf.request();
-	cmsDoTransform(ht, input_bi.ptr, output_bi.ptr, num_pixel);
+class WorkerPool {
+public:
+	void submit(std::function<void()> task) {
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			tasks.push_back(std::move(task));
+		}
+		cv.notify_one();
+	}
+
+	void ensure_workers(int n) {
+		std::lock_guard<std::mutex> lock(mtx);
+		while ((int)workers.size() < n) {
+			workers.emplace_back([this]() { run(); });
+		}
+	}
+
+private:
+	std::mutex mtx;
+	std::condition_variable cv;
+	std::deque<std::function<void()>> tasks;
+	std::vector<std::thread> workers;
+
+	void run() {
+		for (;;) {
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> lock(mtx);
+				cv.wait(lock, [this]() { return !tasks.empty(); });
+				task = std::move(tasks.front());
+				tasks.pop_front();
+			}
+			task();
+		}
+	}
+};
+
+// Never destroyed: joining threads while the module is unloaded can deadlock (Windows loader lock).
+WorkerPool &get_worker_pool() {
+	static WorkerPool *pool = new WorkerPool();
+	return *pool;
 }
 
-bool setAsciiTag(std::string str, cmsHPROFILE hProfile, cmsTagSignature tag) {
-	auto m = cmsMLUalloc(NULL, 0);
-	cmsMLUsetASCII(m, cmsNoLanguage, cmsNoCountry, str.c_str());
-	auto rc = cmsWriteTag(hProfile, tag, m);
-	cmsMLUfree(m);
-	return rc;
+// Workers for n_jobs calls in flight, with the helpers of the tiles of one. The pool never shrinks,
+// so calls beyond the cores wait in the queue instead of adding threads.
+int pool_size_for_jobs(size_t n_jobs, int n_threads) {
+	size_t cores = std::max(std::thread::hardware_concurrency(), 1u);
+	return (int)std::min(n_jobs, cores) + std::max(n_threads, 1) - 1;
+}
+
+static std::atomic<int> NUM_THREADS(1);
+const size_t MIN_PIXELS_PER_TILE = 16384;
+
+struct CmmError {
+	cmsContext context;
+	cmsUInt32Number code;
+	std::string msg;
+};
+
+// Errors of the contexts by create_context(), collected on each thread without lock.
+std::vector<CmmError> &thread_errors() {
+	static thread_local std::vector<CmmError> errors;
+	return errors;
+}
+
+void CmmCollectErrorHandler(cmsContext context, cmsUInt32Number error_code, const char *text) {
+	thread_errors().push_back(CmmError{context, error_code, text});
+}
+
+// Calls fn(begin, end) over [0, n) in tiles of at least min_tile items on up to n_threads threads.
+// The caller works on tiles too, so it never waits on a worker that has nothing to do.
+void parallel_for(size_t n, int n_threads, size_t min_tile, const std::function<void(size_t, size_t)> &fn) {
+	size_t n_tiles = std::min(n / std::max(min_tile, (size_t)1), (size_t)std::max(n_threads, 1) * 4);
+#ifdef CMM_NO_THREADS
+	n_tiles = 1;
+#endif
+	if (n_tiles <= 1 || n_threads <= 1) {
+		if (n) {
+			fn(0, n);
+		}
+		return;
+	}
+
+	struct Job {
+		std::function<void(size_t, size_t)> fn;
+		size_t n, n_tiles;
+		std::atomic<size_t> next{0};
+		size_t done = 0;
+		std::mutex mtx;
+		std::condition_variable cv;
+		std::exception_ptr error;
+		std::vector<CmmError> errors;
+
+		void work() {
+			auto &tls_errors = thread_errors();
+			for (size_t i; (i = next.fetch_add(1)) < n_tiles;) {
+				std::exception_ptr e;
+				try {
+					fn(n * i / n_tiles, n * (i + 1) / n_tiles);
+				} catch (...) {
+					e = std::current_exception();
+				}
+				std::lock_guard<std::mutex> lock(mtx);
+				if (e && !error) {
+					error = e;
+				}
+				// Hands the errors over to the caller thread.
+				if (!tls_errors.empty()) {
+					std::move(tls_errors.begin(), tls_errors.end(), std::back_inserter(errors));
+					tls_errors.clear();
+				}
+				if (++done == n_tiles) {
+					cv.notify_all();
+				}
+			}
+		}
+	};
+	auto job = std::make_shared<Job>();
+	job->fn = fn;
+	job->n = n;
+	job->n_tiles = n_tiles;
+
+	int n_helper = (int)std::min((size_t)n_threads, n_tiles) - 1;
+	auto &pool = get_worker_pool();
+	pool.ensure_workers(n_helper);
+	for (int i = 0; i < n_helper; i++) {
+		pool.submit([job]() { job->work(); });
+	}
+	job->work();
+	std::unique_lock<std::mutex> lock(job->mtx);
+	job->cv.wait(lock, [&job]() { return job->done == job->n_tiles; });
+	auto &tls_errors = thread_errors();
+	std::move(job->errors.begin(), job->errors.end(), std::back_inserter(tls_errors));
+	job->errors.clear();
+	if (job->error) {
+		std::rethrow_exception(job->error);
+	}
+}
+
+// Settings of a context made by create_context(). Stored as the user data of the context.
+struct CmmContextData {
+	CmmContextData(int n_threads, size_t min_pixels_per_thread, bool raise_errors)
+		: n_threads(n_threads), min_pixels_per_thread(min_pixels_per_thread), lcms2_threaded(false), raise_errors(raise_errors) {}
+
+	int n_threads;
+	size_t min_pixels_per_thread;
+	bool lcms2_threaded;
+	bool raise_errors;
+	std::mutex errors_mtx;
+	std::vector<CmmError> errors;
+};
+
+CmmContextData *get_context_data(cmsContext context) {
+	if (!context) {
+		return NULL;
+	}
+	return static_cast<CmmContextData *>(cmsGetContextUserData(context));
+}
+
+class LcmsError : public std::runtime_error {
+public:
+	using std::runtime_error::runtime_error;
+};
+
+// Moves the errors collected on this thread to their contexts after a call.
+// Throws LcmsError if a context is made with raise_errors, unless raise is false because
+// another exception is on the way; the errors of those contexts are dropped then.
+void surface_errors(bool raise = true) {
+	auto &tls_errors = thread_errors();
+	if (tls_errors.empty()) {
+		return;
+	}
+	std::vector<CmmError> errors;
+	errors.swap(tls_errors);
+	std::string msg;
+	for (auto &e : errors) {
+		auto data = get_context_data(e.context);
+		if (!data) {
+			continue;
+		}
+		if (data->raise_errors) {
+			msg += (msg.empty() ? "" : "\n") + std::to_string(e.code) + ": " + e.msg;
+		} else {
+			std::lock_guard<std::mutex> lock(data->errors_mtx);
+			data->errors.push_back(std::move(e));
+		}
+	}
+	if (raise && !msg.empty()) {
+		throw LcmsError(msg);
+	}
+}
+
+// Bytes per pixel of a chunky (interleaved) format. Double has T_BYTES 0.
+cmsUInt32Number pixel_size(cmsUInt32Number format) {
+	cmsUInt32Number n_byte = T_BYTES(format);
+	if (n_byte == 0) {
+		n_byte = sizeof(cmsFloat64Number);
+	}
+	return n_byte * (T_CHANNELS(format) + T_EXTRA(format));
+}
+
+// Thread settings of the context of the transform, or the module defaults.
+// Returns false if the threaded plugin of Little-CMS splits the work instead.
+bool get_transform_threads(cmsHTRANSFORM ht, int &n_threads, size_t &min_tile) {
+	n_threads = NUM_THREADS.load();
+	min_tile = MIN_PIXELS_PER_TILE;
+	auto context_data = get_context_data(cmsGetTransformContextID(ht));
+	if (context_data) {
+		if (context_data->lcms2_threaded) {
+			return false;
+		}
+		n_threads = context_data->n_threads;
+		min_tile = context_data->min_pixels_per_thread;
+	}
+	return true;
+}
+
+// CLUT engine: tetrahedral interpolation of [curves] CLUT [curves] pipelines with 16-bit tables.
+// The result is bit-exact with TetrahedralInterp16() of Little-CMS, including its int32 wrapping.
+enum ClutIsa { CLUT_ISA_OFF, CLUT_ISA_SCALAR, CLUT_ISA_SSE41, CLUT_ISA_AVX2 };
+
+const char *CLUT_ISA_NAMES[] = {"off", "scalar", "sse4.1", "avx2"};
+
+// Input and output of do_transform() smaller than this are left to Little-CMS.
+const size_t CLUT_ENGINE_MIN_PIXELS = 4096;
+
+// Building curve tables takes 65536 evaluations per curve.
+const size_t CLUT_ENGINE_MIN_ROWS = 65536;
+
+struct ClutEngine {
+	int n_out;
+	int32_t domain[3];
+	int32_t opta[3];  // Offset in clut of a grid step of each input
+	std::vector<int32_t> clut;
+	std::vector<cmsUInt16Number> pre;  // 65536 entries per input (+1 padding for gather), empty for identity
+	std::vector<cmsUInt16Number> post;  // 65536 entries per output (+1 padding for gather), empty for identity
+};
+
+inline void store_sample(cmsUInt16Number *p, uint32_t v) {
+	*p = (cmsUInt16Number)v;
+}
+
+// FROM_16_TO_8() of Little-CMS
+inline void store_sample(cmsUInt8Number *p, uint32_t v) {
+	*p = (cmsUInt8Number)((v * 65281U + 8388608U) >> 24);
+}
+
+template <typename Out>
+void clut_eval_scalar(const ClutEngine &e, const cmsUInt16Number *in, ptrdiff_t in_stride, Out *out, ptrdiff_t out_stride, size_t n) {
+	const cmsUInt16Number *pre = e.pre.empty() ? NULL : e.pre.data();
+	const cmsUInt16Number *post = e.post.empty() ? NULL : e.post.data();
+	for (size_t i = 0; i < n; i++, in += in_stride, out += out_stride) {
+		int32_t r[3], o[3], base = 0;
+		for (int c = 0; c < 3; c++) {
+			int32_t v = pre ? pre[c * 65536 + in[c]] : in[c];
+			int32_t a = v * e.domain[c];
+			int32_t f = a + (a + 0x7fff) / 0xffff;
+			base += (f >> 16) * e.opta[c];
+			r[c] = f & 0xffff;
+			o[c] = v == 0xffff ? 0 : e.opta[c];
+		}
+		// Vertices of the tetrahedron by descending rests. The order of ties does not change the result.
+		int hi = r[0] >= r[1] && r[0] >= r[2] ? 0 : (r[1] > r[0] && r[1] >= r[2] ? 1 : 2);
+		int lo = r[2] <= r[0] && r[2] <= r[1] ? 2 : (r[1] <= r[0] && r[1] < r[2] ? 1 : 0);
+		uint32_t w_hi = r[hi], w_lo = r[lo], w_mid = r[0] + r[1] + r[2] - w_hi - w_lo;
+		int32_t v3 = o[0] + o[1] + o[2], v1 = o[hi], v2 = v3 - o[lo];
+		const int32_t *t = e.clut.data() + base;
+		for (int k = 0; k < e.n_out; k++, t++) {
+			uint32_t rest = (uint32_t)(t[v1] - t[0]) * w_hi + (uint32_t)(t[v2] - t[v1]) * w_mid
+				+ (uint32_t)(t[v3] - t[v2]) * w_lo + 0x8001U;
+			uint32_t y = (uint32_t)t[0] + (uint32_t)((int32_t)(rest + (uint32_t)((int32_t)rest >> 16)) >> 16);
+			y &= 0xffff;
+			store_sample(out + k, post ? post[k * 65536 + y] : y);
+		}
+	}
+}
+
+#ifdef CMM_X86
+// Loads the inputs of lanes through the pre curves.
+template <int N>
+inline void clut_load_lanes(const ClutEngine &e, const cmsUInt16Number *in, ptrdiff_t in_stride, int32_t (&lanes)[3][N]) {
+	const cmsUInt16Number *pre = e.pre.empty() ? NULL : e.pre.data();
+	for (int l = 0; l < N; l++, in += in_stride) {
+		for (int c = 0; c < 3; c++) {
+			lanes[c][l] = pre ? pre[c * 65536 + in[c]] : in[c];
+		}
+	}
+}
+
+template <typename Out>
+CMM_TARGET("sse4.1") void clut_eval_sse41(const ClutEngine &e, const cmsUInt16Number *in, ptrdiff_t in_stride, Out *out, ptrdiff_t out_stride, size_t n) {
+	const cmsUInt16Number *post = e.post.empty() ? NULL : e.post.data();
+	const int32_t *clut = e.clut.data();
+	const __m128i v_ffff = _mm_set1_epi32(0xffff), ones = _mm_set1_epi32(-1);
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4, in += 4 * in_stride, out += 4 * out_stride) {
+		alignas(16) int32_t lanes[3][4];
+		clut_load_lanes(e, in, in_stride, lanes);
+		__m128i r[3], o[3], base = _mm_setzero_si128();
+		for (int c = 0; c < 3; c++) {
+			__m128i v = _mm_load_si128((const __m128i *)lanes[c]);
+			__m128i a = _mm_mullo_epi32(v, _mm_set1_epi32(e.domain[c]));
+			// (t + 1 + (t >> 16)) >> 16 == t / 0xffff for t < 2^24
+			__m128i t = _mm_add_epi32(a, _mm_set1_epi32(0x7fff));
+			__m128i f = _mm_add_epi32(a, _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(t, _mm_set1_epi32(1)), _mm_srli_epi32(t, 16)), 16));
+			base = _mm_add_epi32(base, _mm_mullo_epi32(_mm_srli_epi32(f, 16), _mm_set1_epi32(e.opta[c])));
+			r[c] = _mm_and_si128(f, v_ffff);
+			o[c] = _mm_andnot_si128(_mm_cmpeq_epi32(v, v_ffff), _mm_set1_epi32(e.opta[c]));
+		}
+		__m128i gt_yx = _mm_cmpgt_epi32(r[1], r[0]), gt_zx = _mm_cmpgt_epi32(r[2], r[0]), gt_zy = _mm_cmpgt_epi32(r[2], r[1]);
+		__m128i hi_x = _mm_andnot_si128(_mm_or_si128(gt_yx, gt_zx), ones);
+		__m128i hi_y = _mm_andnot_si128(gt_zy, gt_yx);
+		__m128i lo_z = _mm_andnot_si128(_mm_or_si128(gt_zx, gt_zy), ones);
+		__m128i lo_y = _mm_andnot_si128(gt_yx, gt_zy);
+		__m128i w_hi = _mm_blendv_epi8(_mm_blendv_epi8(r[2], r[1], hi_y), r[0], hi_x);
+		__m128i w_lo = _mm_blendv_epi8(_mm_blendv_epi8(r[0], r[1], lo_y), r[2], lo_z);
+		__m128i w_mid = _mm_sub_epi32(_mm_add_epi32(_mm_add_epi32(r[0], r[1]), r[2]), _mm_add_epi32(w_hi, w_lo));
+		__m128i o_hi = _mm_blendv_epi8(_mm_blendv_epi8(o[2], o[1], hi_y), o[0], hi_x);
+		__m128i o_lo = _mm_blendv_epi8(_mm_blendv_epi8(o[0], o[1], lo_y), o[2], lo_z);
+		__m128i v3 = _mm_add_epi32(_mm_add_epi32(o[0], o[1]), o[2]);
+		alignas(16) int32_t idx[4][4];
+		_mm_store_si128((__m128i *)idx[0], base);
+		_mm_store_si128((__m128i *)idx[1], _mm_add_epi32(base, o_hi));
+		_mm_store_si128((__m128i *)idx[2], _mm_add_epi32(base, _mm_sub_epi32(v3, o_lo)));
+		_mm_store_si128((__m128i *)idx[3], _mm_add_epi32(base, v3));
+		for (int k = 0; k < e.n_out; k++) {
+			__m128i c[4];
+			for (int j = 0; j < 4; j++) {
+				c[j] = _mm_setr_epi32(clut[idx[j][0] + k], clut[idx[j][1] + k], clut[idx[j][2] + k], clut[idx[j][3] + k]);
+			}
+			__m128i rest = _mm_add_epi32(_mm_add_epi32(
+				_mm_mullo_epi32(_mm_sub_epi32(c[1], c[0]), w_hi),
+				_mm_mullo_epi32(_mm_sub_epi32(c[2], c[1]), w_mid)), _mm_add_epi32(
+				_mm_mullo_epi32(_mm_sub_epi32(c[3], c[2]), w_lo), _mm_set1_epi32(0x8001)));
+			__m128i y = _mm_add_epi32(c[0], _mm_srai_epi32(_mm_add_epi32(rest, _mm_srai_epi32(rest, 16)), 16));
+			alignas(16) int32_t ys[4];
+			_mm_store_si128((__m128i *)ys, _mm_and_si128(y, v_ffff));
+			for (int l = 0; l < 4; l++) {
+				store_sample(out + l * out_stride + k, post ? post[k * 65536 + ys[l]] : ys[l]);
+			}
+		}
+	}
+	clut_eval_scalar(e, in, in_stride, out, out_stride, n - i);
+}
+
+template <typename Out>
+CMM_TARGET("avx2") void clut_eval_avx2(const ClutEngine &e, const cmsUInt16Number *in, ptrdiff_t in_stride, Out *out, ptrdiff_t out_stride, size_t n) {
+	const cmsUInt16Number *post = e.post.empty() ? NULL : e.post.data();
+	const int *clut = (const int *)e.clut.data();
+	const __m256i v_ffff = _mm256_set1_epi32(0xffff), ones = _mm256_set1_epi32(-1);
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8, in += 8 * in_stride, out += 8 * out_stride) {
+		alignas(32) int32_t lanes[3][8];
+		clut_load_lanes(e, in, in_stride, lanes);
+		__m256i r[3], o[3], base = _mm256_setzero_si256();
+		for (int c = 0; c < 3; c++) {
+			__m256i v = _mm256_load_si256((const __m256i *)lanes[c]);
+			__m256i a = _mm256_mullo_epi32(v, _mm256_set1_epi32(e.domain[c]));
+			__m256i t = _mm256_add_epi32(a, _mm256_set1_epi32(0x7fff));
+			__m256i f = _mm256_add_epi32(a, _mm256_srli_epi32(_mm256_add_epi32(_mm256_add_epi32(t, _mm256_set1_epi32(1)), _mm256_srli_epi32(t, 16)), 16));
+			base = _mm256_add_epi32(base, _mm256_mullo_epi32(_mm256_srli_epi32(f, 16), _mm256_set1_epi32(e.opta[c])));
+			r[c] = _mm256_and_si256(f, v_ffff);
+			o[c] = _mm256_andnot_si256(_mm256_cmpeq_epi32(v, v_ffff), _mm256_set1_epi32(e.opta[c]));
+		}
+		__m256i gt_yx = _mm256_cmpgt_epi32(r[1], r[0]), gt_zx = _mm256_cmpgt_epi32(r[2], r[0]), gt_zy = _mm256_cmpgt_epi32(r[2], r[1]);
+		__m256i hi_x = _mm256_andnot_si256(_mm256_or_si256(gt_yx, gt_zx), ones);
+		__m256i hi_y = _mm256_andnot_si256(gt_zy, gt_yx);
+		__m256i lo_z = _mm256_andnot_si256(_mm256_or_si256(gt_zx, gt_zy), ones);
+		__m256i lo_y = _mm256_andnot_si256(gt_yx, gt_zy);
+		__m256i w_hi = _mm256_blendv_epi8(_mm256_blendv_epi8(r[2], r[1], hi_y), r[0], hi_x);
+		__m256i w_lo = _mm256_blendv_epi8(_mm256_blendv_epi8(r[0], r[1], lo_y), r[2], lo_z);
+		__m256i w_mid = _mm256_sub_epi32(_mm256_add_epi32(_mm256_add_epi32(r[0], r[1]), r[2]), _mm256_add_epi32(w_hi, w_lo));
+		__m256i o_hi = _mm256_blendv_epi8(_mm256_blendv_epi8(o[2], o[1], hi_y), o[0], hi_x);
+		__m256i o_lo = _mm256_blendv_epi8(_mm256_blendv_epi8(o[0], o[1], lo_y), o[2], lo_z);
+		__m256i v3 = _mm256_add_epi32(_mm256_add_epi32(o[0], o[1]), o[2]);
+		__m256i i1 = _mm256_add_epi32(base, o_hi);
+		__m256i i2 = _mm256_add_epi32(base, _mm256_sub_epi32(v3, o_lo));
+		__m256i i3 = _mm256_add_epi32(base, v3);
+		for (int k = 0; k < e.n_out; k++) {
+			__m256i c0 = _mm256_i32gather_epi32(clut + k, base, 4);
+			__m256i c1 = _mm256_i32gather_epi32(clut + k, i1, 4);
+			__m256i c2 = _mm256_i32gather_epi32(clut + k, i2, 4);
+			__m256i c3 = _mm256_i32gather_epi32(clut + k, i3, 4);
+			__m256i rest = _mm256_add_epi32(_mm256_add_epi32(
+				_mm256_mullo_epi32(_mm256_sub_epi32(c1, c0), w_hi),
+				_mm256_mullo_epi32(_mm256_sub_epi32(c2, c1), w_mid)), _mm256_add_epi32(
+				_mm256_mullo_epi32(_mm256_sub_epi32(c3, c2), w_lo), _mm256_set1_epi32(0x8001)));
+			__m256i y = _mm256_add_epi32(c0, _mm256_srai_epi32(_mm256_add_epi32(rest, _mm256_srai_epi32(rest, 16)), 16));
+			y = _mm256_and_si256(y, v_ffff);
+			if (post) {
+				// Tables are padded for the 4-byte read of the last entry.
+				y = _mm256_and_si256(_mm256_i32gather_epi32((const int *)(post + k * 65536), y, 2), v_ffff);
+			}
+			alignas(32) int32_t ys[8];
+			_mm256_store_si256((__m256i *)ys, y);
+			for (int l = 0; l < 8; l++) {
+				store_sample(out + l * out_stride + k, ys[l]);
+			}
+		}
+	}
+	clut_eval_scalar(e, in, in_stride, out, out_stride, n - i);
+}
+
+bool cpu_supports(ClutIsa isa) {
+#if defined(_MSC_VER)
+	int r[4];
+	__cpuid(r, 0);
+	int n_ids = r[0];
+	__cpuid(r, 1);
+	bool sse41 = (r[2] & (1 << 19)) != 0;
+	bool os_avx = (r[2] & (1 << 27)) && (r[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;
+	bool avx2 = false;
+	if (n_ids >= 7 && os_avx) {
+		__cpuidex(r, 7, 0);
+		avx2 = (r[1] & (1 << 5)) != 0;
+	}
+#else
+	__builtin_cpu_init();
+	bool sse41 = __builtin_cpu_supports("sse4.1");
+	bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+	switch (isa) {
+	case CLUT_ISA_SSE41:
+		return sse41;
+	case CLUT_ISA_AVX2:
+		return avx2;
+	default:
+		return true;
+	}
+}
+#else
+bool cpu_supports(ClutIsa isa) {
+	return isa == CLUT_ISA_OFF || isa == CLUT_ISA_SCALAR;
+}
+#endif
+
+ClutIsa best_clut_isa() {
+	for (ClutIsa isa : {CLUT_ISA_AVX2, CLUT_ISA_SSE41}) {
+		if (cpu_supports(isa)) {
+			return isa;
+		}
+	}
+	return CLUT_ISA_SCALAR;
+}
+
+static std::atomic<int> CLUT_ISA(best_clut_isa());
+
+template <typename Out>
+void clut_eval(const ClutEngine &e, const cmsUInt16Number *in, ptrdiff_t in_stride, Out *out, ptrdiff_t out_stride, size_t n) {
+	switch (CLUT_ISA.load()) {
+#ifdef CMM_X86
+	case CLUT_ISA_AVX2:
+		clut_eval_avx2(e, in, in_stride, out, out_stride, n);
+		break;
+	case CLUT_ISA_SSE41:
+		clut_eval_sse41(e, in, in_stride, out, out_stride, n);
+		break;
+#endif
+	default:
+		clut_eval_scalar(e, in, in_stride, out, out_stride, n);
+	}
+}
+
+// Table of 65536 entries by cmsEvalToneCurve16() for each curve of a curve set stage. Empty for identity.
+// Pipelines evaluate tabulated curves in 16-bit, but segmented curves in float, so they fail.
+bool tabulate_curves(const cmsStage *stage, cmsUInt32Number n, std::vector<cmsUInt16Number> &table) {
+	if (cmsStageType(stage) != cmsSigCurveSetElemType) {
+		return false;
+	}
+	auto data = static_cast<_cmsStageToneCurvesData *>(cmsStageData(stage));
+	if (data->nCurves != n) {
+		return false;
+	}
+	table.assign(n * 65536 + 1, 0);
+	bool identity = true;
+	for (cmsUInt32Number i = 0; i < n; i++) {
+		cmsToneCurve *curve = data->TheCurves[i];
+		if (curve->nSegments != 0) {
+			return false;
+		}
+		for (cmsUInt32Number v = 0; v < 65536; v++) {
+			cmsUInt16Number y = cmsEvalToneCurve16(curve, (cmsUInt16Number)v);
+			table[i * 65536 + v] = y;
+			identity = identity && y == v;
+		}
+	}
+	if (identity) {
+		table.clear();
+	}
+	return true;
+}
+
+// Builds the engine if cmsPipelineEval16() of the pipeline is [curves] CLUT [curves] in 16-bit.
+// The float stages of the default evaluator round-trip 16-bit values exactly. NULL if not eligible.
+std::shared_ptr<ClutEngine> build_clut_engine(const cmsPipeline *lut) {
+	if (!lut || cmsPipelineInputChannels(lut) != 3) {
+		return nullptr;
+	}
+	// Interpolation plugins may replace TetrahedralInterp16().
+	auto interp_plugin = static_cast<_cmsInterpPluginChunkType *>(_cmsContextGetClientChunk(lut->ContextID, InterpPlugin));
+	if (interp_plugin && interp_plugin->Interpolators) {
+		return nullptr;
+	}
+	std::vector<cmsStage *> stages;
+	int clut_pos = -1;
+	for (cmsStage *stage = cmsPipelineGetPtrToFirstStage(lut); stage; stage = cmsStageNext(stage)) {
+		if (cmsStageType(stage) == cmsSigCLutElemType) {
+			if (clut_pos >= 0) {
+				return nullptr;
+			}
+			clut_pos = (int)stages.size();
+		}
+		stages.push_back(stage);
+	}
+	if (clut_pos < 0 || clut_pos > 1 || stages.size() - clut_pos > 2) {
+		return nullptr;
+	}
+	auto clut_data = static_cast<_cmsStageCLutData *>(cmsStageData(stages[clut_pos]));
+	const cmsInterpParams *params = clut_data->Params;
+	if (clut_data->HasFloatValues || params->nInputs != 3 || (params->dwFlags & CMS_LERP_FLAGS_TRILINEAR)) {
+		return nullptr;
+	}
+	if (lut->Data != lut) {
+		// Optimized by resampling into the CLUT alone, evaluated by Lerp16 directly.
+		if (stages.size() != 1 || lut->Data != params
+			|| reinterpret_cast<void (*)()>(lut->Eval16Fn) != reinterpret_cast<void (*)()>(params->Interpolation.Lerp16)) {
+			return nullptr;
+		}
+	}
+	auto engine = std::make_shared<ClutEngine>();
+	engine->n_out = (int)params->nOutputs;
+	for (int c = 0; c < 3; c++) {
+		if (params->Domain[c] > 255) {
+			return nullptr;
+		}
+		engine->domain[c] = (int32_t)params->Domain[c];
+		engine->opta[c] = (int32_t)params->opta[2 - c];
+	}
+	engine->clut.assign(clut_data->Tab.T, clut_data->Tab.T + clut_data->nEntries);
+	if (clut_pos == 1 && !tabulate_curves(stages[0], 3, engine->pre)) {
+		return nullptr;
+	}
+	if (clut_pos + 1 < (int)stages.size() && !tabulate_curves(stages[clut_pos + 1], params->nOutputs, engine->post)) {
+		return nullptr;
+	}
+	return engine;
+}
+
+// Chunky integer format without swaps, flavor, premultiplied alpha, or endian and Lab V2 conversions.
+// Extra channels follow the colors.
+bool is_plain_chunky(cmsUInt32Number format, cmsUInt32Number n_byte, cmsUInt32Number n_ch) {
+	return T_BYTES(format) == n_byte && T_CHANNELS(format) == n_ch && !T_FLOAT(format) && !T_PLANAR(format)
+		&& !T_DOSWAP(format) && !T_SWAPFIRST(format) && !T_FLAVOR(format)
+		&& !T_ENDIAN16(format) && !T_PREMUL(format) && T_COLORSPACE(format) != PT_LabV2;
+}
+
+// CLUT engines of transforms, built on the first large transform and dropped by destroy_transform().
+class ClutEngines {
+public:
+	std::shared_ptr<ClutEngine> get(cmsHTRANSFORM ht) {
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			auto it = engines.find(ht);
+			if (it != engines.end()) {
+				return it->second;
+			}
+		}
+		auto p = static_cast<_cmsTRANSFORM *>(ht);
+		std::shared_ptr<ClutEngine> engine;
+		// Plugin transforms, gamut check and null transforms do not go through Lut->Eval16Fn simply.
+		if (p->Lut && !p->GamutCheck && !p->UserData && !p->OldXform && !(p->dwOriginalFlags & cmsFLAGS_NULLTRANSFORM)) {
+			engine = build_clut_engine(p->Lut);
+		}
+		std::lock_guard<std::mutex> lock(mtx);
+		return engines.emplace(ht, engine).first->second;
+	}
+
+	void forget(cmsHTRANSFORM ht) {
+		std::lock_guard<std::mutex> lock(mtx);
+		engines.erase(ht);
+	}
+
+private:
+	std::mutex mtx;
+	std::map<cmsHTRANSFORM, std::shared_ptr<ClutEngine>> engines;
+};
+
+static ClutEngines CLUT_ENGINES;
+
+// CLUT engines of the LUT tags for eval_lut16(), built on the first large call. Keyed by the pipelines
+// which profiles own, so they are dropped by profile_modified() and close_profile_handle().
+class LutEngines {
+public:
+	std::shared_ptr<ClutEngine> get(cmsHPROFILE hp, const cmsPipeline *lut) {
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			auto it = engines.find(lut);
+			if (it != engines.end()) {
+				return it->second.engine;
+			}
+		}
+		auto engine = build_clut_engine(lut);
+		std::lock_guard<std::mutex> lock(mtx);
+		return engines.emplace(lut, Entry{hp, engine}).first->second.engine;
+	}
+
+	void forget_profile(cmsHPROFILE hp) {
+		std::lock_guard<std::mutex> lock(mtx);
+		for (auto it = engines.begin(); it != engines.end();) {
+			it = it->second.hp == hp ? engines.erase(it) : std::next(it);
+		}
+	}
+
+private:
+	struct Entry {
+		cmsHPROFILE hp;
+		std::shared_ptr<ClutEngine> engine;
+	};
+
+	std::mutex mtx;
+	std::map<const cmsPipeline *, Entry> engines;
+};
+
+static LutEngines LUT_ENGINES;
+
+// cmsFLAGS_COPY_ALPHA of Little-CMS on the pixels of the CLUT engine.
+template <typename Out>
+void copy_extra(const cmsUInt16Number *in, ptrdiff_t in_stride, Out *out, ptrdiff_t out_stride, int n_extra, size_t n) {
+	for (int k = 0; k < n_extra; k++) {
+		for (size_t i = 0; i < n; i++) {
+			store_sample(out + i * out_stride + k, in[i * in_stride + k]);
+		}
+	}
+}
+
+// Engine for 16-bit input and 16 or 8-bit output of the transform. NULL if not eligible.
+std::shared_ptr<ClutEngine> get_transform_clut_engine(cmsHTRANSFORM ht, cmsUInt32Number num_pixel) {
+	if (CLUT_ISA.load() == CLUT_ISA_OFF || num_pixel < CLUT_ENGINE_MIN_PIXELS) {
+		return nullptr;
+	}
+	cmsUInt32Number in_fmt = cmsGetTransformInputFormat(ht);
+	cmsUInt32Number out_fmt = cmsGetTransformOutputFormat(ht);
+	if (!is_plain_chunky(in_fmt, 2, 3) || (T_BYTES(out_fmt) != 1 && T_BYTES(out_fmt) != 2)) {
+		return nullptr;
+	}
+	auto engine = CLUT_ENGINES.get(ht);
+	if (!engine || !is_plain_chunky(out_fmt, T_BYTES(out_fmt), engine->n_out)) {
+		return nullptr;
+	}
+	return engine;
+}
+
+// Opt-in instrumentation. When disabled, the hot paths only load the enabled flag.
+struct StatsCounter {
+	std::atomic<uint64_t> calls{0}, amount{0}, ns{0}, max_ns{0};
+
+	void add(uint64_t n, uint64_t elapsed_ns) {
+		calls.fetch_add(1, std::memory_order_relaxed);
+		amount.fetch_add(n, std::memory_order_relaxed);
+		ns.fetch_add(elapsed_ns, std::memory_order_relaxed);
+		uint64_t m = max_ns.load(std::memory_order_relaxed);
+		while (elapsed_ns > m && !max_ns.compare_exchange_weak(m, elapsed_ns, std::memory_order_relaxed)) {
+		}
+	}
+
+	void reset() {
+		calls = 0;
+		amount = 0;
+		ns = 0;
+		max_ns = 0;
+	}
+
+	py::dict info(const char *amount_name) const {
+		py::dict d("calls"_a = calls.load(), "ns"_a = ns.load(), "max_ns"_a = max_ns.load());
+		if (amount_name) {
+			d[amount_name] = amount.load();
+		}
+		return d;
+	}
+};
+
+class Stats {
+public:
+	std::atomic<bool> enabled{false};
+	StatsCounter transform, create, open_profile;
+
+	static uint64_t now() {
+		return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	void add_transform(cmsHTRANSFORM ht, uint64_t n_pixel, uint64_t elapsed_ns) {
+		transform.add(n_pixel, elapsed_ns);
+		std::lock_guard<std::mutex> lock(mtx);
+		auto &t = per_transform[ht];
+		t.calls++;
+		t.pixels += n_pixel;
+		t.ns += elapsed_ns;
+	}
+
+	py::object transform_info(cmsHTRANSFORM ht) {
+		std::lock_guard<std::mutex> lock(mtx);
+		auto it = per_transform.find(ht);
+		if (it == per_transform.end()) {
+			return py::none();
+		}
+		return py::dict("calls"_a = it->second.calls, "pixels"_a = it->second.pixels, "ns"_a = it->second.ns);
+	}
+
+	void forget(cmsHTRANSFORM ht) {
+		std::lock_guard<std::mutex> lock(mtx);
+		per_transform.erase(ht);
+	}
+
+	void reset() {
+		transform.reset();
+		create.reset();
+		open_profile.reset();
+		std::lock_guard<std::mutex> lock(mtx);
+		per_transform.clear();
+	}
+
+private:
+	struct TransformStats {
+		uint64_t calls = 0, pixels = 0, ns = 0;
+	};
+
+	std::mutex mtx;
+	std::map<cmsHTRANSFORM, TransformStats> per_transform;
+};
+
+static Stats STATS;
+
+// Measures the scope into the counter, if stats are enabled at the start.
+class StatsScope {
+public:
+	StatsScope(StatsCounter &counter, uint64_t amount, cmsHTRANSFORM ht = NULL)
+		: counter(counter), amount(amount), ht(ht), start(STATS.enabled.load(std::memory_order_relaxed) ? Stats::now() : 0) {}
+
+	~StatsScope() {
+		if (!start) {
+			return;
+		}
+		uint64_t elapsed = Stats::now() - start;
+		if (ht) {
+			STATS.add_transform(ht, amount, elapsed);
+		} else {
+			counter.add(amount, elapsed);
+		}
+	}
+
+	StatsScope(const StatsScope &) = delete;
+	StatsScope &operator=(const StatsScope &) = delete;
+
+private:
+	StatsCounter &counter;
+	uint64_t amount;
+	cmsHTRANSFORM ht;
+	uint64_t start;
+};
+
+// Deletes a transform with its side data.
+void destroy_transform(cmsHTRANSFORM ht) {
+	CLUT_ENGINES.forget(ht);
+	STATS.forget(ht);
+	cmsDeleteTransform(ht);
+}
+
+void transform_pixels(cmsHTRANSFORM ht, const void *input, void *output, cmsUInt32Number num_pixel) {
+	StatsScope stats(STATS.transform, num_pixel, ht);
+	cmsUInt32Number in_fmt = cmsGetTransformInputFormat(ht);
+	cmsUInt32Number out_fmt = cmsGetTransformOutputFormat(ht);
+	int n_threads;
+	size_t min_tile;
+	if (T_PLANAR(in_fmt) || T_PLANAR(out_fmt) || !get_transform_threads(ht, n_threads, min_tile)) {
+		cmsDoTransform(ht, input, output, num_pixel);
+		return;
+	}
+	auto engine = get_transform_clut_engine(ht, num_pixel);
+	if (engine) {
+		auto in = static_cast<const cmsUInt16Number *>(input);
+		int in_stride = 3 + T_EXTRA(in_fmt);
+		int n_out = engine->n_out;
+		int out_stride = n_out + T_EXTRA(out_fmt);
+		// As Little-CMS, extra channels are copied only if asked and the numbers match.
+		bool copy_alpha = (static_cast<_cmsTRANSFORM *>(ht)->dwOriginalFlags & cmsFLAGS_COPY_ALPHA) && T_EXTRA(in_fmt) == T_EXTRA(out_fmt);
+		int n_copy = copy_alpha ? T_EXTRA(in_fmt) : 0;
+		parallel_for(num_pixel, n_threads, min_tile, [&](size_t begin, size_t end) {
+			if (T_BYTES(out_fmt) == 2) {
+				auto out = static_cast<cmsUInt16Number *>(output) + begin * out_stride;
+				clut_eval(*engine, in + begin * in_stride, in_stride, out, out_stride, end - begin);
+				copy_extra(in + begin * in_stride + 3, in_stride, out + n_out, out_stride, n_copy, end - begin);
+			} else {
+				auto out = static_cast<cmsUInt8Number *>(output) + begin * out_stride;
+				clut_eval(*engine, in + begin * in_stride, in_stride, out, out_stride, end - begin);
+				copy_extra(in + begin * in_stride + 3, in_stride, out + n_out, out_stride, n_copy, end - begin);
+			}
+		});
+		return;
+	}
+	auto in_ps = pixel_size(in_fmt);
+	auto out_ps = pixel_size(out_fmt);
+	parallel_for(num_pixel, n_threads, min_tile, [=](size_t begin, size_t end) {
+		cmsDoTransform(ht,
+			static_cast<const cmsUInt8Number *>(input) + begin * in_ps,
+			static_cast<cmsUInt8Number *>(output) + begin * out_ps,
+			(cmsUInt32Number)(end - begin));
+	});
+}
+
+// Geometry of an image buffer for cmsDoTransformLineStride().
+struct ImageLayout {
+	cmsUInt32Number width, height;
+	cmsUInt32Number bytes_per_line, bytes_per_plane;
+};
+
+// Reads the layout from the shape and strides. Chunky formats take (height, width, channels),
+// planar formats take (channels, height, width). (height, width) is allowed for one channel.
+// False for strides by which rows or planes overlap.
+bool get_image_layout(const py::array &a, cmsUInt32Number format, ImageLayout &layout) {
+	size_t n_byte = T_BYTES(format) ? T_BYTES(format) : sizeof(cmsFloat64Number);
+	size_t n_ch = T_CHANNELS(format) + T_EXTRA(format);
+	bool is_float_dtype = a.dtype().kind() == 'f';
+	if ((size_t)a.itemsize() != n_byte || is_float_dtype != (T_FLOAT(format) != 0)) {
+		return false;
+	}
+	auto ndim = a.ndim();
+	if (ndim != 3 && !(ndim == 2 && n_ch == 1)) {
+		return false;
+	}
+	bool planar = T_PLANAR(format) != 0;
+	py::ssize_t shape[3], strides[3];
+	if (ndim == 3) {
+		for (int i = 0; i < 3; i++) {
+			shape[i] = a.shape(i);
+			strides[i] = a.strides(i);
+		}
+	} else if (planar) {
+		shape[0] = 1;
+		strides[0] = 0;
+		for (int i = 0; i < 2; i++) {
+			shape[i + 1] = a.shape(i);
+			strides[i + 1] = a.strides(i);
+		}
+	} else {
+		for (int i = 0; i < 2; i++) {
+			shape[i] = a.shape(i);
+			strides[i] = a.strides(i);
+		}
+		shape[2] = 1;
+		strides[2] = (py::ssize_t)n_byte;
+	}
+	// Strides of dimensions of size 1 are never used.
+	auto stride_ok = [&](int i, py::ssize_t expected) {
+		return shape[i] == 1 || (expected ? strides[i] == expected : strides[i] > 0);
+	};
+	const py::ssize_t max_stride = 0xFFFFFFFF;
+	if (planar) {
+		if (shape[0] != (py::ssize_t)n_ch || !stride_ok(2, (py::ssize_t)n_byte) || !stride_ok(1, 0) || !stride_ok(0, 0)) {
+			return false;
+		}
+		layout.height = (cmsUInt32Number)shape[1];
+		layout.width = (cmsUInt32Number)shape[2];
+		layout.bytes_per_line = shape[1] == 1 ? (cmsUInt32Number)(shape[2] * n_byte) : (cmsUInt32Number)strides[1];
+		layout.bytes_per_plane = shape[0] == 1 ? 0 : (cmsUInt32Number)strides[0];
+		if (strides[0] > max_stride || strides[1] > max_stride) {
+			return false;
+		}
+		// No overlap: the rows of a plane, and the planes one after another or interleaved by rows.
+		py::ssize_t line = shape[2] * (py::ssize_t)n_byte;
+		py::ssize_t row_stride = shape[1] == 1 ? line : strides[1];
+		if (row_stride < line) {
+			return false;
+		}
+		if (shape[0] > 1 && strides[0] < (shape[1] - 1) * row_stride + line
+			&& !(strides[0] >= line && (shape[0] - 1) * strides[0] + line <= row_stride)) {
+			return false;
+		}
+	} else {
+		if (shape[2] != (py::ssize_t)n_ch || !stride_ok(2, (py::ssize_t)n_byte) || !stride_ok(1, (py::ssize_t)(n_ch * n_byte)) || !stride_ok(0, 0)) {
+			return false;
+		}
+		layout.height = (cmsUInt32Number)shape[0];
+		layout.width = (cmsUInt32Number)shape[1];
+		layout.bytes_per_line = shape[0] == 1 ? (cmsUInt32Number)(shape[1] * n_ch * n_byte) : (cmsUInt32Number)strides[0];
+		layout.bytes_per_plane = 0;
+		if (strides[0] > max_stride) {
+			return false;
+		}
+		// No overlap of the rows; tiles of rows are written in parallel.
+		if (shape[0] > 1 && strides[0] < shape[1] * (py::ssize_t)(n_ch * n_byte)) {
+			return false;
+		}
+	}
+	return shape[0] * shape[1] * shape[2] <= max_stride;
+}
+
+void transform_image(cmsHTRANSFORM ht, const void *input, const ImageLayout &in_layout, void *output, const ImageLayout &out_layout) {
+	auto width = in_layout.width;
+	StatsScope stats(STATS.transform, (uint64_t)width * in_layout.height, ht);
+	int n_threads;
+	size_t min_tile;
+	if (!get_transform_threads(ht, n_threads, min_tile) || width == 0) {
+		cmsDoTransformLineStride(ht, input, output, width, in_layout.height,
+			in_layout.bytes_per_line, out_layout.bytes_per_line, in_layout.bytes_per_plane, out_layout.bytes_per_plane);
+		return;
+	}
+	size_t min_rows = (min_tile + width - 1) / width;
+	parallel_for(in_layout.height, n_threads, min_rows, [&](size_t begin, size_t end) {
+		cmsDoTransformLineStride(ht,
+			static_cast<const cmsUInt8Number *>(input) + begin * in_layout.bytes_per_line,
+			static_cast<cmsUInt8Number *>(output) + begin * out_layout.bytes_per_line,
+			width, (cmsUInt32Number)(end - begin),
+			in_layout.bytes_per_line, out_layout.bytes_per_line, in_layout.bytes_per_plane, out_layout.bytes_per_plane);
+	});
+}
+
+// Geometry of a (height, width) gamut mask of uint8 or uint16.
+struct MaskLayout {
+	cmsUInt32Number width, height, n_byte;
+	ptrdiff_t row_stride, pixel_stride;
+};
+
+bool get_mask_layout(const py::array &a, MaskLayout &layout) {
+	if (a.ndim() != 2 || a.dtype().kind() != 'u' || (a.itemsize() != 1 && a.itemsize() != 2) || !a.writeable()) {
+		return false;
+	}
+	layout.height = (cmsUInt32Number)a.shape(0);
+	layout.width = (cmsUInt32Number)a.shape(1);
+	layout.n_byte = (cmsUInt32Number)a.itemsize();
+	layout.row_stride = a.strides(0);
+	layout.pixel_stride = a.strides(1);
+	return true;
+}
+
+// 16-bit proofing transform with cmsFLAGS_GAMUTCHECK evaluated pixel by pixel like
+// TransformOnePixelWithGamutCheck() of Little-CMS, writing the result of the gamut check to the mask.
+// Out-of-gamut pixels get alarm_codes if given, otherwise the proof colors.
+bool transform_gamut_mask(cmsHTRANSFORM ht, const void *input, const ImageLayout &in_layout, void *output, const ImageLayout &out_layout,
+	void *mask, const MaskLayout &mask_layout, const cmsUInt16Number *alarm_codes) {
+	auto p = static_cast<_cmsTRANSFORM *>(ht);
+	if (!p->Lut || !p->GamutCheck || !p->FromInput || !p->ToOutput
+		|| T_PLANAR(p->InputFormat) || T_PLANAR(p->OutputFormat)) {
+		return false;
+	}
+	auto width = in_layout.width;
+	StatsScope stats(STATS.transform, (uint64_t)width * in_layout.height, ht);
+	cmsStride stride = {in_layout.bytes_per_line, out_layout.bytes_per_line, 0, 0};
+	bool copy_alpha = (p->dwOriginalFlags & cmsFLAGS_COPY_ALPHA) != 0;
+	auto rows = [&](size_t begin, size_t end) {
+		cmsUInt16Number w_in[cmsMAXCHANNELS] = {0}, w_out[cmsMAXCHANNELS] = {0}, out_of_gamut;
+		for (size_t y = begin; y < end; y++) {
+			auto in_line = static_cast<const cmsUInt8Number *>(input) + y * in_layout.bytes_per_line;
+			auto out_line = static_cast<cmsUInt8Number *>(output) + y * out_layout.bytes_per_line;
+			auto mask_line = static_cast<cmsUInt8Number *>(mask) + y * mask_layout.row_stride;
+			auto accum = const_cast<cmsUInt8Number *>(in_line);
+			auto out = out_line;
+			for (cmsUInt32Number x = 0; x < width; x++) {
+				accum = p->FromInput(p, w_in, accum, 0);
+				cmsPipelineEval16(w_in, &out_of_gamut, p->GamutCheck);
+				if (out_of_gamut >= 1 && alarm_codes) {
+					memcpy(w_out, alarm_codes, sizeof(cmsUInt16Number) * p->Lut->OutputChannels);
+				} else {
+					cmsPipelineEval16(w_in, w_out, p->Lut);
+				}
+				out = p->ToOutput(p, w_out, out, 0);
+				auto m = mask_line + x * mask_layout.pixel_stride;
+				if (mask_layout.n_byte == 1) {
+					*m = out_of_gamut ? 255 : 0;
+				} else {
+					*reinterpret_cast<cmsUInt16Number *>(m) = out_of_gamut;
+				}
+			}
+			if (copy_alpha) {
+				_cmsHandleExtraChannels(p, in_line, out_line, width, 1, &stride);
+			}
+		}
+	};
+	int n_threads;
+	size_t min_tile;
+	if (!get_transform_threads(ht, n_threads, min_tile) || width == 0) {
+		rows(0, in_layout.height);
+	} else {
+		parallel_for(in_layout.height, n_threads, (min_tile + width - 1) / width, rows);
+	}
+	return true;
+}
+
+// Unique pixel values of up to 8 bytes for do_transform_dedup(). Open addressing, never shrinks.
+class PixelPalette {
+public:
+	explicit PixelPalette(size_t max_unique) : max_unique(max_unique) {
+		size_t capacity = 16;
+		shift = 60;
+		while (capacity < max_unique * 2) {
+			capacity <<= 1;
+			shift--;
+		}
+		mask = capacity - 1;
+		keys.resize(capacity);
+		slots.assign(capacity, EMPTY);
+	}
+
+	// Adds the value if new. False if it makes more than max_unique values.
+	bool add(uint64_t key) {
+		for (size_t i = slot(key);; i = (i + 1) & mask) {
+			if (slots[i] == EMPTY) {
+				if (values.size() >= max_unique) {
+					return false;
+				}
+				slots[i] = (uint32_t)values.size();
+				keys[i] = key;
+				values.push_back(key);
+				return true;
+			}
+			if (keys[i] == key) {
+				return true;
+			}
+		}
+	}
+
+	// Index of an added value.
+	uint32_t find(uint64_t key) const {
+		for (size_t i = slot(key);; i = (i + 1) & mask) {
+			if (keys[i] == key && slots[i] != EMPTY) {
+				return slots[i];
+			}
+		}
+	}
+
+	std::vector<uint64_t> values;  // In the order of addition
+
+private:
+	enum : uint32_t { EMPTY = 0xFFFFFFFF };
+	size_t max_unique, mask;
+	int shift;
+	std::vector<uint64_t> keys;
+	std::vector<uint32_t> slots;
+
+	size_t slot(uint64_t key) const {
+		return (size_t)((key * 0x9E3779B97F4A7C15ULL) >> shift);
+	}
+};
+
+inline uint64_t load_pixel_key(const cmsUInt8Number *p, size_t n) {
+	uint64_t key = 0;
+	memcpy(&key, p, n);
+	return key;
+}
+
+// Transforms only the unique colors of the image and scatters them. Output extra channels are
+// written only when they are copied from the input by cmsFLAGS_COPY_ALPHA, otherwise dst keeps them
+// as transform_image() does. False without writing anything if not eligible or there are more than
+// max_unique colors.
+bool transform_dedup(cmsHTRANSFORM ht, const void *input, const ImageLayout &in_layout, void *output, const ImageLayout &out_layout, size_t max_unique) {
+	auto in_fmt = cmsGetTransformInputFormat(ht);
+	auto out_fmt = cmsGetTransformOutputFormat(ht);
+	size_t in_ps = pixel_size(in_fmt), out_ps = pixel_size(out_fmt);
+	auto p = static_cast<_cmsTRANSFORM *>(ht);
+	bool copies_extra = (p->dwOriginalFlags & cmsFLAGS_COPY_ALPHA) && T_EXTRA(in_fmt) == T_EXTRA(out_fmt);
+	if (T_PLANAR(in_fmt) || T_PLANAR(out_fmt) || in_ps > sizeof(uint64_t) || max_unique == 0 || max_unique > 0xFFFFFFF
+		|| !(T_EXTRA(out_fmt) == 0 || copies_extra)) {
+		return false;
+	}
+	auto width = in_layout.width, height = in_layout.height;
+	int n_threads;
+	size_t min_tile;
+	bool threaded = get_transform_threads(ht, n_threads, min_tile) && width != 0;
+	size_t tile_rows = threaded ? (min_tile + width - 1) / width : 0;
+
+	// Adds the colors of rows [begin, end) to a palette. False if there are too many.
+	std::atomic<bool> too_many{false};
+	auto scan = [&](PixelPalette &palette, size_t begin, size_t end) {
+		for (size_t y = begin; y < end && !too_many; y++) {
+			auto in = static_cast<const cmsUInt8Number *>(input) + y * in_layout.bytes_per_line;
+			uint64_t last = 0;
+			for (size_t x = 0; x < width; x++, in += in_ps) {
+				uint64_t key = load_pixel_key(in, in_ps);
+				// Runs of the same color are common in flat graphics.
+				if ((x == 0 || key != last) && !palette.add(key)) {
+					too_many = true;
+					return false;
+				}
+				last = key;
+			}
+		}
+		return !too_many;
+	};
+	// A palette never holds more colors than the pixels it scans.
+	PixelPalette palette(std::min(max_unique, width * height));
+	if (!threaded) {
+		if (!scan(palette, 0, height)) {
+			return false;
+		}
+	} else {
+		// Tiles collect their own colors without locks, and merge them once each. The scan reads the
+		// whole image like the scatter, so it is tiled the same way.
+		std::mutex mtx;
+		parallel_for(height, n_threads, tile_rows, [&](size_t begin, size_t end) {
+			PixelPalette tile(std::min(max_unique, width * (end - begin)));
+			if (!scan(tile, begin, end)) {
+				return;
+			}
+			std::lock_guard<std::mutex> lock(mtx);
+			for (auto key : tile.values) {
+				if (too_many || !palette.add(key)) {
+					too_many = true;
+					return;
+				}
+			}
+		});
+		if (too_many) {
+			return false;
+		}
+	}
+	StatsScope stats(STATS.transform, (uint64_t)width * height, ht);
+	size_t n_unique = palette.values.size();
+	std::vector<cmsUInt8Number> colors_in(n_unique * in_ps), colors_out(n_unique * out_ps);
+	for (size_t i = 0; i < n_unique; i++) {
+		memcpy(&colors_in[i * in_ps], &palette.values[i], in_ps);
+	}
+	if (n_unique) {
+		cmsDoTransform(ht, colors_in.data(), colors_out.data(), (cmsUInt32Number)n_unique);
+	}
+	auto scatter = [&](size_t begin, size_t end) {
+		for (size_t y = begin; y < end; y++) {
+			auto in = static_cast<const cmsUInt8Number *>(input) + y * in_layout.bytes_per_line;
+			auto out = static_cast<cmsUInt8Number *>(output) + y * out_layout.bytes_per_line;
+			uint64_t last = 0;
+			const cmsUInt8Number *color = NULL;
+			for (size_t x = 0; x < width; x++, in += in_ps, out += out_ps) {
+				uint64_t key = load_pixel_key(in, in_ps);
+				if (!color || key != last) {
+					color = &colors_out[palette.find(key) * out_ps];
+					last = key;
+				}
+				memcpy(out, color, out_ps);
+			}
+		}
+	};
+	if (!threaded) {
+		scatter(0, height);
+	} else {
+		parallel_for(height, n_threads, tile_rows, scatter);
+	}
+	return true;
+}
+
+bool parse_delta_e_method(const std::string &name, DeltaEMethod &method) {
+	static const std::map<std::string, DeltaEMethod> methods = {
+		{"76", DELTA_E_76}, {"94", DELTA_E_94}, {"2000", DELTA_E_2000}, {"CMC", DELTA_E_CMC},
+	};
+	auto it = methods.find(name);
+	if (it == methods.end()) {
+		return false;
+	}
+	method = it->second;
+	return true;
+}
+
+// Summary of DeltaE. Each chunk is summed in two passes, and merged by the formula of Chan et al.,
+// not to lose the spread around a large mean.
+struct DeltaEStats {
+	size_t count = 0;
+	cmsFloat64Number mean = 0, m2 = 0, max = 0;  // m2: sum of squared deviations from the mean
+
+	void add(const cmsFloat64Number *d, size_t n) {
+		if (!n) {
+			return;
+		}
+		DeltaEStats chunk;
+		chunk.count = n;
+		cmsFloat64Number sum = 0;
+		for (size_t i = 0; i < n; i++) {
+			sum += d[i];
+			chunk.max = std::max(chunk.max, d[i]);
+		}
+		chunk.mean = sum / n;
+		for (size_t i = 0; i < n; i++) {
+			cmsFloat64Number dev = d[i] - chunk.mean;
+			chunk.m2 += dev * dev;
+		}
+		merge(chunk);
+	}
+
+	void merge(const DeltaEStats &o) {
+		if (!o.count) {
+			return;
+		}
+		size_t n = count + o.count;
+		cmsFloat64Number delta = o.mean - mean;
+		mean += delta * o.count / n;
+		m2 += o.m2 + delta * delta * ((cmsFloat64Number)count * o.count / n);
+		count = n;
+		max = std::max(max, o.max);
+	}
+
+	py::dict dict() const {
+		cmsFloat64Number var = count ? m2 / count : 0;
+		return py::dict("count"_a = count, "mean"_a = mean, "std"_a = std::sqrt(var), "max"_a = max);
+	}
+};
+
+// DeltaEStats of the tiles of parallel_for(), merged in the order of the tiles, not in the order
+// they finish, so that the result is the same for each run.
+class DeltaETiles {
+public:
+	void add(size_t begin, const DeltaEStats &tile) {
+		std::lock_guard<std::mutex> lock(mtx);
+		tiles[begin] = tile;
+	}
+
+	DeltaEStats merged() const {
+		DeltaEStats stats;
+		for (auto &tile : tiles) {
+			stats.merge(tile.second);
+		}
+		return stats;
+	}
+
+private:
+	std::mutex mtx;
+	std::map<size_t, DeltaEStats> tiles;
+};
+
+// Lab of n float32 or float64 chunky pixels from i into a chunk.
+inline void load_lab_chunk(const void *buf, bool is_double, size_t i, size_t n,
+	cmsFloat64Number *L, cmsFloat64Number *a, cmsFloat64Number *b) {
+	if (is_double) {
+		auto p = static_cast<const cmsFloat64Number *>(buf) + i * 3;
+		for (size_t k = 0; k < n; k++) {
+			L[k] = p[k * 3];
+			a[k] = p[k * 3 + 1];
+			b[k] = p[k * 3 + 2];
+		}
+	} else {
+		auto p = static_cast<const cmsFloat32Number *>(buf) + i * 3;
+		for (size_t k = 0; k < n; k++) {
+			L[k] = p[k * 3];
+			a[k] = p[k * 3 + 1];
+			b[k] = p[k * 3 + 2];
+		}
+	}
+}
+
+inline void store_delta_e(void *out, bool is_double, size_t i, const cmsFloat64Number *d, size_t n) {
+	if (is_double) {
+		std::copy(d, d + n, static_cast<cmsFloat64Number *>(out) + i);
+	} else {
+		auto p = static_cast<cmsFloat32Number *>(out) + i;
+		for (size_t k = 0; k < n; k++) {
+			p[k] = (cmsFloat32Number)d[k];
+		}
+	}
+}
+
+// DeltaE of n Lab pairs. out may be NULL.
+DeltaEStats delta_e_pixels(const DeltaEParams &p, const void *lab1, const void *lab2, bool lab_double,
+	void *out, bool out_double, size_t n, int n_threads) {
+	DeltaEKernel kernel = get_delta_e_kernel(p.method);
+	DeltaETiles tiles;
+	parallel_for(n, n_threads, MIN_PIXELS_PER_TILE, [&](size_t begin, size_t end) {
+		DeltaEStats tile;
+		LabChunk c;
+		cmsFloat64Number d[DELTA_E_CHUNK];
+		for (size_t i = begin; i < end; i += DELTA_E_CHUNK) {
+			size_t m = std::min(DELTA_E_CHUNK, end - i);
+			load_lab_chunk(lab1, lab_double, i, m, c.L1, c.a1, c.b1);
+			load_lab_chunk(lab2, lab_double, i, m, c.L2, c.a2, c.b2);
+			kernel(p, c, m, d);
+			if (out) {
+				store_delta_e(out, out_double, i, d, m);
+			}
+			tile.add(d, m);
+		}
+		tiles.add(begin, tile);
+	});
+	return tiles.merged();
+}
+
+// Float Lab chunky output format without extra channels.
+bool is_float_lab(cmsUInt32Number format) {
+	return T_COLORSPACE(format) == PT_Lab && T_FLOAT(format) && (T_BYTES(format) == 0 || T_BYTES(format) == 4)
+		&& T_CHANNELS(format) == 3 && !T_EXTRA(format) && !T_PLANAR(format) && !T_DOSWAP(format) && !T_SWAPFIRST(format);
+}
+
+// DeltaE between the outputs of two transforms to float Lab, chunk by chunk without the Lab images.
+// out is (height, width) of float32 or float64 with row_stride in bytes, or NULL.
+DeltaEStats delta_e_transforms(const DeltaEParams &p,
+	cmsHTRANSFORM ht1, const void *input1, const ImageLayout &layout1,
+	cmsHTRANSFORM ht2, const void *input2, const ImageLayout &layout2,
+	void *out, bool out_double, ptrdiff_t out_row_stride) {
+	bool double1 = T_BYTES(cmsGetTransformOutputFormat(ht1)) == 0;
+	bool double2 = T_BYTES(cmsGetTransformOutputFormat(ht2)) == 0;
+	auto in_step = [](cmsHTRANSFORM ht) {
+		auto format = cmsGetTransformInputFormat(ht);
+		size_t n_byte = T_BYTES(format) ? T_BYTES(format) : sizeof(cmsFloat64Number);
+		return T_PLANAR(format) ? n_byte : n_byte * (T_CHANNELS(format) + T_EXTRA(format));
+	};
+	size_t step1 = in_step(ht1), step2 = in_step(ht2);
+	auto width = layout1.width;
+	int n_threads;
+	size_t min_tile;
+	if (!get_transform_threads(ht1, n_threads, min_tile)) {
+		n_threads = 1;
+	}
+	DeltaEKernel kernel = get_delta_e_kernel(p.method);
+	DeltaETiles tiles;
+	parallel_for(layout1.height, n_threads, (min_tile + width - 1) / std::max(width, (cmsUInt32Number)1), [&](size_t begin, size_t end) {
+		DeltaEStats tile;
+		cmsFloat64Number buf1[DELTA_E_CHUNK * 3], buf2[DELTA_E_CHUNK * 3];
+		LabChunk c;
+		cmsFloat64Number d[DELTA_E_CHUNK];
+		for (size_t y = begin; y < end; y++) {
+			auto in1 = static_cast<const cmsUInt8Number *>(input1) + y * layout1.bytes_per_line;
+			auto in2 = static_cast<const cmsUInt8Number *>(input2) + y * layout2.bytes_per_line;
+			for (size_t x = 0; x < width; x += DELTA_E_CHUNK) {
+				auto n = (cmsUInt32Number)std::min(DELTA_E_CHUNK, width - x);
+				cmsDoTransformLineStride(ht1, in1 + x * step1, buf1, n, 1, layout1.bytes_per_line, (cmsUInt32Number)sizeof(buf1), layout1.bytes_per_plane, 0);
+				cmsDoTransformLineStride(ht2, in2 + x * step2, buf2, n, 1, layout2.bytes_per_line, (cmsUInt32Number)sizeof(buf2), layout2.bytes_per_plane, 0);
+				load_lab_chunk(buf1, double1, 0, n, c.L1, c.a1, c.b1);
+				load_lab_chunk(buf2, double2, 0, n, c.L2, c.a2, c.b2);
+				kernel(p, c, n, d);
+				if (out) {
+					store_delta_e(static_cast<cmsUInt8Number *>(out) + y * out_row_stride, out_double, x, d, n);
+				}
+				tile.add(d, n);
+			}
+		}
+		tiles.add(begin, tile);
+	});
+	return tiles.merged();
+}
+
+// Read-only IO handler on a Python buffer. Little-CMS reads tags lazily, so the buffer is
+// kept until the profile is closed.
+struct BufferIO {
+	Py_buffer view;
+	bool has_view = false;
+	cmsUInt32Number pos = 0;
+
+	// Needs the GIL if has_view.
+	~BufferIO() {
+		if (has_view) {
+			PyBuffer_Release(&view);
+		}
+	}
+};
+
+cmsUInt32Number BufferIORead(cmsIOHANDLER *io, void *buffer, cmsUInt32Number size, cmsUInt32Number count) {
+	auto b = static_cast<BufferIO *>(io->stream);
+	cmsUInt64Number len = (cmsUInt64Number)size * count;
+	if (b->pos + len > io->ReportedSize) {
+		cmsSignalError(io->ContextID, cmsERROR_READ, "Read from memory error");
+		return 0;
+	}
+	memcpy(buffer, static_cast<const cmsUInt8Number *>(b->view.buf) + b->pos, (size_t)len);
+	b->pos += (cmsUInt32Number)len;
+	return count;
+}
+
+cmsBool BufferIOSeek(cmsIOHANDLER *io, cmsUInt32Number offset) {
+	if (offset > io->ReportedSize) {
+		cmsSignalError(io->ContextID, cmsERROR_SEEK, "Too few data; probably corrupted profile");
+		return FALSE;
+	}
+	static_cast<BufferIO *>(io->stream)->pos = offset;
+	return TRUE;
 }
 
-typedef union {
-	char s[5];
-	cmsTagSignature tag;
-} tag_str;
+cmsUInt32Number BufferIOTell(cmsIOHANDLER *io) {
+	return static_cast<BufferIO *>(io->stream)->pos;
+}
+
+cmsBool BufferIOWrite(cmsIOHANDLER *io, cmsUInt32Number size, const void *buffer) {
+	return FALSE;
+}
+
+cmsBool BufferIOClose(cmsIOHANDLER *io) {
+	auto b = static_cast<BufferIO *>(io->stream);
+	{
+		py::gil_scoped_acquire acquire;
+		delete b;
+	}
+	delete io;
+	return TRUE;
+}
+
+cmsHPROFILE open_profile_from_buffer(py::buffer buf) {
+	StatsScope stats(STATS.open_profile, 1);
+	// Owned here until the handler is passed to Little-CMS.
+	std::unique_ptr<BufferIO> b(new BufferIO());
+	if (PyObject_GetBuffer(buf.ptr(), &b->view, PyBUF_SIMPLE) != 0) {
+		throw py::error_already_set();
+	}
+	b->has_view = true;
+	if ((cmsUInt64Number)b->view.len > 0xFFFFFFFF) {
+		return NULL;
+	}
+	std::unique_ptr<cmsIOHANDLER> io(new cmsIOHANDLER());
+	io->stream = b.get();
+	io->ContextID = NULL;
+	io->ReportedSize = (cmsUInt32Number)b->view.len;
+	io->Read = BufferIORead;
+	io->Seek = BufferIOSeek;
+	io->Close = BufferIOClose;
+	io->Tell = BufferIOTell;
+	io->Write = BufferIOWrite;
+	// The handler is closed by Little-CMS even if it fails.
+	b.release();
+	return cmsOpenProfileFromIOhandlerTHR(NULL, io.release());
+}
+
+#ifdef _WIN32
+using NativePath = std::wstring;
+#else
+using NativePath = std::string;
+#endif
+
+// Path for the C runtime. Wide on Windows, because narrow paths are in the ANSI code page there.
+NativePath native_path(py::object path) {
+	auto os = py::module_::import("os");
+#ifdef _WIN32
+	return os.attr("fsdecode")(path).cast<std::wstring>();
+#else
+	return os.attr("fsencode")(path).cast<std::string>();
+#endif
+}
+
+FILE *open_native_file(const NativePath &path, bool write) {
+#ifdef _WIN32
+	return _wfopen(path.c_str(), write ? L"wb" : L"rb");
+#else
+	return fopen(path.c_str(), write ? "wb" : "rb");
+#endif
+}
+
+// fseek() and ftell() with 64-bit offsets, as long is 32-bit on Windows. -1 if the offset does not fit.
+int seek_native_file(FILE *f, cmsUInt64Number offset, int origin) {
+#ifdef _WIN32
+	return offset > (cmsUInt64Number)std::numeric_limits<__int64>::max() ? -1 : _fseeki64(f, (__int64)offset, origin);
+#else
+	return offset > (cmsUInt64Number)std::numeric_limits<off_t>::max() ? -1 : fseeko(f, (off_t)offset, origin);
+#endif
+}
+
+cmsInt64Number tell_native_file(FILE *f) {
+#ifdef _WIN32
+	return _ftelli64(f);
+#else
+	return ftello(f);
+#endif
+}
+
+// IO handler of Little-CMS on a file opened by open_native_file(). NULL if the file cannot be opened.
+cmsIOHANDLER *open_native_io_handler(cmsContext context, const NativePath &path, bool write) {
+	FILE *f = open_native_file(path, write);
+	if (!f) {
+		cmsSignalError(context, cmsERROR_FILE, write ? "Couldn't create the file" : "File not found");
+		return NULL;
+	}
+	cmsIOHANDLER *io = cmsOpenIOhandlerFromStream(context, f);
+	if (!io) {
+		fclose(f);
+	}
+	return io;
+}
+
+cmsHPROFILE open_profile_from_path(py::object path, bool use_mmap) {
+	auto path_str = py::module_::import("os").attr("fsdecode")(path);
+	if (use_mmap) {
+		auto mmap = py::module_::import("mmap");
+		auto f = py::module_::import("builtins").attr("open")(path_str, "rb");
+		py::object mm;
+		try {
+			mm = mmap.attr("mmap")(f.attr("fileno")(), 0, "access"_a = mmap.attr("ACCESS_READ"));
+		} catch (...) {
+			f.attr("close")();
+			throw;
+		}
+		f.attr("close")();
+		return open_profile_from_buffer(mm);
+	}
+	auto native = native_path(path_str);
+	StatsScope stats(STATS.open_profile, 1);
+	cmsIOHANDLER *io = open_native_io_handler(NULL, native, false);
+	if (!io) {
+		return NULL;
+	}
+	// The handler is closed by Little-CMS even if it fails.
+	return cmsOpenProfileFromIOhandlerTHR(NULL, io);
+}
+
+// Inspection of the header and the tag directory, without opening the profile by Little-CMS.
+// No tag other than the description and the copyright is read.
+inline cmsUInt32Number load_be32(const cmsUInt8Number *p) {
+	return ((cmsUInt32Number)p[0] << 24) | ((cmsUInt32Number)p[1] << 16) | ((cmsUInt32Number)p[2] << 8) | p[3];
+}
+
+inline cmsUInt16Number load_be16(const cmsUInt8Number *p) {
+	return (cmsUInt16Number)((p[0] << 8) | p[1]);
+}
+
+// Reads [offset, offset + len) of a profile into dst. False on an I/O error.
+using ProfileReader = std::function<bool(cmsUInt32Number offset, cmsUInt32Number len, cmsUInt8Number *dst)>;
+
+struct TagEntry {
+	cmsUInt32Number sig, offset, size, type;
+	cmsUInt32Number linked;  // Signature of the tag whose data Little-CMS reads for this one, links followed. 0 if none.
+	bool known;  // Little-CMS has the descriptor of the tag.
+	bool type_supported;  // The tag type is one of the descriptor.
+};
+
+struct ProfileSummary {
+	cmsUInt8Number header[128];
+	std::vector<TagEntry> tags;
+	bool has_description = false, has_copyright = false;
+	std::string description, copyright;  // UTF-8
+};
+
+// Text tags larger than this are not read.
+const cmsUInt32Number MAX_TEXT_TAG_SIZE = 1 << 20;
+
+void append_utf8(std::string &s, uint32_t c) {
+	if (c < 0x80) {
+		s += (char)c;
+	} else if (c < 0x800) {
+		s += (char)(0xC0 | (c >> 6));
+		s += (char)(0x80 | (c & 0x3F));
+	} else if (c < 0x10000) {
+		s += (char)(0xE0 | (c >> 12));
+		s += (char)(0x80 | ((c >> 6) & 0x3F));
+		s += (char)(0x80 | (c & 0x3F));
+	} else {
+		s += (char)(0xF0 | (c >> 18));
+		s += (char)(0x80 | ((c >> 12) & 0x3F));
+		s += (char)(0x80 | ((c >> 6) & 0x3F));
+		s += (char)(0x80 | (c & 0x3F));
+	}
+}
+
+// Text of textType, textDescriptionType (the ASCII part) or multiLocalizedUnicodeType (eng/USA, eng, or the first).
+bool read_tag_text(const ProfileReader &read, const TagEntry &tag, std::string &text) {
+	if (tag.size < 12 || tag.size > MAX_TEXT_TAG_SIZE) {
+		return false;
+	}
+	std::vector<cmsUInt8Number> data(tag.size);
+	if (!read(tag.offset, tag.size, data.data())) {
+		return false;
+	}
+	const cmsUInt8Number *p = data.data();
+	auto ascii = [&text](const cmsUInt8Number *begin, size_t len) {
+		text.assign((const char *)begin, strnlen((const char *)begin, len));
+		return true;
+	};
+	switch (load_be32(p)) {
+	case cmsSigTextType:
+		return ascii(p + 8, tag.size - 8);
+	case cmsSigTextDescriptionType:
+		return ascii(p + 12, std::min<size_t>(load_be32(p + 8), tag.size - 12));
+	case cmsSigMultiLocalizedUnicodeType: {
+		cmsUInt32Number n = load_be32(p + 8), rec_size = load_be32(p + 12);
+		if (n == 0 || rec_size < 12 || n > (tag.size - 16) / rec_size) {
+			return false;
+		}
+		cmsUInt32Number best = 0;
+		int best_score = -1;
+		for (cmsUInt32Number i = 0; i < n; i++) {
+			const cmsUInt8Number *r = p + 16 + i * rec_size;
+			int score = (memcmp(r, "en", 2) == 0) + (memcmp(r, "enUS", 4) == 0);
+			if (score > best_score) {
+				best = i;
+				best_score = score;
+			}
+		}
+		const cmsUInt8Number *r = p + 16 + best * rec_size;
+		cmsUInt32Number len = load_be32(r + 4), offset = load_be32(r + 8);
+		if (offset > tag.size || len > tag.size - offset) {
+			return false;
+		}
+		text.clear();
+		for (cmsUInt32Number i = 0; i + 1 < len; i += 2) {
+			uint32_t c = load_be16(p + offset + i);
+			if (c >= 0xD800 && c < 0xDC00 && i + 3 < len) {
+				uint32_t low = load_be16(p + offset + i + 2);
+				if (low >= 0xDC00 && low < 0xE000) {
+					c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+					i += 2;
+				}
+			}
+			if (c == 0) {
+				break;
+			}
+			append_utf8(text, c);
+		}
+		return true;
+	}
+	default:
+		return false;
+	}
+}
+
+// Same as CompatibleTypes() of Little-CMS, which decides whether tags of the same data are linked.
+bool compatible_tag_types(const cmsTagDescriptor *desc1, const cmsTagDescriptor *desc2) {
+	if (!desc1 || !desc2 || desc1->nSupportedTypes != desc2->nSupportedTypes || desc1->ElemCount != desc2->ElemCount) {
+		return false;
+	}
+	for (cmsUInt32Number i = 0; i < desc1->nSupportedTypes; i++) {
+		if (desc1->SupportedTypes[i] != desc2->SupportedTypes[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Links the tags as _cmsReadHeader() does: to the last earlier tag of the same data and a compatible
+// descriptor. Then follows the links as cmsReadTag() does, which reads the data of the end of the chain.
+void link_summary_tags(std::vector<TagEntry> &tags) {
+	std::vector<const cmsTagDescriptor *> descs;
+	for (auto &t : tags) {
+		descs.push_back(_cmsGetTagDescriptor(NULL, (cmsTagSignature)t.sig));
+	}
+	for (size_t i = 0; i < tags.size(); i++) {
+		auto &t = tags[i];
+		for (size_t j = 0; j < i; j++) {
+			if (tags[j].offset == t.offset && tags[j].size == t.size && compatible_tag_types(descs[j], descs[i])) {
+				t.linked = tags[j].sig;
+			}
+		}
+		t.known = descs[i] != NULL;
+		// cmsReadTag() checks the type of the data against the descriptor of the requested tag.
+		t.type_supported = t.known && std::find(descs[i]->SupportedTypes,
+			descs[i]->SupportedTypes + descs[i]->nSupportedTypes, (cmsTagTypeSignature)t.type) != descs[i]->SupportedTypes + descs[i]->nSupportedTypes;
+	}
+	auto find_first = [&tags](cmsUInt32Number sig) {
+		return std::find_if(tags.begin(), tags.end(), [sig](const TagEntry &t) { return t.sig == sig; });
+	};
+	std::vector<cmsUInt32Number> resolved(tags.size());
+	for (size_t i = 0; i < tags.size(); i++) {
+		cmsUInt32Number sig = tags[i].linked;
+		// Links go to earlier tags, but duplicated signatures may loop.
+		for (size_t steps = 0; sig && steps < tags.size(); steps++) {
+			auto it = find_first(sig);
+			if (it == tags.end() || !it->linked) {
+				break;
+			}
+			sig = it->linked;
+		}
+		resolved[i] = sig;
+	}
+	for (size_t i = 0; i < tags.size(); i++) {
+		tags[i].linked = resolved[i];
+	}
+}
+
+bool read_profile_summary(const ProfileReader &read, cmsUInt64Number length, ProfileSummary &s) {
+	cmsUInt8Number count[4];
+	if (length < 132 || !read(0, 128, s.header) || !read(128, 4, count)
+		|| load_be32(s.header + 36) != cmsMagicNumber) {
+		return false;
+	}
+	// As Little-CMS, the size in the header is trusted only up to the real length.
+	cmsUInt32Number size = (cmsUInt32Number)std::min<cmsUInt64Number>(load_be32(s.header), std::min<cmsUInt64Number>(length, 0xFFFFFFFF));
+	cmsUInt32Number n = load_be32(count);
+	if (size < 132 || n > (size - 132) / 12) {
+		return false;
+	}
+	std::vector<cmsUInt8Number> dir(n * 12);
+	if (n && !read(132, n * 12, dir.data())) {
+		return false;
+	}
+	for (cmsUInt32Number i = 0; i < n; i++) {
+		TagEntry t{load_be32(&dir[i * 12]), load_be32(&dir[i * 12 + 4]), load_be32(&dir[i * 12 + 8]), 0, 0, false, false};
+		// Broken entries are skipped, as Little-CMS does.
+		if (t.offset > size || t.size > size - t.offset) {
+			continue;
+		}
+		cmsUInt8Number type[4];
+		if (t.size >= 8 && read(t.offset, 4, type)) {
+			t.type = load_be32(type);
+		}
+		s.tags.push_back(t);
+	}
+	link_summary_tags(s.tags);
+	for (auto &t : s.tags) {
+		if (t.sig == cmsSigProfileDescriptionTag) {
+			s.has_description = read_tag_text(read, t, s.description);
+		} else if (t.sig == cmsSigCopyrightTag) {
+			s.has_copyright = read_tag_text(read, t, s.copyright);
+		}
+	}
+	return true;
+}
+
+bool read_profile_summary_from_memory(const void *data, size_t len, ProfileSummary &s) {
+	auto read = [data, len](cmsUInt32Number offset, cmsUInt32Number n, cmsUInt8Number *dst) {
+		if ((size_t)offset + n > len) {
+			return false;
+		}
+		memcpy(dst, static_cast<const cmsUInt8Number *>(data) + offset, n);
+		return true;
+	};
+	return read_profile_summary(read, len, s);
+}
+
+bool read_profile_summary_from_file(const NativePath &path, ProfileSummary &s) {
+	FILE *f = open_native_file(path, false);
+	if (!f) {
+		return false;
+	}
+	bool ok = false;
+	if (seek_native_file(f, 0, SEEK_END) == 0) {
+		cmsInt64Number length = tell_native_file(f);
+		auto read = [f](cmsUInt32Number offset, cmsUInt32Number n, cmsUInt8Number *dst) {
+			return seek_native_file(f, offset, SEEK_SET) == 0 && fread(dst, 1, n, f) == n;
+		};
+		ok = length > 0 && read_profile_summary(read, (cmsUInt64Number)length, s);
+	}
+	fclose(f);
+	return ok;
+}
+
+std::string signature_string(cmsUInt32Number sig) {
+	char s[4] = {(char)(sig >> 24), (char)(sig >> 16), (char)(sig >> 8), (char)sig};
+	return std::string(s, 4);
+}
+
+py::object decode_utf8(const std::string &s) {
+	return py::reinterpret_steal<py::object>(PyUnicode_DecodeUTF8(s.data(), (Py_ssize_t)s.size(), "replace"));
+}
+
+py::dict profile_summary_dict(const ProfileSummary &s) {
+	const cmsUInt8Number *h = s.header;
+	py::dict tags;
+	for (auto &t : s.tags) {
+		tags[py::str(signature_string(t.sig))] = py::dict(
+			"offset"_a = t.offset, "size"_a = t.size,
+			"type"_a = t.type ? py::object(py::str(signature_string(t.type))) : py::none(),
+			"linked"_a = t.linked ? py::object(py::str(signature_string(t.linked))) : py::none(),
+			"type_supported"_a = t.known ? py::object(py::bool_(t.type_supported)) : py::none());
+	}
+	bool has_id = std::any_of(h + 84, h + 100, [](cmsUInt8Number b) { return b != 0; });
+	return py::dict(
+		"size"_a = load_be32(h), "cmm"_a = load_be32(h + 4),
+		"version"_a = h[8] + (h[9] >> 4) / 10.0 + (h[9] & 0xF) / 100.0,
+		"device_class"_a = load_be32(h + 12), "color_space"_a = load_be32(h + 16), "pcs"_a = load_be32(h + 20),
+		"flags"_a = load_be32(h + 44), "manufacturer"_a = load_be32(h + 48), "model"_a = load_be32(h + 52),
+		"rendering_intent"_a = load_be32(h + 64), "creator"_a = load_be32(h + 80),
+		"header_profile_id"_a = has_id ? py::object(py::bytes((const char *)h + 84, 16)) : py::none(),
+		"description"_a = s.has_description ? decode_utf8(s.description) : py::none(),
+		"copyright"_a = s.has_copyright ? decode_utf8(s.copyright) : py::none(),
+		"tags"_a = tags);
+}
+
+// Destination of cmsSaveProfileToIOhandler(). Writers of tag types seek back to patch offsets,
+// so it is random access. Python errors are kept in error, since they cannot pass through Little-CMS.
+struct SaveIO {
+	enum Kind { BYTES, BYTEARRAY, FIXED, STREAM };
+	Kind kind;
+	PyObject *obj = NULL;  // Owned bytes, or borrowed bytearray or stream
+	char *data = NULL;
+	Py_ssize_t base = 0;  // Start position of STREAM
+	cmsUInt32Number capacity = 0;
+	cmsUInt32Number pos = 0;
+	cmsUInt32Number size = 0;
+	std::exception_ptr error;
+
+	// Makes the room of [0, n) for BYTES and BYTEARRAY.
+	void reserve(cmsUInt32Number n) {
+		if (n <= capacity) {
+			return;
+		}
+		Py_ssize_t new_capacity = std::max<Py_ssize_t>({(Py_ssize_t)n, (Py_ssize_t)capacity * 2, 4096});
+		if (kind == BYTES) {
+			if (_PyBytes_Resize(&obj, new_capacity) != 0) {
+				throw py::error_already_set();
+			}
+			data = PyBytes_AS_STRING(obj);
+		} else {
+			if (PyByteArray_Resize(obj, new_capacity) != 0) {
+				throw py::error_already_set();
+			}
+			data = PyByteArray_AS_STRING(obj);
+		}
+		capacity = (cmsUInt32Number)new_capacity;
+	}
+};
+
+cmsBool SaveIOWrite(cmsIOHANDLER *io, cmsUInt32Number size, const void *buffer) {
+	auto s = static_cast<SaveIO *>(io->stream);
+	if (s->error) {
+		return FALSE;
+	}
+	cmsUInt64Number end = (cmsUInt64Number)s->pos + size;
+	if (end > 0xFFFFFFFF) {
+		return FALSE;
+	}
+	try {
+		switch (s->kind) {
+		case SaveIO::FIXED:
+			// The header is written first, with the size from the sizing pass of Little-CMS,
+			// so a buffer too small fails before anything is written.
+			if (s->size == 0 && size >= sizeof(cmsUInt32Number)
+				&& load_be32(static_cast<const cmsUInt8Number *>(buffer)) > s->capacity) {
+				return FALSE;
+			}
+			if (end > s->capacity) {
+				return FALSE;
+			}
+			break;
+		case SaveIO::STREAM:
+			py::handle(s->obj).attr("write")(py::bytes(static_cast<const char *>(buffer), size));
+			break;
+		default:
+			s->reserve((cmsUInt32Number)end);
+		}
+	} catch (...) {
+		s->error = std::current_exception();
+		return FALSE;
+	}
+	if (s->kind != SaveIO::STREAM) {
+		memcpy(s->data + s->pos, buffer, size);
+	}
+	s->pos = (cmsUInt32Number)end;
+	s->size = std::max(s->size, s->pos);
+	io->UsedSpace = s->size;
+	return TRUE;
+}
+
+cmsBool SaveIOSeek(cmsIOHANDLER *io, cmsUInt32Number offset) {
+	auto s = static_cast<SaveIO *>(io->stream);
+	if (s->error || offset > s->size) {
+		return FALSE;
+	}
+	if (s->kind == SaveIO::STREAM) {
+		try {
+			py::handle(s->obj).attr("seek")(s->base + offset);
+		} catch (...) {
+			s->error = std::current_exception();
+			return FALSE;
+		}
+	}
+	s->pos = offset;
+	return TRUE;
+}
+
+cmsUInt32Number SaveIOTell(cmsIOHANDLER *io) {
+	return static_cast<SaveIO *>(io->stream)->pos;
+}
+
+cmsUInt32Number SaveIORead(cmsIOHANDLER *io, void *buffer, cmsUInt32Number size, cmsUInt32Number count) {
+	return 0;
+}
+
+cmsBool SaveIOClose(cmsIOHANDLER *io) {
+	return TRUE;
+}
+
+// Saves a profile straight into the destination of s. cmsSaveProfileToIOhandler() still runs its sizing
+// pass on a NULL handler before the write. Returns the size, or 0 if fail. Python errors of the destination are raised.
+cmsUInt32Number save_profile(cmsHPROFILE hp, SaveIO &s) {
+	cmsIOHANDLER io = {};
+	io.stream = &s;
+	io.ContextID = cmsGetProfileContextID(hp);
+	io.Read = SaveIORead;
+	io.Seek = SaveIOSeek;
+	io.Close = SaveIOClose;
+	io.Tell = SaveIOTell;
+	io.Write = SaveIOWrite;
+	cmsUInt32Number n = cmsSaveProfileToIOhandler(hp, &io);
+	if (n && s.kind == SaveIO::STREAM) {
+		SaveIOSeek(&io, s.size);
+	}
+	if (s.error) {
+		std::rethrow_exception(s.error);
+	}
+	return n;
+}
+
+bool setAsciiTag(std::string str, cmsHPROFILE hProfile, cmsTagSignature tag) {
+	auto m = cmsMLUalloc(NULL, 0);
+	cmsMLUsetASCII(m, cmsNoLanguage, cmsNoCountry, str.c_str());
+	auto rc = cmsWriteTag(hProfile, tag, m);
+	cmsMLUfree(m);
+	return rc;
+}
+
+typedef union {
+	char s[5];
+	cmsTagSignature tag;
+} tag_str;
+
+bool invalidChar (char c) {  
+    return c < 32 || c >= 127;
+} 
+
+void stripNonAscii(std::string &str) { 
+    str.erase(remove_if(str.begin(),str.end(), invalidChar), str.end());  
+}
+
+const std::map<std::string, cmsTagSignature> &get_lut_tag_map() {
+	static const std::map<std::string, cmsTagSignature> lut_tag_map = {
+		{"B2A0", cmsSigBToA0Tag},
+		{"B2A1", cmsSigBToA1Tag},
+		{"B2A2", cmsSigBToA2Tag},
+		{"A2B0", cmsSigAToB0Tag},
+		{"A2B1", cmsSigAToB1Tag},
+		{"A2B2", cmsSigAToB2Tag},
+		{"gamt", cmsSigGamutTag},
+	};
+	return lut_tag_map;
+}
+
+// Pipeline of a LUT tag. NULL if the tag is unknown or absent.
+// The pipeline is owned by the profile.
+cmsPipeline *read_lut_pipeline(cmsHPROFILE hp, const std::string &tag) {
+	auto &lut_tag_map = get_lut_tag_map();
+	auto it = lut_tag_map.find(tag);
+	if (it == lut_tag_map.end() || !cmsIsTag(hp, it->second)) {
+		return NULL;
+	}
+	return (cmsPipeline *)cmsReadTag(hp, it->second);
+}
+
+const size_t MIN_ROWS_PER_TILE = 1024;
+
+// True if the channels of the rows are contiguous, as eval() of eval_rows() takes.
+template <typename T>
+bool has_contiguous_channels(const py::array_t<T> &a, cmsUInt32Number n_ch) {
+	return (n_ch <= 1 || a.strides(1) == (py::ssize_t)sizeof(T)) && a.strides(0) % (py::ssize_t)sizeof(T) == 0;
+}
+
+// Evaluates the rows of input_array into output_array without the GIL,
+// by eval(in, in_row_stride, out, out_row_stride, n_rows) on chunks. Strides are in elements.
+// Arrays whose channels are not contiguous (e.g. arr[:, ::-1]) go through C-contiguous copies.
+template <typename T, typename F>
+int eval_rows(cmsUInt32Number in_ch, cmsUInt32Number out_ch, py::array_t<T> &input_array, py::array_t<T> &output_array, F eval) {
+	if (input_array.ndim() != 2 || input_array.shape(1) != in_ch
+		|| output_array.ndim() != 2 || output_array.shape(1) != out_ch
+		|| input_array.shape(0) != output_array.shape(0)) {
+		return 0;
+	}
+	if (!has_contiguous_channels(input_array, in_ch)) {
+		py::array_t<T> input_copy(py::array_t<T, py::array::c_style>::ensure(input_array));
+		return eval_rows(in_ch, out_ch, input_copy, output_array, eval);
+	}
+	if (!has_contiguous_channels(output_array, out_ch)) {
+		if (!output_array.writeable()) {
+			return 0;
+		}
+		py::array_t<T> output_copy({output_array.shape(0), (py::ssize_t)out_ch});
+		int rc = eval_rows(in_ch, out_ch, input_array, output_copy, eval);
+		output_array[py::ellipsis()] = output_copy;
+		return rc;
+	}
+	auto input_array_bi = input_array.request();
+	auto output_array_bi = output_array.request(true);
+	auto in = static_cast<const T *>(input_array_bi.ptr);
+	auto out = static_cast<T *>(output_array_bi.ptr);
+	ptrdiff_t in_stride = input_array_bi.strides[0] / (ptrdiff_t)sizeof(T);
+	ptrdiff_t out_stride = output_array_bi.strides[0] / (ptrdiff_t)sizeof(T);
+	py::gil_scoped_release release;
+	parallel_for((size_t)input_array_bi.shape[0], NUM_THREADS, MIN_ROWS_PER_TILE, [&](size_t begin, size_t end) {
+		eval(in + (ptrdiff_t)begin * in_stride, in_stride, out + (ptrdiff_t)begin * out_stride, out_stride, end - begin);
+	});
+	return -1;
+}
+
+// Curve set stage of the columns of table[entries, channels]. NULL if fail.
+cmsStage *alloc_table_stage(py::array_t<cmsUInt16Number> &table) {
+	auto table_c = table.unchecked<2>();
+	auto n_entry = (cmsUInt32Number)table_c.shape(0);
+	auto n_ch = (cmsUInt32Number)table_c.shape(1);
+	std::vector<cmsUInt16Number> values(n_entry);
+	std::vector<cmsToneCurve *> curves(n_ch, nullptr);
+	bool ok = true;
+	for (cmsUInt32Number c = 0; c < n_ch && ok; c++) {
+		for (cmsUInt32Number i = 0; i < n_entry; i++) {
+			values[i] = table_c(i, c);
+		}
+		curves[c] = cmsBuildTabulatedToneCurve16(NULL, n_entry, values.data());
+		ok = curves[c] != NULL;
+	}
+	cmsStage *stage = ok ? cmsStageAllocToneCurves(NULL, n_ch, curves.data()) : NULL;
+	for (auto curve : curves) {
+		if (curve) {
+			cmsFreeToneCurve(curve);
+		}
+	}
+	return stage;
+}
+
+// Quantizes 0.0 - 1.0 to 0 - 0xffff without the GIL. NaN goes to 0.
+template <typename T, int Flags>
+void quantize_table(const py::array_t<T, Flags> &src, std::vector<cmsUInt16Number> &dst) {
+	const T *p = src.data();
+	dst.resize(src.size());
+	py::gil_scoped_release release;
+	parallel_for(dst.size(), NUM_THREADS, MIN_PIXELS_PER_TILE, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			T v = p[i] * 65535 + (T)0.5;
+			dst[i] = v >= 65535 ? 0xffff : (v >= 1 ? (cmsUInt16Number)v : 0);
+		}
+	});
+}
+
+// Pipeline of curves, CLUT and curves for add_lut16(). NULL if the arrays do not fit.
+cmsPipeline *alloc_lut16_pipeline(cmsHPROFILE hp, int n_out_ch, py::object clut_obj, py::object pre_table_obj, py::object post_table_obj) {
+	auto clut = py::array::ensure(clut_obj);
+	auto pre_table = py::array_t<cmsUInt16Number>::ensure(pre_table_obj);
+	auto post_table = py::array_t<cmsUInt16Number>::ensure(post_table_obj);
+	if (!clut || !pre_table || !post_table) {
+		return NULL;
+	}
+	int n_in_ch = (int)clut.ndim() - 1;
+	auto pre_table_bi = pre_table.request();
+	auto post_table_bi = post_table.request();
+	if (n_in_ch < 1 || n_in_ch > MAX_INPUT_DIMENSIONS || n_out_ch < 1 || n_out_ch > cmsMAXCHANNELS
+		|| clut.shape(n_in_ch) != n_out_ch
+		|| pre_table_bi.ndim != 2 || pre_table_bi.shape[0] < 2 || pre_table_bi.shape[1] != n_in_ch
+		|| post_table_bi.ndim != 2 || post_table_bi.shape[0] < 2 || post_table_bi.shape[1] != n_out_ch) {
+		return NULL;
+	}
+	cmsUInt32Number grid_points[MAX_INPUT_DIMENSIONS];
+	for (int i = 0; i < n_in_ch; i++) {
+		grid_points[i] = (cmsUInt32Number)clut.shape(i);
+		// lut16 of ICC v2 has the same grid points for all inputs.
+		if (grid_points[i] < 2 || (cmsGetProfileVersion(hp) < 4.0 && grid_points[i] != grid_points[0])) {
+			return NULL;
+		}
+	}
+	// Tag types of lut16 and mAB store 16-bit CLUT, so float CLUT is quantized here.
+	std::vector<cmsUInt16Number> quantized;
+	py::array_t<cmsUInt16Number, py::array::c_style | py::array::forcecast> clut16;
+	const cmsUInt16Number *clut_table;
+	if (clut.dtype().kind() == 'f') {
+		if (clut.itemsize() == sizeof(cmsFloat32Number)) {
+			quantize_table(py::array_t<cmsFloat32Number, py::array::c_style | py::array::forcecast>::ensure(clut), quantized);
+		} else {
+			quantize_table(py::array_t<cmsFloat64Number, py::array::c_style | py::array::forcecast>::ensure(clut), quantized);
+		}
+		clut_table = quantized.data();
+	} else {
+		clut16 = py::array_t<cmsUInt16Number, py::array::c_style | py::array::forcecast>::ensure(clut);
+		if (!clut16) {
+			return NULL;
+		}
+		clut_table = clut16.data();
+	}
+	auto pipeline = cmsPipelineAlloc(NULL, n_in_ch, n_out_ch);
+	if (!pipeline) {
+		return NULL;
+	}
+	cmsStage *stages[] = {
+		alloc_table_stage(pre_table),
+		cmsStageAllocCLut16bitGranular(NULL, grid_points, n_in_ch, n_out_ch, clut_table),
+		alloc_table_stage(post_table),
+	};
+	bool ok = true;
+	for (auto stage : stages) {
+		if (!stage) {
+			ok = false;
+		} else if (!ok) {
+			cmsStageFree(stage);
+		} else {
+			// The pipeline owns the stage even if it fails.
+			ok = cmsPipelineInsertStage(pipeline, cmsAT_END, stage);
+		}
+	}
+	if (!ok) {
+		cmsPipelineFree(pipeline);
+		return NULL;
+	}
+	return pipeline;
+}
+
+// Curve set of the stage at index of the pipeline. Negative index counts from the end.
+// NULL if out of range or not a curve set.
+_cmsStageToneCurvesData *get_stage_curves(const cmsPipeline *pipeline, int index) {
+	int n_stage = (int)cmsPipelineStageCount(pipeline);
+	if (index < 0) {
+		index += n_stage;
+	}
+	if (index < 0 || index >= n_stage) {
+		return NULL;
+	}
+	cmsStage *stage = cmsPipelineGetPtrToFirstStage(pipeline);
+	for (int i = 0; i < index; i++) {
+		stage = cmsStageNext(stage);
+	}
+	if (cmsStageType(stage) != cmsSigCurveSetElemType) {
+		return NULL;
+	}
+	return static_cast<_cmsStageToneCurvesData *>(cmsStageData(stage));
+}
+
+// Rows above this evaluate 16-bit curves by tables of 65536 entries.
+const size_t CURVE_TABLE_MIN_ROWS = 16384;
+
+int eval_stage_curves16(const _cmsStageToneCurvesData *curves, py::array_t<cmsUInt16Number> &input_array, py::array_t<cmsUInt16Number> &output_array) {
+	cmsUInt32Number n = curves->nCurves;
+	std::vector<cmsUInt16Number> table;
+	if (input_array.ndim() == 2 && (cmsUInt32Number)input_array.shape(1) == n && (size_t)input_array.shape(0) >= CURVE_TABLE_MIN_ROWS) {
+		table.resize(n * 65536);
+		py::gil_scoped_release release;
+		parallel_for(table.size(), NUM_THREADS, 65536, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; i++) {
+				table[i] = cmsEvalToneCurve16(curves->TheCurves[i >> 16], (cmsUInt16Number)(i & 0xffff));
+			}
+		});
+	}
+	return eval_rows(n, n, input_array, output_array,
+		[&](const cmsUInt16Number *in, ptrdiff_t in_stride, cmsUInt16Number *out, ptrdiff_t out_stride, size_t n_row) {
+			for (size_t i = 0; i < n_row; i++, in += in_stride, out += out_stride) {
+				for (cmsUInt32Number c = 0; c < n; c++) {
+					out[c] = table.empty() ? cmsEvalToneCurve16(curves->TheCurves[c], in[c]) : table[c * 65536 + in[c]];
+				}
+			}
+		});
+}
+
+int eval_stage_curves_float(const _cmsStageToneCurvesData *curves, py::array_t<cmsFloat32Number> &input_array, py::array_t<cmsFloat32Number> &output_array) {
+	cmsUInt32Number n = curves->nCurves;
+	return eval_rows(n, n, input_array, output_array,
+		[&](const cmsFloat32Number *in, ptrdiff_t in_stride, cmsFloat32Number *out, ptrdiff_t out_stride, size_t n_row) {
+			for (size_t i = 0; i < n_row; i++, in += in_stride, out += out_stride) {
+				for (cmsUInt32Number c = 0; c < n; c++) {
+					out[c] = cmsEvalToneCurveFloat(curves->TheCurves[c], in[c]);
+				}
+			}
+		});
+}
+
+static py::function ERROR_HANDLER;
+void CmmLogErrorHandler(cmsContext context, cmsUInt32Number error_code, const char *text)
+{
+	// Transforms may run on pool threads without the GIL.
+	py::gil_scoped_acquire acquire;
+	if (!ERROR_HANDLER) {
+		return;
+	}
+	std::string msg = text;
+	try {
+		ERROR_HANDLER(error_code, msg);
+	} catch (py::error_already_set &e) {
+		e.discard_as_unraisable("cmm log error handler");
+	}
+}
+
+// MD5 profile IDs for the transform cache, computed once per handle. The ID in the header
+// is not trusted, because other tools often leave it stale or copy it between profiles.
+// Every binding which writes a profile calls profile_modified() after the write.
+class ProfileIds {
+public:
+	bool get(cmsHPROFILE hp, std::string &id) {
+		uint64_t epoch_before;
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			auto it = ids.find(hp);
+			if (it != ids.end()) {
+				id = it->second;
+				return true;
+			}
+			epoch_before = epoch;
+		}
+		// A serialization of the profile; the lock is not held meanwhile.
+		if (!compute_id(hp, id)) {
+			return false;
+		}
+		std::lock_guard<std::mutex> lock(mtx);
+		// Not kept if a profile is modified or closed meanwhile, as it may be stale.
+		if (epoch == epoch_before) {
+			ids[hp] = id;
+		}
+		return true;
+	}
+
+	void set_modified(cmsHPROFILE hp) {
+		forget(hp);
+	}
+
+	void forget(cmsHPROFILE hp) {
+		std::lock_guard<std::mutex> lock(mtx);
+		epoch++;
+		ids.erase(hp);
+	}
+
+private:
+	std::mutex mtx;
+	std::map<cmsHPROFILE, std::string> ids;
+	uint64_t epoch = 0;
+
+	// Same as cmsMD5computeID(), but from a copy, so the header of the handle is not written.
+	static bool compute_id(cmsHPROFILE hp, std::string &id) {
+		cmsUInt32Number size = 0;
+		if (!cmsSaveProfileToMem(hp, NULL, &size) || size < sizeof(cmsICCHeader)) {
+			return false;
+		}
+		std::vector<cmsUInt8Number> mem(size);
+		if (!cmsSaveProfileToMem(hp, mem.data(), &size)) {
+			return false;
+		}
+		// The flags, the rendering intent and the ID are zeros for the MD5 (ICC.1 7.2.18).
+		auto header = reinterpret_cast<cmsICCHeader *>(mem.data());
+		header->flags = 0;
+		header->renderingIntent = 0;
+		memset(&header->profileID, 0, sizeof(header->profileID));
+		cmsHANDLE md5 = cmsMD5alloc(cmsGetProfileContextID(hp));
+		if (!md5) {
+			return false;
+		}
+		cmsMD5add(md5, mem.data(), size);
+		cmsProfileID computed;
+		cmsMD5finish(&computed, md5);
+		id.assign((const char *)computed.ID8, 16);
+		return true;
+	}
+};
+
+static ProfileIds PROFILE_IDS;
+
+// Drops what is derived from the content of a profile, after a write to it.
+void profile_modified(cmsHPROFILE hp) {
+	PROFILE_IDS.set_modified(hp);
+	LUT_ENGINES.forget_profile(hp);
+}
+
+void close_profile_handle(cmsHPROFILE hp) {
+	PROFILE_IDS.forget(hp);
+	LUT_ENGINES.forget_profile(hp);
+	cmsCloseProfile(hp);
+}
+
+// Key of the transform cache. Made of profile IDs and integer parameters.
+class TransformKey {
+public:
+	bool add_profile(cmsHPROFILE hp) {
+		std::string id(16, '\0');
+		if (hp && !PROFILE_IDS.get(hp, id)) {
+			return false;
+		}
+		key += id;
+		return true;
+	}
+
+	void add_int(uint64_t v) {
+		key.append((const char *)&v, sizeof(v));
+	}
+
+	void add_double(double v) {
+		uint64_t bits;
+		memcpy(&bits, &v, sizeof(bits));
+		add_int(bits);
+	}
+
+	void add_context(cmsContext context) {
+		add_int((uint64_t)(uintptr_t)context);
+	}
+
+	const std::string &str() const {
+		return key;
+	}
+
+private:
+	std::string key;
+};
+
+// LRU cache of transforms. A cached handle is shared by the callers and reference counted.
+// Evicted handles in use are deleted by the last delete_transform().
+class TransformCache {
+public:
+	bool enabled() {
+		std::lock_guard<std::mutex> lock(mtx);
+		return capacity != 0;
+	}
+
+	cmsHTRANSFORM acquire(const std::string &key) {
+		std::lock_guard<std::mutex> lock(mtx);
+		auto it = by_key.find(key);
+		if (it == by_key.end()) {
+			misses++;
+			return NULL;
+		}
+		hits++;
+		auto &entry = entries[it->second];
+		entry.refs++;
+		lru.splice(lru.begin(), lru, entry.lru_pos);
+		return it->second;
+	}
+
+	// Returns the cached one if another thread has made it meanwhile.
+	cmsHTRANSFORM insert(const std::string &key, cmsHTRANSFORM ht) {
+		std::lock_guard<std::mutex> lock(mtx);
+		if (capacity == 0) {
+			return ht;
+		}
+		auto it = by_key.find(key);
+		if (it != by_key.end()) {
+			destroy_transform(ht);
+			auto &entry = entries[it->second];
+			entry.refs++;
+			lru.splice(lru.begin(), lru, entry.lru_pos);
+			return it->second;
+		}
+		lru.push_front(ht);
+		by_key[key] = ht;
+		entries[ht] = Entry{key, 1, true, lru.begin()};
+		evict(capacity);
+		return ht;
+	}
+
+	// Keeps a handle alive while a job uses it, cached or not. The job calls delete_transform_handle()
+	// at the end, so delete_transform() meanwhile drops only the reference of the caller.
+	void pin(cmsHTRANSFORM ht) {
+		std::lock_guard<std::mutex> lock(mtx);
+		auto it = entries.find(ht);
+		if (it != entries.end()) {
+			it->second.refs++;
+			return;
+		}
+		// The reference of the caller and the one of the job.
+		entries[ht] = Entry{std::string(), 2, false, lru.end()};
+	}
+
+	// Returns false if the handle is not cached or pinned.
+	bool release(cmsHTRANSFORM ht) {
+		std::lock_guard<std::mutex> lock(mtx);
+		auto it = entries.find(ht);
+		if (it == entries.end()) {
+			return false;
+		}
+		if (--it->second.refs == 0 && !it->second.cached) {
+			destroy_transform(ht);
+			entries.erase(it);
+		}
+		return true;
+	}
+
+	void set_capacity(size_t n) {
+		std::lock_guard<std::mutex> lock(mtx);
+		capacity = n;
+		evict(capacity);
+	}
+
+	void clear() {
+		std::lock_guard<std::mutex> lock(mtx);
+		evict(0);
+	}
+
+	// Drops the transforms of a context before the context is deleted.
+	void clear_context(cmsContext context) {
+		std::lock_guard<std::mutex> lock(mtx);
+		for (auto it = lru.begin(); it != lru.end();) {
+			auto ht = *it++;
+			if (cmsGetTransformContextID(ht) == context) {
+				drop(ht);
+			}
+		}
+	}
+
+	py::dict info() {
+		std::lock_guard<std::mutex> lock(mtx);
+		return py::dict("hits"_a = hits, "misses"_a = misses, "size"_a = lru.size(), "capacity"_a = capacity);
+	}
+
+private:
+	struct Entry {
+		std::string key;
+		int refs;
+		bool cached;
+		std::list<cmsHTRANSFORM>::iterator lru_pos;
+	};
+
+	std::mutex mtx;
+	size_t capacity = 0;
+	uint64_t hits = 0, misses = 0;
+	std::list<cmsHTRANSFORM> lru;
+	std::map<std::string, cmsHTRANSFORM> by_key;
+	std::map<cmsHTRANSFORM, Entry> entries;
+
+	void evict(size_t n) {
+		while (lru.size() > n) {
+			drop(lru.back());
+		}
+	}
+
+	void drop(cmsHTRANSFORM ht) {
+		auto it = entries.find(ht);
+		by_key.erase(it->second.key);
+		lru.erase(it->second.lru_pos);
+		it->second.cached = false;
+		if (it->second.refs == 0) {
+			destroy_transform(ht);
+			entries.erase(it);
+		}
+	}
+};
+
+static TransformCache TRANSFORM_CACHE;
+
+void delete_transform_handle(cmsHTRANSFORM ht) {
+	if (!TRANSFORM_CACHE.release(ht)) {
+		destroy_transform(ht);
+	}
+}
+
+// Pins a transform handle for a scope. See TransformCache::pin().
+class TransformPin {
+public:
+	explicit TransformPin(cmsHTRANSFORM ht) : ht(ht) {
+		TRANSFORM_CACHE.pin(ht);
+	}
+	TransformPin(const TransformPin &) = delete;
+	TransformPin &operator=(const TransformPin &) = delete;
+	~TransformPin() {
+		delete_transform_handle(ht);
+	}
+
+private:
+	cmsHTRANSFORM ht;
+};
+
+// surface_errors() after a creation. The transform is deleted if it throws.
+cmsHTRANSFORM surface_creation_errors(cmsHTRANSFORM ht) {
+	try {
+		surface_errors();
+	} catch (...) {
+		if (ht) {
+			delete_transform_handle(ht);
+		}
+		throw;
+	}
+	return ht;
+}
+
+// Kinds of transform cache keys. A key starts with its kind, not to be taken for another kind
+// of the same length.
+enum TransformKeyKind : uint64_t {
+	TRANSFORM_KEY = 0x54524e53,
+	PROOFING_TRANSFORM_KEY = 0x50524f46,
+	EXTENDED_TRANSFORM_KEY = 0x4558544e,
+	DEVICE_LINK_TRANSFORM_KEY = 0x444c4e4b,
+};
+
+// Looks up the cache by the key of make_key() after the kind, or creates a transform by create() and caches it.
+template <typename K, typename F>
+cmsHTRANSFORM create_cached_transform(TransformKeyKind kind, K make_key, F create) {
+	auto timed_create = [&create]() {
+		StatsScope stats(STATS.create, 1);
+		return create();
+	};
+	TransformKey key;
+	key.add_int(kind);
+	if (!TRANSFORM_CACHE.enabled() || !make_key(key)) {
+		return timed_create();
+	}
+	cmsHTRANSFORM ht = TRANSFORM_CACHE.acquire(key.str());
+	if (ht) {
+		return ht;
+	}
+	ht = timed_create();
+	if (!ht) {
+		return NULL;
+	}
+	return TRANSFORM_CACHE.insert(key.str(), ht);
+}
+
+cmsHTRANSFORM create_transform_handle(cmsHPROFILE src_hp, int src_format, cmsHPROFILE trg_hp, int trg_format, int intent, int flags, cmsContext context) {
+	return create_cached_transform(TRANSFORM_KEY, [&](TransformKey &key) {
+		for (uint64_t v : {(uint64_t)src_format, (uint64_t)trg_format, (uint64_t)intent, (uint64_t)flags}) {
+			key.add_int(v);
+		}
+		key.add_context(context);
+		// Read from the context by absolute colorimetric intents.
+		key.add_double(cmsSetAdaptationStateTHR(context, -1));
+		return key.add_profile(src_hp) && key.add_profile(trg_hp);
+	}, [&]() {
+		return cmsCreateTransformTHR(context, src_hp, src_format, trg_hp, trg_format, intent, flags);
+	});
+}
+
+cmsHTRANSFORM create_proofing_transform_handle(cmsHPROFILE src_hp, int src_format, cmsHPROFILE trg_hp, int trg_format, cmsHPROFILE proof_hp, int intent, int proof_intent, int flags, cmsContext context) {
+	return create_cached_transform(PROOFING_TRANSFORM_KEY, [&](TransformKey &key) {
+		for (uint64_t v : {(uint64_t)src_format, (uint64_t)trg_format, (uint64_t)intent, (uint64_t)proof_intent, (uint64_t)flags}) {
+			key.add_int(v);
+		}
+		key.add_context(context);
+		key.add_double(cmsSetAdaptationStateTHR(context, -1));
+		return key.add_profile(src_hp) && key.add_profile(trg_hp) && key.add_profile(proof_hp);
+	}, [&]() {
+		return cmsCreateProofingTransformTHR(context, src_hp, src_format, trg_hp, trg_format, proof_hp, intent, proof_intent, flags | cmsFLAGS_SOFTPROOFING);
+	});
+}
+
+// Transform through a chain of profiles with per-step intents, BPC and adaptation states.
+// NULL if the lengths do not match or there are too many profiles.
+cmsHTRANSFORM create_extended_transform_handle(const std::vector<cmsHPROFILE> &profiles, const std::vector<cmsUInt32Number> &intents,
+	const std::vector<cmsBool> &bpc, const std::vector<cmsFloat64Number> &adaptation, cmsHPROFILE gamut_hp, cmsUInt32Number gamut_pcs_position,
+	int src_format, int trg_format, int flags, cmsContext context) {
+	size_t n = profiles.size();
+	if (n == 0 || n > 255 || intents.size() != n || bpc.size() != n || adaptation.size() != n
+		|| std::find(profiles.begin(), profiles.end(), (cmsHPROFILE)NULL) != profiles.end()) {
+		return NULL;
+	}
+	return create_cached_transform(EXTENDED_TRANSFORM_KEY, [&](TransformKey &key) {
+		for (uint64_t v : {(uint64_t)n, (uint64_t)src_format, (uint64_t)trg_format, (uint64_t)flags, (uint64_t)gamut_pcs_position}) {
+			key.add_int(v);
+		}
+		key.add_context(context);
+		for (size_t i = 0; i < n; i++) {
+			key.add_int(intents[i]);
+			key.add_int((uint64_t)bpc[i]);
+			key.add_double(adaptation[i]);
+			if (!key.add_profile(profiles[i])) {
+				return false;
+			}
+		}
+		return key.add_profile(gamut_hp);
+	}, [&]() {
+		return cmsCreateExtendedTransform(context, (cmsUInt32Number)n, const_cast<cmsHPROFILE *>(profiles.data()),
+			const_cast<cmsBool *>(bpc.data()), const_cast<cmsUInt32Number *>(intents.data()), const_cast<cmsFloat64Number *>(adaptation.data()),
+			gamut_hp, gamut_pcs_position, src_format, trg_format, flags);
+	});
+}
+
+// Same as cmsCreateMultiprofileTransformTHR(), through the cache of create_extended_transform_handle().
+cmsHTRANSFORM create_multiprofile_transform_handle(const std::vector<cmsHPROFILE> &profiles, int src_format, int trg_format, int intent, int flags, cmsContext context) {
+	size_t n = profiles.size();
+	return create_extended_transform_handle(profiles, std::vector<cmsUInt32Number>(n, (cmsUInt32Number)intent),
+		std::vector<cmsBool>(n, (flags & cmsFLAGS_BLACKPOINTCOMPENSATION) ? TRUE : FALSE),
+		std::vector<cmsFloat64Number>(n, cmsSetAdaptationStateTHR(context, -1)), NULL, 0, src_format, trg_format, flags, context);
+}
+
+// Owner of a profile handle. Closed by close(), "with" or garbage collection.
+class Profile {
+public:
+	explicit Profile(cmsHPROFILE hp) : hp(hp) {}
+	Profile(const Profile &) = delete;
+	Profile &operator=(const Profile &) = delete;
+	~Profile() {
+		close();
+	}
+
+	void close() {
+		if (hp) {
+			close_profile_handle(hp);
+			hp = NULL;
+		}
+	}
+
+	cmsHPROFILE handle() const {
+		if (!hp) {
+			throw py::value_error("Profile is closed.");
+		}
+		return hp;
+	}
+
+	bool closed() const {
+		return !hp;
+	}
+
+private:
+	cmsHPROFILE hp;
+};
+
+// Owner of a transform handle. Keeps its profiles alive.
+class Transform {
+public:
+	Transform(cmsHTRANSFORM ht, std::vector<std::shared_ptr<Profile>> profiles) : ht(ht), profiles(std::move(profiles)) {}
+	Transform(const Transform &) = delete;
+	Transform &operator=(const Transform &) = delete;
+	~Transform() {
+		close();
+	}
+
+	void close() {
+		if (ht) {
+			delete_transform_handle(ht);
+			ht = NULL;
+		}
+		profiles.clear();
+	}
+
+	cmsHTRANSFORM handle() const {
+		if (!ht) {
+			throw py::value_error("Transform is closed.");
+		}
+		return ht;
+	}
+
+	bool closed() const {
+		return !ht;
+	}
+
+	const std::vector<std::shared_ptr<Profile>> &get_profiles() const {
+		return profiles;
+	}
+
+private:
+	cmsHTRANSFORM ht;
+	std::vector<std::shared_ptr<Profile>> profiles;
+};
+
+// Arguments which take a Profile / Transform object or a PyCapsule handle.
+struct ProfileArg {
+	cmsHPROFILE hp;
+	operator cmsHPROFILE() const {
+		return hp;
+	}
+};
+
+struct TransformArg {
+	cmsHTRANSFORM ht;
+	operator cmsHTRANSFORM() const {
+		return ht;
+	}
+};
+
+namespace pybind11 {
+namespace detail {
+
+template <typename Arg, typename Owner>
+struct handle_arg_caster {
+	bool load(handle src, bool) {
+		if (src.is_none()) {
+			value = Arg{NULL};
+			return true;
+		}
+		if (isinstance<capsule>(src)) {
+			value = Arg{reinterpret_borrow<capsule>(src).get_pointer()};
+			return true;
+		}
+		if (isinstance<Owner>(src)) {
+			value = Arg{src.cast<Owner &>().handle()};
+			return true;
+		}
+		return false;
+	}
+
+	static handle cast(const Arg &src, return_value_policy, handle) {
+		if (!src) {
+			return none().release();
+		}
+		return capsule((void *)src).release();
+	}
+
+	Arg value;
+	static constexpr auto name = const_name("Union[") + make_caster<Owner>::name + const_name(", capsule]");
+	template <typename T>
+	using cast_op_type = Arg;
+	operator Arg() {
+		return value;
+	}
+};
+
+template <> struct type_caster<ProfileArg> : handle_arg_caster<ProfileArg, Profile> {};
+template <> struct type_caster<TransformArg> : handle_arg_caster<TransformArg, Transform> {};
+
+} // namespace detail
+} // namespace pybind11
+
+// Whether buffers of T hold the samples of the format. Double has T_BYTES 0.
+template <typename T>
+bool format_holds(cmsUInt32Number format) {
+	size_t n_byte = T_BYTES(format) ? T_BYTES(format) : sizeof(cmsFloat64Number);
+	return n_byte == sizeof(T) && (T_FLOAT(format) != 0) == std::is_floating_point<T>::value;
+}
+
+template <typename T, typename U>
+void do_transform(TransformArg ht, py::array_t <T> input_buf, py::array_t <U> output_buf, int num_pixel) {
+	// The integer variants never checked the formats; the float ones reject a mismatch
+	// rather than reinterpret the buffers.
+	if ((std::is_floating_point<T>::value || std::is_floating_point<U>::value)
+		&& (!format_holds<T>(cmsGetTransformInputFormat(ht)) || !format_holds<U>(cmsGetTransformOutputFormat(ht)))) {
+		throw py::value_error("Transform formats do not match the buffer types.");
+	}
+	py::buffer_info input_bi = input_buf.request();
+	py::buffer_info output_bi = output_buf.request();
+	{
+		py::gil_scoped_release release;
+		transform_pixels(ht, input_bi.ptr, output_bi.ptr, num_pixel);
+	}
+	surface_errors();
+}
+
+// do_transform_async() calls not completed yet. Waited at exit, because a worker
+// cannot take the GIL once the interpreter finalizes.
+class AsyncJobs {
+public:
+	// Returns the number of the calls in flight, this one included.
+	int begin() {
+		std::lock_guard<std::mutex> lock(mtx);
+		return ++n;
+	}
+
+	void end() {
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			n--;
+		}
+		cv.notify_all();
+	}
+
+	void wait() {
+		std::unique_lock<std::mutex> lock(mtx);
+		cv.wait(lock, [this]() { return n == 0; });
+	}
+
+private:
+	std::mutex mtx;
+	std::condition_variable cv;
+	int n = 0;
+};
+
+static AsyncJobs ASYNC_JOBS;
+
+// A do_transform_async() call. Holds the Python objects until the future is done;
+// they are touched only with the GIL. The handle is pinned by submit_async().
+struct AsyncTransform {
+	py::object owner, src, dst, future;
+	cmsHTRANSFORM ht;
+	const void *input;
+	void *output;
+	ImageLayout in_layout, out_layout;
+
+	void set_exception(std::exception_ptr error) {
+		// Lets pybind11 translate the exception, LcmsError included.
+		try {
+			py::cpp_function([error]() { std::rethrow_exception(error); })();
+		} catch (py::error_already_set &e) {
+			future.attr("set_exception")(e.value());
+		}
+	}
+
+	void run() {
+		{
+			py::gil_scoped_acquire acquire;
+			if (!future.attr("set_running_or_notify_cancel")().cast<bool>()) {
+				return;
+			}
+		}
+		std::exception_ptr error;
+		try {
+			transform_image(ht, input, in_layout, output, out_layout);
+			surface_errors();
+		} catch (...) {
+			error = std::current_exception();
+		}
+		py::gil_scoped_acquire acquire;
+		try {
+			if (error) {
+				set_exception(error);
+			} else {
+				future.attr("set_result")(-1);
+			}
+		} catch (py::error_already_set &e) {
+			e.discard_as_unraisable("cmm.do_transform_async");
+		}
+	}
+};
+
+void submit_async(AsyncTransform *job) {
+	int n_jobs = ASYNC_JOBS.begin();
+	TRANSFORM_CACHE.pin(job->ht);
+	auto task = [job]() {
+		job->run();
+		delete_transform_handle(job->ht);
+		{
+			py::gil_scoped_acquire acquire;
+			delete job;
+		}
+		ASYNC_JOBS.end();
+	};
+#ifdef CMM_NO_THREADS
+	(void)n_jobs;
+	py::gil_scoped_release release;
+	task();
+#else
+	int n_threads;
+	size_t min_tile;
+	get_transform_threads(job->ht, n_threads, min_tile);
+	// The caller of parallel_for() works on tiles too, so a job never waits on a queued helper.
+	auto &pool = get_worker_pool();
+	pool.ensure_workers(pool_size_for_jobs(n_jobs, n_threads));
+	pool.submit(task);
+#endif
+}
+
+// dtype of the buffers of a format. 16-bit float is float16.
+py::dtype format_dtype(cmsUInt32Number format) {
+	size_t n_byte = T_BYTES(format) ? T_BYTES(format) : sizeof(cmsFloat64Number);
+	if (T_FLOAT(format)) {
+		return py::dtype(n_byte == 2 ? "float16" : n_byte == 4 ? "float32" : "float64");
+	}
+	return py::dtype(n_byte == 1 ? "uint8" : "uint16");
+}
+
+// A row strip of do_transform_stream() for the worker. It has no Python object, because the
+// worker may drop the last reference without the GIL.
+struct StreamStrip {
+	const void *in_ptr;
+	void *out_ptr;
+	ImageLayout in_layout, out_layout;
+	bool done = false;
+	std::exception_ptr error;
+	std::vector<CmmError> errors;
+};
+
+// Transforms row strips from src (an ndarray, e.g. np.memmap, or an iterable of strips) into
+// dst (an ndarray, or a callable which takes the output strips in order).
+// At most max_in_flight strips are transformed at once, while the caller pulls the next strip.
+int transform_stream(cmsHTRANSFORM ht, py::object src, py::object dst, size_t rows_per_strip, size_t max_in_flight) {
+	// The callbacks of src and dst may delete the transform.
+	TransformPin pin(ht);
+	auto in_format = cmsGetTransformInputFormat(ht);
+	auto out_format = cmsGetTransformOutputFormat(ht);
+	bool out_planar = T_PLANAR(out_format) != 0;
+	size_t out_ch = T_CHANNELS(out_format) + T_EXTRA(out_format);
+
+	bool src_is_array = py::isinstance<py::array>(src);
+	bool dst_is_array = py::isinstance<py::array>(dst);
+	if (!dst_is_array && !PyCallable_Check(dst.ptr())) {
+		return 0;
+	}
+	ImageLayout src_layout, dst_layout;
+	const cmsUInt8Number *src_data = NULL;
+	cmsUInt8Number *dst_data = NULL;
+	if (src_is_array) {
+		auto src_array = src.cast<py::array>();
+		if (!get_image_layout(src_array, in_format, src_layout)) {
+			return 0;
+		}
+		src_data = static_cast<const cmsUInt8Number *>(src_array.data());
+	}
+	if (dst_is_array) {
+		auto dst_array = dst.cast<py::array>();
+		if (!dst_array.writeable() || !get_image_layout(dst_array, out_format, dst_layout)) {
+			return 0;
+		}
+		dst_data = static_cast<cmsUInt8Number *>(dst_array.mutable_data());
+	}
+	if (src_is_array && dst_is_array
+		&& (src_layout.width != dst_layout.width || src_layout.height != dst_layout.height)) {
+		return 0;
+	}
+	size_t width = src_is_array ? src_layout.width : dst_is_array ? dst_layout.width : 0;
+	if (rows_per_strip == 0) {
+		// About a million pixels per strip: enough for the tiles of all threads.
+		rows_per_strip = std::max((size_t)1, ((size_t)1 << 20) / std::max(width, (size_t)1));
+	}
+	max_in_flight = std::max(max_in_flight, (size_t)1);
+
+	int n_threads;
+	size_t min_tile;
+	get_transform_threads(ht, n_threads, min_tile);
+#ifndef CMM_NO_THREADS
+	auto &pool = get_worker_pool();
+	pool.ensure_workers(pool_size_for_jobs(max_in_flight, n_threads));
+#endif
+
+	struct Shared {
+		std::mutex mtx;
+		std::condition_variable cv;
+	};
+	auto shared = std::make_shared<Shared>();
+	// A strip in flight. The arrays stay with the caller, and are released with the GIL.
+	struct InFlight {
+		std::shared_ptr<StreamStrip> strip;
+		py::object in, out;
+	};
+	std::deque<InFlight> in_flight;
+	size_t row = 0;
+
+	auto wait_front = [&]() {
+		InFlight entry = std::move(in_flight.front());
+		in_flight.pop_front();
+		auto &strip = entry.strip;
+		{
+			py::gil_scoped_release release;
+			std::unique_lock<std::mutex> lock(shared->mtx);
+			shared->cv.wait(lock, [&strip]() { return strip->done; });
+		}
+		auto &tls_errors = thread_errors();
+		std::move(strip->errors.begin(), strip->errors.end(), std::back_inserter(tls_errors));
+		return entry;
+	};
+	auto deliver = [&](InFlight entry) {
+		if (entry.strip->error) {
+			std::rethrow_exception(entry.strip->error);
+		}
+		if (!dst_is_array) {
+			dst(entry.out);
+		}
+	};
+	auto submit = [&](InFlight entry) {
+		auto strip = entry.strip;
+		auto task = [strip, shared, ht]() {
+			try {
+				transform_image(ht, strip->in_ptr, strip->in_layout, strip->out_ptr, strip->out_layout);
+			} catch (...) {
+				strip->error = std::current_exception();
+			}
+			auto &tls_errors = thread_errors();
+			strip->errors = std::move(tls_errors);
+			tls_errors.clear();
+			{
+				std::lock_guard<std::mutex> lock(shared->mtx);
+				strip->done = true;
+			}
+			shared->cv.notify_all();
+		};
+#ifdef CMM_NO_THREADS
+		{
+			py::gil_scoped_release release;
+			task();
+		}
+#else
+		pool.submit(task);
+#endif
+		in_flight.push_back(std::move(entry));
+	};
+	py::iterator it;
+	if (!src_is_array) {
+		it = py::iter(src);
+	}
+	bool ok = true;
+	// Makes the next strip. False at the end, or on a strip of a wrong layout with ok = false.
+	// The strips before it are delivered still, so a wrong strip after the first one raises ValueError.
+	auto next_strip = [&](InFlight &entry) {
+		entry = InFlight{std::make_shared<StreamStrip>(), py::object(), py::object()};
+		auto &strip = entry.strip;
+		if (src_is_array) {
+			if (row >= src_layout.height) {
+				return false;
+			}
+			entry.in = src;
+			strip->in_layout = src_layout;
+			strip->in_layout.height = (cmsUInt32Number)std::min(rows_per_strip, (size_t)src_layout.height - row);
+			strip->in_ptr = src_data + row * src_layout.bytes_per_line;
+		} else {
+			if (it == py::iterator::sentinel()) {
+				return false;
+			}
+			auto in = py::array::ensure(*it);
+			++it;
+			if (!in || !get_image_layout(in, in_format, strip->in_layout)
+				|| (width && strip->in_layout.width != width)) {
+				ok = false;
+				return false;
+			}
+			width = strip->in_layout.width;
+			entry.in = in;
+			strip->in_ptr = in.data();
+		}
+		if (dst_is_array) {
+			if (row + strip->in_layout.height > dst_layout.height) {
+				ok = false;
+				return false;
+			}
+			entry.out = dst;
+			strip->out_layout = dst_layout;
+			strip->out_layout.height = strip->in_layout.height;
+			strip->out_ptr = dst_data + row * dst_layout.bytes_per_line;
+		} else {
+			size_t rows = strip->in_layout.height;
+			std::vector<py::ssize_t> shape = out_planar
+				? std::vector<py::ssize_t>{(py::ssize_t)out_ch, (py::ssize_t)rows, (py::ssize_t)width}
+				: std::vector<py::ssize_t>{(py::ssize_t)rows, (py::ssize_t)width, (py::ssize_t)out_ch};
+			py::array out(format_dtype(out_format), shape);
+			get_image_layout(out, out_format, strip->out_layout);
+			entry.out = out;
+			strip->out_ptr = out.mutable_data();
+		}
+		row += strip->in_layout.height;
+		return true;
+	};
+
+	try {
+		InFlight entry;
+		while (next_strip(entry)) {
+			if (in_flight.size() >= max_in_flight) {
+				deliver(wait_front());
+			}
+			submit(std::move(entry));
+		}
+		while (!in_flight.empty()) {
+			deliver(wait_front());
+		}
+	} catch (...) {
+		// The workers use the buffers of the strips until they are done.
+		while (!in_flight.empty()) {
+			wait_front();
+		}
+		// The errors of the strips are reported now, not by a later call.
+		surface_errors(false);
+		throw;
+	}
+	surface_errors();
+	if (!ok && row) {
+		throw py::value_error("The strip at row " + std::to_string(row)
+			+ " does not match the image. The rows before it are transformed.");
+	}
+	return ok ? -1 : 0;
+}
+
+PYBIND11_MODULE(cmm, m) {
+
+#define PY_ATTR_PT(_a) m.attr(#_a) = _a
+#define PY_ATTR_ENUM(_a) m.attr(#_a) = (int)_a
+
+    m.doc() = R"pbdoc(
+        Color Management Module
+        -----------------------
+
+        .. currentmodule:: cmm
+
+        .. autosummary::
+           :toctree: _generate
+    )pbdoc";
+
+	py::register_exception<LcmsError>(m, "LcmsError");
+
+	py::class_<Profile, std::shared_ptr<Profile>>(m, "Profile", R"pbdoc(
+		Owner of a profile handle. The handle is closed by close(), the end of "with" block, or garbage collection.
+		Functions which take a profile handle also take a Profile.
+	)pbdoc")
+		.def(py::init([](py::capsule handle) {
+			return std::make_shared<Profile>(handle.get_pointer());
+		}), "handle"_a, R"pbdoc(
+			Takes the ownership of a profile handle, like the one by create_srgb_profile().
+			Do not close the handle by close_profile() after this.
+
+			Parameters
+			----------
+			handle: PyCapsule
+				Profile handle
+		)pbdoc")
+		.def_static("from_mem", [](py::buffer profile_content) -> std::shared_ptr<Profile> {
+			cmsHPROFILE hp = open_profile_from_buffer(profile_content);
+			if (!hp) {
+				return nullptr;
+			}
+			return std::make_shared<Profile>(hp);
+		}, "profile_content"_a, R"pbdoc(
+			Opens ICC profile from memory. See open_profile_from_mem().
+
+			Returns
+			-------
+			Optional[Profile]
+				None if error.
+		)pbdoc")
+		.def_static("from_file", [](py::object path, bool use_mmap) -> std::shared_ptr<Profile> {
+			cmsHPROFILE hp = open_profile_from_path(path, use_mmap);
+			if (!hp) {
+				return nullptr;
+			}
+			return std::make_shared<Profile>(hp);
+		}, "path"_a, "use_mmap"_a = false, R"pbdoc(
+			Opens ICC profile from a file. See open_profile_from_file().
+
+			Returns
+			-------
+			Optional[Profile]
+				None if error.
+		)pbdoc")
+		.def_property_readonly("handle", &Profile::handle, "Profile handle. Owned by this object.")
+		.def_property_readonly("closed", &Profile::closed)
+		.def("close", &Profile::close)
+		.def("__enter__", [](std::shared_ptr<Profile> self) {
+			return self;
+		})
+		.def("__exit__", [](Profile &self, py::args) {
+			self.close();
+		});
+
+	py::class_<Transform, std::shared_ptr<Transform>>(m, "Transform", R"pbdoc(
+		Owner of a transform handle. The handle is deleted by close(), the end of "with" block, or garbage collection.
+		Functions which take a transform handle also take a Transform.
+		A Transform keeps its profiles alive.
+	)pbdoc")
+		.def(py::init([](py::capsule handle, std::vector<std::shared_ptr<Profile>> profiles) {
+			return std::make_shared<Transform>(handle.get_pointer(), profiles);
+		}), "handle"_a, "profiles"_a = std::vector<std::shared_ptr<Profile>>(), R"pbdoc(
+			Takes the ownership of a transform handle. Do not delete the handle by delete_transform() after this.
+
+			Parameters
+			----------
+			handle: PyCapsule
+				Transform handle
+			profiles: [Profile]
+				Profiles to be kept alive with the transform.
+		)pbdoc")
+		.def_static("create", [](std::shared_ptr<Profile> src, int src_format, std::shared_ptr<Profile> trg, int trg_format, int intent, int flags, cmsContext context) -> std::shared_ptr<Transform> {
+			cmsHTRANSFORM ht = create_transform_handle(src->handle(), src_format, trg->handle(), trg_format, intent, flags, context);
+			surface_creation_errors(ht);
+			if (!ht) {
+				return nullptr;
+			}
+			return std::make_shared<Transform>(ht, std::vector<std::shared_ptr<Profile>>{src, trg});
+		}, "src"_a, "src_format"_a, "trg"_a, "trg_format"_a, "intent"_a, "flags"_a, "context"_a = py::none(), R"pbdoc(
+			Creates transform. See create_transform().
+
+			Returns
+			-------
+			Optional[Transform]
+				None if error.
+		)pbdoc")
+		.def_static("create_proofing", [](std::shared_ptr<Profile> src, int src_format, std::shared_ptr<Profile> trg, int trg_format, std::shared_ptr<Profile> proof, int intent, int proof_intent, int flags, cmsContext context) -> std::shared_ptr<Transform> {
+			cmsHTRANSFORM ht = create_proofing_transform_handle(src->handle(), src_format, trg->handle(), trg_format, proof->handle(), intent, proof_intent, flags, context);
+			surface_creation_errors(ht);
+			if (!ht) {
+				return nullptr;
+			}
+			return std::make_shared<Transform>(ht, std::vector<std::shared_ptr<Profile>>{src, trg, proof});
+		}, "src"_a, "src_format"_a, "trg"_a, "trg_format"_a, "proof"_a, "intent"_a, "proof_intent"_a, "flags"_a, "context"_a = py::none(), R"pbdoc(
+			Creates soft proof transform. See create_proofing_transform().
+
+			Returns
+			-------
+			Optional[Transform]
+				None if error.
+		)pbdoc")
+		.def_static("create_multiprofile", [](std::vector<std::shared_ptr<Profile>> profiles, int src_format, int trg_format, int intent, int flags, cmsContext context) -> std::shared_ptr<Transform> {
+			std::vector<cmsHPROFILE> hps;
+			for (auto &p : profiles) {
+				hps.push_back(p->handle());
+			}
+			cmsHTRANSFORM ht = create_multiprofile_transform_handle(hps, src_format, trg_format, intent, flags, context);
+			surface_creation_errors(ht);
+			if (!ht) {
+				return nullptr;
+			}
+			return std::make_shared<Transform>(ht, profiles);
+		}, "profiles"_a, "src_format"_a, "trg_format"_a, "intent"_a, "flags"_a, "context"_a = py::none(), R"pbdoc(
+			Creates transform through a chain of profiles. See create_multiprofile_transform().
+
+			Returns
+			-------
+			Optional[Transform]
+				None if error.
+		)pbdoc")
+		.def_property_readonly("handle", &Transform::handle, "Transform handle. Owned by this object.")
+		.def_property_readonly("closed", &Transform::closed)
+		.def_property_readonly("profiles", &Transform::get_profiles)
+		.def("close", &Transform::close)
+		.def("__enter__", [](std::shared_ptr<Transform> self) {
+			return self;
+		})
+		.def("__exit__", [](Transform &self, py::args) {
+			self.close();
+		});
+
+	m.def("set_log_error_handler", [](py::function handler) {
+		ERROR_HANDLER = handler;
+		cmsSetLogErrorHandler(CmmLogErrorHandler);
+	}, "handler"_a, R"pbdoc(
+		Set log error handler.
+
+		Parameters
+		----------
+		handler: Callable[[uint32, str], None]
+			uint32:
+				cmsERROR_UNDEFINED           0
+				cmsERROR_FILE                1
+				cmsERROR_RANGE               2
+				cmsERROR_INTERNAL            3
+				cmsERROR_NULL                4
+				cmsERROR_READ                5
+				cmsERROR_SEEK                6
+				cmsERROR_WRITE               7
+				cmsERROR_UNKNOWN_EXTENSION   8
+				cmsERROR_COLORSPACE_CHECK    9
+				cmsERROR_ALREADY_DEFINED     10
+				cmsERROR_BAD_SIGNATURE       11
+				cmsERROR_CORRUPTION_DETECTED 12
+				cmsERROR_NOT_SUITABLE        13
+			str: Error message
+	)pbdoc");
+
+	PY_ATTR_PT(cmsERROR_UNDEFINED);
+	PY_ATTR_PT(cmsERROR_FILE);
+	PY_ATTR_PT(cmsERROR_RANGE);
+	PY_ATTR_PT(cmsERROR_INTERNAL);
+	PY_ATTR_PT(cmsERROR_NULL);
+	PY_ATTR_PT(cmsERROR_READ);
+	PY_ATTR_PT(cmsERROR_SEEK);
+	PY_ATTR_PT(cmsERROR_WRITE);
+	PY_ATTR_PT(cmsERROR_UNKNOWN_EXTENSION);
+	PY_ATTR_PT(cmsERROR_COLORSPACE_CHECK);
+	PY_ATTR_PT(cmsERROR_ALREADY_DEFINED);
+	PY_ATTR_PT(cmsERROR_BAD_SIGNATURE);
+	PY_ATTR_PT(cmsERROR_CORRUPTION_DETECTED);
+	PY_ATTR_PT(cmsERROR_NOT_SUITABLE);
+
+	m.def("unset_log_error_handler", [](void) {
+		cmsSetLogErrorHandler(NULL);
+		ERROR_HANDLER = py::function();
+	}, R"pbdoc(
+		Unset log error handler.
+	)pbdoc");
+
+	m.def("open_profile_from_mem", [](py::buffer profile_content) {
+		return open_profile_from_buffer(profile_content);
+	}, "profile_content"_a, R"pbdoc(
+		Opens ICC profile from memory. The content is not copied. The profile keeps the buffer
+		until close_profile(), so do not modify a mutable buffer while the profile is open.
+
+		Parameters
+		----------
+		profile_content: bytes, or any C-contiguous buffer like bytearray, memoryview, mmap and ndarray
+
+		Returns
+		-------
+		PyCapsule
+			Profile handle. None if error.
+	)pbdoc");
+
+	m.def("open_profile_from_file", &open_profile_from_path, "path"_a, "use_mmap"_a = false, R"pbdoc(
+		Opens ICC profile from a file. Tags are read when they are used, so the whole file is not read.
+
+		Parameters
+		----------
+		path: str or os.PathLike
+		use_mmap: bool
+			If True, the file is memory-mapped instead of being read by stdio.
+
+		Returns
+		-------
+		PyCapsule
+			Profile handle. None if error.
+	)pbdoc");
+
+	m.def("close_profile", [](py::object hp) {
+		if (py::isinstance<Profile>(hp)) {
+			hp.cast<Profile &>().close();
+		} else {
+			close_profile_handle(hp.cast<ProfileArg>());
+		}
+	}, "hprofile"_a, R"pbdoc(
+		Closes ICC profile.
+
+		Parameters
+		----------
+		hp: PyCapsule
+			Profile handle
+	)pbdoc");
+
+	m.def("get_device_class", [](ProfileArg hp) {
+		return (int)cmsGetDeviceClass(hp);
+	}, "hprofile"_a, R"pbdoc(
+		Gets device class of a profile.
+
+		Parameters
+		----------
+		hp: PyCapsule
+			Profile handle
+
+		Returns
+		-------
+		int
+			cmsSigInputClass 0x73636E72 'scnr'
+			cmsSigDisplayClass 0x6D6E7472 'mntr'
+			cmsSigOutputClass 0x70727472 'prtr'
+			cmsSigLinkClass 0x6C696E6B 'link'
+			cmsSigAbstractClass 0x61627374 'abst'
+			cmsSigColorSpaceClass 0x73706163 'spac'
+			cmsSigNamedColorClass 0x6e6d636c 'nmcl' 
+	)pbdoc");
+
+	PY_ATTR_ENUM(cmsSigInputClass);
+	PY_ATTR_ENUM(cmsSigDisplayClass);
+	PY_ATTR_ENUM(cmsSigOutputClass);
+	PY_ATTR_ENUM(cmsSigLinkClass);
+	PY_ATTR_ENUM(cmsSigAbstractClass);
+	PY_ATTR_ENUM(cmsSigColorSpaceClass);
+	PY_ATTR_ENUM(cmsSigNamedColorClass);
+
+	m.def("get_color_space", [](ProfileArg hp) {
+		return (int)cmsGetColorSpace(hp);
+	}, "hprofile"_a, R"pbdoc(
+		Gets color space.
+
+		Parameters
+		----------
+		hp: PyCapsule
+			Profile handle
+
+		Returns
+		-------
+		int
+			cmsSigXYZData 0x58595A20 'XYZ '
+			cmsSigLabData 0x4C616220 'Lab '
+			cmsSigLuvData 0x4C757620 'Luv '
+			cmsSigYCbCrData 0x59436272 'YCbr'
+			cmsSigYxyData 0x59787920 'Yxy '
+			cmsSigRgbData 0x52474220 'RGB '
+			cmsSigGrayData 0x47524159 'GRAY'
+			cmsSigHsvData 0x48535620 'HSV '
+			cmsSigHlsData 0x484C5320 'HLS '
+			cmsSigCmykData 0x434D594B 'CMYK'
+			cmsSigCmyData 0x434D5920 'CMY '
+			cmsSigMCH1Data 0x4D434831 'MCH1'
+			cmsSigMCH2Data 0x4D434832 'MCH2'
+			cmsSigMCH3Data 0x4D434833 'MCH3'
+			cmsSigMCH4Data 0x4D434834 'MCH4'
+			cmsSigMCH5Data 0x4D434835 'MCH5'
+			cmsSigMCH6Data 0x4D434836 'MCH6'
+			cmsSigMCH7Data 0x4D434837 'MCH7'
+			cmsSigMCH8Data 0x4D434838 'MCH8'
+			cmsSigMCH9Data 0x4D434839 'MCH9'
+			cmsSigMCHAData 0x4D43483A 'MCHA'
+			cmsSigMCHBData 0x4D43483B 'MCHB'
+			cmsSigMCHCData 0x4D43483C 'MCHC'
+			cmsSigMCHDData 0x4D43483D 'MCHD'
+			cmsSigMCHEData 0x4D43483E 'MCHE'
+			cmsSigMCHFData 0x4D43483F 'MCHF'
+			cmsSigNamedData 0x6e6d636c 'nmcl'
+			cmsSig1colorData 0x31434C52 '1CLR'
+			cmsSig2colorData 0x32434C52 '2CLR'
+			cmsSig3colorData 0x33434C52 '3CLR'
+			cmsSig4colorData 0x34434C52 '4CLR'
+			cmsSig5colorData 0x35434C52 '5CLR'
+			cmsSig6colorData 0x36434C52 '6CLR'
+			cmsSig7colorData 0x37434C52 '7CLR'
+			cmsSig8colorData 0x38434C52 '8CLR'
+			cmsSig9colorData 0x39434C52 '9CLR'
+			cmsSig10colorData 0x41434C52 'ACLR'
+			cmsSig11colorData 0x42434C52 'BCLR'
+			cmsSig12colorData 0x43434C52 'CCLR'
+			cmsSig13colorData 0x44434C52 'DCLR'
+			cmsSig14colorData 0x45434C52 'ECLR'
+			cmsSig15colorData 0x46434C52 'FCLR'
+			cmsSigLuvKData 0x4C75764B 'LuvK'
+	)pbdoc");
+
+	PY_ATTR_ENUM(cmsSigXYZData);
+	PY_ATTR_ENUM(cmsSigLabData);
+	PY_ATTR_ENUM(cmsSigLuvData);
+	PY_ATTR_ENUM(cmsSigYCbCrData);
+	PY_ATTR_ENUM(cmsSigYxyData);
+	PY_ATTR_ENUM(cmsSigRgbData);
+	PY_ATTR_ENUM(cmsSigGrayData);
+	PY_ATTR_ENUM(cmsSigHsvData);
+	PY_ATTR_ENUM(cmsSigHlsData);
+	PY_ATTR_ENUM(cmsSigCmykData);
+	PY_ATTR_ENUM(cmsSigCmyData);
+	PY_ATTR_ENUM(cmsSigMCH1Data);
+	PY_ATTR_ENUM(cmsSigMCH2Data);
+	PY_ATTR_ENUM(cmsSigMCH3Data);
+	PY_ATTR_ENUM(cmsSigMCH4Data);
+	PY_ATTR_ENUM(cmsSigMCH5Data);
+	PY_ATTR_ENUM(cmsSigMCH6Data);
+	PY_ATTR_ENUM(cmsSigMCH7Data);
+	PY_ATTR_ENUM(cmsSigMCH8Data);
+	PY_ATTR_ENUM(cmsSigMCH9Data);
+	PY_ATTR_ENUM(cmsSigMCHAData);
+	PY_ATTR_ENUM(cmsSigMCHBData);
+	PY_ATTR_ENUM(cmsSigMCHCData);
+	PY_ATTR_ENUM(cmsSigMCHDData);
+	PY_ATTR_ENUM(cmsSigMCHEData);
+	PY_ATTR_ENUM(cmsSigMCHFData);
+	PY_ATTR_ENUM(cmsSigNamedData);
+	PY_ATTR_ENUM(cmsSig1colorData);
+	PY_ATTR_ENUM(cmsSig2colorData);
+	PY_ATTR_ENUM(cmsSig3colorData);
+	PY_ATTR_ENUM(cmsSig4colorData);
+	PY_ATTR_ENUM(cmsSig5colorData);
+	PY_ATTR_ENUM(cmsSig6colorData);
+	PY_ATTR_ENUM(cmsSig7colorData);
+	PY_ATTR_ENUM(cmsSig8colorData);
+	PY_ATTR_ENUM(cmsSig9colorData);
+	PY_ATTR_ENUM(cmsSig10colorData);
+	PY_ATTR_ENUM(cmsSig11colorData);
+	PY_ATTR_ENUM(cmsSig12colorData);
+	PY_ATTR_ENUM(cmsSig13colorData);
+	PY_ATTR_ENUM(cmsSig14colorData);
+	PY_ATTR_ENUM(cmsSig15colorData);
+	PY_ATTR_ENUM(cmsSigLuvKData);
+
+	m.def("get_available_b2an_list", [](ProfileArg hp) {
+		// Same tags as cmsReadTag() returns the same pointer, without reading them.
+		auto key = [&hp](cmsTagSignature sig) -> cmsUInt32Number {
+			if (!cmsIsTag(hp, sig)) {
+				return 0;
+			}
+			// cmsReadTag() follows the chain of links. Bounded for loops by cmsLinkTag().
+			for (int steps = 0; steps < MAX_TABLE_TAG; steps++) {
+				cmsTagSignature linked = cmsTagLinkedTo(hp, sig);
+				if (!linked) {
+					break;
+				}
+				sig = linked;
+			}
+			return sig;
+		};
+		cmsUInt32Number p0 = key(cmsSigBToA0Tag), p1 = key(cmsSigBToA1Tag), p2 = key(cmsSigBToA2Tag);
+		std::vector<std::string> r;
+		if (p1) {
+			r.push_back(std::string("B2A1"));
+		}
+		if (p0 != p1) {
+			r.push_back(std::string("B2A0"));
+		}
+		if (p2 != p1) {
+			r.push_back(std::string("B2A2"));
+		}
+		return r;
+	}, "hprofile"_a, R"pbdoc(
+		Gets available B2An list
+
+		Parameters
+		----------
+		hp: PyCapsule
+			Profile handle
+
+		Returns
+		-------
+		[str]
+			'B2A0', 'B2A1', and/or 'B2A2'
+	)pbdoc");
+
+	m.def("inspect_profile", [](py::object profile_content) -> py::object {
+		Py_buffer view;
+		if (PyObject_GetBuffer(profile_content.ptr(), &view, PyBUF_SIMPLE) != 0) {
+			throw py::error_already_set();
+		}
+		ProfileSummary s;
+		bool ok;
+		{
+			py::gil_scoped_release release;
+			ok = read_profile_summary_from_memory(view.buf, (size_t)view.len, s);
+		}
+		PyBuffer_Release(&view);
+		return ok ? py::object(profile_summary_dict(s)) : py::none();
+	}, "profile_content"_a, R"pbdoc(
+		Reads the header and the tag directory of a profile, without opening it.
+		Only the description and the copyright tags are read; LUTs are never decoded.
+
+		Parameters
+		----------
+		profile_content: bytes, or any C-contiguous buffer like bytearray, memoryview, mmap and ndarray
+
+		Returns
+		-------
+		Optional[dict]
+			None if it is not a profile.
+			size, cmm, version (e.g. 4.3), device_class, color_space, pcs (cmsSig* values), flags,
+			manufacturer, model, rendering_intent, creator: from the header.
+			header_profile_id: Optional[bytes], the profile ID field of the header as it is, not verified
+			against the computed MD5. None if not set.
+			description, copyright: Optional[str]. eng/USA if localized.
+			tags: {'A2B0': {'offset': int, 'size': int, 'type': Optional[str], 'linked': Optional[str],
+			'type_supported': Optional[bool]}, ...}.
+			linked is the tag whose data Little-CMS reads for the tag, following the chain of links.
+			Little-CMS links a tag to an earlier one of the same data only if their tag types are compatible.
+			type_supported is False if Little-CMS refuses to read the type for the tag, None if the tag is unknown to it.
+	)pbdoc");
+
+	m.def("inspect_profile_files", [](py::iterable paths, int n_threads) {
+		std::vector<NativePath> native_paths;
+		for (auto path : paths) {
+			native_paths.push_back(native_path(py::reinterpret_borrow<py::object>(path)));
+		}
+		if (n_threads <= 0) {
+			n_threads = (int)std::max(std::thread::hardware_concurrency(), 1u);
+		}
+		std::vector<ProfileSummary> summaries(native_paths.size());
+		std::unique_ptr<bool[]> ok(new bool[native_paths.size()]());
+		{
+			py::gil_scoped_release release;
+			parallel_for(native_paths.size(), n_threads, 1, [&](size_t begin, size_t end) {
+				for (size_t i = begin; i < end; i++) {
+					ok[i] = read_profile_summary_from_file(native_paths[i], summaries[i]);
+				}
+			});
+		}
+		py::list r;
+		for (size_t i = 0; i < summaries.size(); i++) {
+			r.append(ok[i] ? py::object(profile_summary_dict(summaries[i])) : py::none());
+		}
+		return r;
+	}, "paths"_a, "n_threads"_a = 0, R"pbdoc(
+		inspect_profile() of many files in parallel. Only the header, the tag directory
+		and the text tags are read from each file.
+
+		Parameters
+		----------
+		paths: Iterable[Union[str, os.PathLike]]
+		n_threads: int
+			Threads to read files. 0 for the number of the CPUs.
+
+		Returns
+		-------
+		[Optional[dict]]
+			Same as inspect_profile(), in the order of paths. None if unreadable or not a profile.
+	)pbdoc");
+
+	m.def("create_srgb_profile", []() {
+		return cmsCreate_sRGBProfile();
+	}, R"pbdoc(
+		Creates sRGB profile.
+	)pbdoc");
+
+	m.def("create_lab4_profile", [](py::object wtpt) {
+		if (wtpt.is_none()) {
+			return cmsCreateLab4Profile(NULL);
+		}
+		py::array_t<double> wtpt_arr = wtpt.cast<py::array_t<double>>();
+		py::buffer_info wtpt_bi = wtpt_arr.request();
+		if (wtpt_bi.ndim != 1 || wtpt_bi.shape[0] != 3) {
+			return (cmsHPROFILE)NULL;
+		}
+		auto wtpt_ptr = static_cast<double *>(wtpt_bi.ptr);
+		cmsCIExyY whitePoint;
+		whitePoint.x = wtpt_ptr[0];
+		whitePoint.y = wtpt_ptr[1];
+		whitePoint.Y = wtpt_ptr[2];
+		return cmsCreateLab4Profile(&whitePoint);
+	}, "wtpt"_a = py::none(), R"pbdoc(
+		Creates a Lab profile based on ICC v4.
+
+		Parameters
+		----------
+		wtpt: Optional[ndarray[float64]]
+			xyY values of white point. Shape=(3,). If None, D50 is used.
+
+		Returns
+		-------
+		PyCapsule
+			Profile handle. None if error.
+	)pbdoc");
+
+	m.def("create_lab2_profile", [](py::object wtpt) {
+		if (wtpt.is_none()) {
+			return cmsCreateLab2Profile(NULL);
+		}
+		py::array_t<double> wtpt_arr = wtpt.cast<py::array_t<double>>();
+		py::buffer_info wtpt_bi = wtpt_arr.request();
+		if (wtpt_bi.ndim != 1 || wtpt_bi.shape[0] != 3) {
+			return (cmsHPROFILE)NULL;
+		}
+		auto wtpt_ptr = static_cast<double *>(wtpt_bi.ptr);
+		cmsCIExyY whitePoint;
+		whitePoint.x = wtpt_ptr[0];
+		whitePoint.y = wtpt_ptr[1];
+		whitePoint.Y = wtpt_ptr[2];
+		return cmsCreateLab2Profile(&whitePoint);
+	}, "wtpt"_a = py::none(), R"pbdoc(
+		Creates a Lab profile based on ICC v2.
+
+		Parameters
+		----------
+		wtpt: Optional[ndarray[float64]]
+			xyY values of white point. Shape=(3,). If None, D50 is used.
+
+		Returns
+		-------
+		PyCapsule
+			Profile handle. None if error.
+	)pbdoc");
+
+	m.def("get_profile_description", [](ProfileArg hp) -> py::object {
+		int len = cmsGetProfileInfoASCII(hp, cmsInfoDescription, "eng", "USA", NULL, 0);
+		if (!len) {
+			return py::cast<py::none>(Py_None);
+		}
+
+		std::unique_ptr<char[]> buffer(new char[len]);
+		if (!cmsGetProfileInfoASCII(hp, cmsInfoDescription, "eng", "USA", buffer.get(), len))
+			return py::cast<py::none>(Py_None);
+
+		auto ret = std::string(buffer.get());
+		stripNonAscii(ret);
+		return (py::str)ret;
+	}, "hprofile"_a, R"pbdoc(
+		Gets profile description. eng/USA only.
+
+		Parameters
+		----------
+		hp: PyCapsule
+			Profile handle
+
+		Returns
+		-------
+		Optional[str]
+			None if error
+	)pbdoc");
+
+	m.def("create_transform", [](ProfileArg src_hp, int src_format, ProfileArg trg_hp, int trg_format, int intent, int flags, cmsContext context) {
+		cmsHTRANSFORM ht = create_transform_handle(src_hp, src_format, trg_hp, trg_format, intent, flags, context);
+		return surface_creation_errors(ht);
+	}, "src_hp"_a, "src_format"_a, "trg_hp"_a, "trg_format"_a, "intent"_a, "flags"_a, "context"_a = py::none(), R"pbdoc(
+		Creates transform.
+
+		Parameters
+		----------
+		src_hp: PyCapsule
+			Profile handle of source
+
+		src_format: int
+			Source format
+
+		trg_hp: PyCapsule
+			Profile handle of target
+
+		trg_format: int
+			Target format
+
+		intent: int
+			Color conversion intent
+			INTENT_PERCEPTUAL				0
+			INTENT_RELATIVE_COLORIMETRIC	1
+			INTENT_SATURATION				2
+			INTENT_ABSOLUTE_COLORIMETRIC	3
+
+		flags: int
+			Conversion flag
+			cmsFLAGS_BLACKPOINTCOMPENSATION	0x2000
+			cmsFLAGS_HIGHRESPRECALC			0x0400
+			cmsFLAGS_NULLTRANSFORM			0x0200
+			cmsFLAGS_NOOPTIMIZE				0x0100
+			cmsFLAGS_KEEP_SEQUENCE			0x0080
+			cmsFLAGS_COPY_ALPHA				0x04000000
+
+		context: Optional[PyCapsule]
+			Context handle by create_context(). None for the global context.
+
+		Returns
+		-------
+		PyCapsule
+			Transform handle
+	)pbdoc");
+
+	PY_ATTR_PT(INTENT_PERCEPTUAL);
+	PY_ATTR_PT(INTENT_RELATIVE_COLORIMETRIC);
+	PY_ATTR_PT(INTENT_SATURATION);
+	PY_ATTR_PT(INTENT_ABSOLUTE_COLORIMETRIC);
+
+	PY_ATTR_PT(cmsFLAGS_BLACKPOINTCOMPENSATION);
+	PY_ATTR_PT(cmsFLAGS_HIGHRESPRECALC);
+	PY_ATTR_PT(cmsFLAGS_NULLTRANSFORM);
+	PY_ATTR_PT(cmsFLAGS_NOOPTIMIZE);
+	PY_ATTR_PT(cmsFLAGS_KEEP_SEQUENCE);
+	PY_ATTR_PT(cmsFLAGS_COPY_ALPHA);
+
+	m.def("create_proofing_transform", [](ProfileArg src_hp, int src_format, ProfileArg trg_hp, int trg_format, ProfileArg proof_hp, int intent, int proof_intent, int flags, cmsContext context) {
+		cmsHTRANSFORM ht = create_proofing_transform_handle(src_hp, src_format, trg_hp, trg_format, proof_hp, intent, proof_intent, flags, context);
+		return surface_creation_errors(ht);
+	}, "src_hp"_a, "src_format"_a, "trg_hp"_a, "trg_format"_a, "proof_hp"_a, "intent"_a, "proof_intent"_a, "flags"_a, "context"_a = py::none(), R"pbdoc(
+		Creates soft proof transform.
+
+		Parameters
+		----------
+		src_hp: PyCapsule
+			Profile handle of source
+
+		src_format: int
+			Source format
+
+		trg_hp: PyCapsule
+			Profile handle of target
+
+		trg_format: int
+			Target format
+
+		proof_hp: PyCapsule
+			Profile handle to proof
+
+		intent: int
+			Color conversion intent
+			INTENT_PERCEPTUAL				0
+			INTENT_RELATIVE_COLORIMETRIC	1
+			INTENT_SATURATION				2
+			INTENT_ABSOLUTE_COLORIMETRIC	3
+
+		flags: int
+			Conversion flag
+			cmsFLAGS_BLACKPOINTCOMPENSATION	0x2000
+			cmsFLAGS_HIGHRESPRECALC			0x0400
+			cmsFLAGS_NULLTRANSFORM			0x0200
+			cmsFLAGS_NOOPTIMIZE				0x0100
+			cmsFLAGS_KEEP_SEQUENCE			0x0080
+			cmsFLAGS_GAMUTCHECK				0x1000
+			cmsFLAGS_SOFTPROOFING			0x4000
+			cmsFLAGS_COPY_ALPHA				0x04000000
+
+		context: Optional[PyCapsule]
+			Context handle by create_context(). None for the global context.
+
+		Returns
+		-------
+		PyCapsule
+			Transform handle
+	)pbdoc");
+
+	PY_ATTR_PT(cmsFLAGS_GAMUTCHECK);
+	PY_ATTR_PT(cmsFLAGS_SOFTPROOFING);
+
+	m.def("create_multiprofile_transform", [](std::vector<ProfileArg> profiles, int src_format, int trg_format, int intent, int flags, cmsContext context) {
+		std::vector<cmsHPROFILE> hps(profiles.begin(), profiles.end());
+		cmsHTRANSFORM ht = create_multiprofile_transform_handle(hps, src_format, trg_format, intent, flags, context);
+		return surface_creation_errors(ht);
+	}, "profiles"_a, "src_format"_a, "trg_format"_a, "intent"_a, "flags"_a, "context"_a = py::none(), R"pbdoc(
+		Creates transform through a chain of profiles, e.g. camera -> working space -> printer,
+		as one optimized pipeline without intermediate buffers.
+
+		Parameters
+		----------
+		profiles: [PyCapsule]
+			Profile handles from source to target. Up to 255.
+
+		src_format: int
+			Source format
+
+		trg_format: int
+			Target format
+
+		intent: int
+			Color conversion intent of all the steps. See create_transform().
+
+		flags: int
+			Conversion flag. See create_transform(). cmsFLAGS_BLACKPOINTCOMPENSATION applies to all the steps.
+
+		context: Optional[PyCapsule]
+			Context handle by create_context(). None for the global context.
+
+		Returns
+		-------
+		PyCapsule
+			Transform handle. None if error.
+	)pbdoc");
+
+	m.def("create_extended_transform", [](std::vector<ProfileArg> profiles, int src_format, int trg_format, std::vector<cmsUInt32Number> intents,
+		py::object bpc, py::object adaptation, int flags, ProfileArg gamut_hp, cmsUInt32Number gamut_pcs_position, cmsContext context) {
+		std::vector<cmsHPROFILE> hps(profiles.begin(), profiles.end());
+		size_t n = hps.size();
+		std::vector<cmsBool> bpc_v(n, (flags & cmsFLAGS_BLACKPOINTCOMPENSATION) ? TRUE : FALSE);
+		if (!bpc.is_none()) {
+			auto v = bpc.cast<std::vector<bool>>();
+			bpc_v.assign(v.begin(), v.end());
+		}
+		std::vector<cmsFloat64Number> adaptation_v(n, cmsSetAdaptationStateTHR(context, -1));
+		if (!adaptation.is_none()) {
+			adaptation_v = adaptation.cast<std::vector<cmsFloat64Number>>();
+		}
+		cmsHTRANSFORM ht = create_extended_transform_handle(hps, intents, bpc_v, adaptation_v, gamut_hp, gamut_pcs_position,
+			src_format, trg_format, flags, context);
+		return surface_creation_errors(ht);
+	}, "profiles"_a, "src_format"_a, "trg_format"_a, "intents"_a, "bpc"_a = py::none(), "adaptation"_a = py::none(),
+	"flags"_a = 0, "gamut_hp"_a = py::none(), "gamut_pcs_position"_a = 0, "context"_a = py::none(), R"pbdoc(
+		Creates transform through a chain of profiles with settings per step, by cmsCreateExtendedTransform().
+
+		Parameters
+		----------
+		profiles: [PyCapsule]
+			Profile handles from source to target. Up to 255.
+
+		src_format: int
+			Source format
+
+		trg_format: int
+			Target format
+
+		intents: [int]
+			Color conversion intent of each profile. See create_transform().
+
+		bpc: Optional[[bool]]
+			Black point compensation of each profile. None for cmsFLAGS_BLACKPOINTCOMPENSATION of flags.
+
+		adaptation: Optional[[float]]
+			Adaptation state of each profile, 0 (no adaptation) to 1 (full). None for the current global state.
+
+		flags: int
+			Conversion flag. See create_transform() and create_proofing_transform().
+
+		gamut_hp: Optional[PyCapsule]
+			Profile handle for gamut check with cmsFLAGS_GAMUTCHECK.
+
+		gamut_pcs_position: int
+			Index of the profile whose PCS the gamut check takes.
+
+		context: Optional[PyCapsule]
+			Context handle by create_context(). None for the global context.
+
+		Returns
+		-------
+		PyCapsule
+			Transform handle. None if the lengths of intents, bpc and adaptation differ from profiles, or error.
+	)pbdoc");
+
+	m.def("set_alarm_codes", [](py::array_t<cmsUInt16Number> alarm_codes) {
+		py::buffer_info alarm_codes_bi = alarm_codes.request();
+		if (alarm_codes_bi.ndim != 1 || alarm_codes_bi.shape[0] != cmsMAXCHANNELS) {
+			return 0;
+		}
+		auto alarm_codes_ptr = static_cast<cmsUInt16Number *>(alarm_codes_bi.ptr);
+		cmsSetAlarmCodes(alarm_codes_ptr);
+		return -1;
+	}, "alarm_codes"_a, R"pbdoc(
+		Sets the global codes used to mark out-out-gamut on Proofing transforms. Values are meant to be encoded in 16 bits.
+		Set cmsFLAGS_GAMUTCHECK and cmsFLAGS_SOFTPROOFING in create_proofing_transform().
+
+		Parameters
+		----------
+		alarm_codes: [uint16], shape=(16)
+
+		Returns
+		-------
+		int
+			0 if fail
+	)pbdoc");
+
+	m.def("set_adaptation_state", [](double state, cmsContext context) {
+		return cmsSetAdaptationStateTHR(context, state);
+	}, "state"_a, "context"_a = py::none(), R"pbdoc(
+		Sets the adaptation state of the observer for INTENT_ABSOLUTE_COLORIMETRIC of the transforms
+		created after, 1 for full adaptation (default) to 0 for none. The transform cache takes it into the keys.
+
+		Parameters
+		----------
+		state: float
+			Adaptation state. Negative to get the current one without changing.
+		context: Optional[PyCapsule]
+			Context handle by create_context(). None for the global context.
+
+		Returns
+		-------
+		float
+			The previous adaptation state
+	)pbdoc");
+	
+	m.def("get_transform_formatter", [](int fl, int pt, int n_ch, int n_byte, int swap, int extra, int swap_first, int premul) {
+		return (FLOAT_SH(fl) | COLORSPACE_SH(pt) | CHANNELS_SH(n_ch) | BYTES_SH(n_byte) | DOSWAP_SH(swap) | EXTRA_SH(extra)
+			| SWAPFIRST_SH(swap_first) | PREMUL_SH(premul));
+	}, "is_float"_a, "pixel_type"_a, "n_ch"_a, "n_byte"_a, "swap"_a, "extra"_a, "swap_first"_a = 0, "premul"_a = 0, R"pbdoc(
+		Calculates transform formatter.
+
+		Parameters
+		----------
+		is_float: int
+			0 or 1
+		pixel_type: int
+			Colorspace type
+			PT_ANY       0    // Don't check colorspace
+			PT_GRAY      3
+			PT_RGB       4
+			PT_CMY       5
+			PT_CMYK      6
+			PT_YCbCr     7
+			PT_YUV       8      // Lu'v'
+			PT_XYZ       9
+			PT_Lab       10
+			PT_YUVK      11     // Lu'v'K
+			PT_HSV       12
+			PT_HLS       13
+			PT_Yxy       14
+
+		n_ch: int
+			Number of channel. Alpha channel is not included here.
+
+		n_byte: int
+			Number of byte of a channel. uint16 should be 2. float32 should be 4, float64 should be 0.
+
+		swap: int
+			1 if BGR order, not RGB
+		
+		extra: int
+			1 if there is alpha channel
+			Extra channels are left as they are in the output, unless cmsFLAGS_COPY_ALPHA is given to the transform.
+
+		swap_first: int
+			1 if the extra channel comes first (ARGB). With swap=1, 1 if it comes last (BGRA), not first (ABGR).
+
+		premul: int
+			1 if the colors are premultiplied by the alpha channel. Needs extra=1.
+	)pbdoc");
+
+	PY_ATTR_PT(PT_ANY);
+	PY_ATTR_PT(PT_GRAY);
+	PY_ATTR_PT(PT_RGB);
+	PY_ATTR_PT(PT_CMY);
+	PY_ATTR_PT(PT_CMYK);
+	PY_ATTR_PT(PT_YCbCr);
+	PY_ATTR_PT(PT_YUV);
+	PY_ATTR_PT(PT_XYZ);
+	PY_ATTR_PT(PT_Lab);
+	PY_ATTR_PT(PT_YUVK);
+	PY_ATTR_PT(PT_HSV);
+	PY_ATTR_PT(PT_HLS);
+	PY_ATTR_PT(PT_Yxy);
+
+	m.def("transform_to_device_link", [](TransformArg ht, double version, int flags) {
+		return cmsTransform2DeviceLink(ht, version, flags);
+	}, "htransform"_a, "version"_a = 4.3, "flags"_a = 0, R"pbdoc(
+		Bakes a transform into a device link profile. The device link can be saved by dump_profile(),
+		and create_transform_from_device_link() rebuilds the transform without precalculation of
+		the original profiles.
+
+		create_transform_from_device_link() optimizes the embedded pipeline again, unless
+		cmsFLAGS_NOOPTIMIZE is passed. The second optimization resamples the pipeline, so the round trip
+		can differ from the original transform by more than a few levels with some profiles.
+		Pass cmsFLAGS_NOOPTIMIZE to evaluate the pipeline as it was baked.
+
+		Parameters
+		----------
+		htransform: PyCapsule
+			Transform handle
+		version: float
+			ICC version of the device link. 4.3 or 2.1 (lut16).
+		flags: int
+			cmsFLAGS_GUESSDEVICECLASS		0x0020
+			cmsFLAGS_KEEP_SEQUENCE			0x0080
+
+		Returns
+		-------
+		PyCapsule
+			Profile handle. None if error.
+	)pbdoc");
 
-bool invalidChar (char c) {  
-    return c < 32 || c >= 127;
-} 
+	PY_ATTR_PT(cmsFLAGS_GUESSDEVICECLASS);
 
-void stripNonAscii(std::string &str) { 
-    str.erase(remove_if(str.begin(),str.end(), invalidChar), str.end());  
-}
+	m.def("create_transform_from_device_link", [](ProfileArg link_hp, int src_format, int trg_format, int flags, cmsContext context) {
+		int intent = (int)cmsGetHeaderRenderingIntent(link_hp);
+		cmsHTRANSFORM ht = create_cached_transform(DEVICE_LINK_TRANSFORM_KEY, [&](TransformKey &key) {
+			for (uint64_t v : {(uint64_t)src_format, (uint64_t)trg_format, (uint64_t)intent, (uint64_t)flags}) {
+				key.add_int(v);
+			}
+			key.add_context(context);
+			key.add_double(cmsSetAdaptationStateTHR(context, -1));
+			return key.add_profile(link_hp);
+		}, [&]() {
+			return cmsCreateTransformTHR(context, link_hp, src_format, NULL, trg_format, intent, flags);
+		});
+		return surface_creation_errors(ht);
+	}, "link_hp"_a, "src_format"_a, "trg_format"_a, "flags"_a = 0, "context"_a = py::none(), R"pbdoc(
+		Creates transform from a device link profile, like the one by transform_to_device_link().
+		The rendering intent in the header of the device link is used.
 
-std::map<std::string, cmsTagSignature> get_lut_tag_map() {
-	auto lut_tag_map = std::map<std::string, cmsTagSignature>();
-	lut_tag_map["B2A0"] = cmsSigBToA0Tag;
-	lut_tag_map["B2A1"] = cmsSigBToA1Tag;
-	lut_tag_map["B2A2"] = cmsSigBToA2Tag;
-	lut_tag_map["A2B0"] = cmsSigAToB0Tag;
-	lut_tag_map["A2B1"] = cmsSigAToB1Tag;
-	lut_tag_map["A2B2"] = cmsSigAToB2Tag;
-	lut_tag_map["gamt"] = cmsSigGamutTag;
-	return lut_tag_map;
-}
+		The pipeline of the device link is optimized again unless cmsFLAGS_NOOPTIMIZE is in flags.
+		For the device links by transform_to_device_link(), cmsFLAGS_NOOPTIMIZE keeps the baked pipeline.
 
-static py::function ERROR_HANDLER;
-void CmmLogErrorHandler(cmsContext context, cmsUInt32Number error_code, const char *text)
-{
-	std::string msg = text;
-	ERROR_HANDLER(error_code, msg);
-}
+		Parameters
+		----------
+		link_hp: PyCapsule
+			Profile handle of device link
 
-PYBIND11_MODULE(cmm, m) {
+		src_format: int
+			Source format
 
-#define PY_ATTR_PT(_a) m.attr(#_a) = _a
-#define PY_ATTR_ENUM(_a) m.attr(#_a) = (int)_a
+		trg_format: int
+			Target format
 
-    m.doc() = R"pbdoc(
-        Color Management Module
-        -----------------------
+		flags: int
+			Conversion flag. See create_transform().
 
-        .. currentmodule:: cmm
+		context: Optional[PyCapsule]
+			Context handle by create_context(). None for the global context.
 
-        .. autosummary::
-           :toctree: _generate
-    )pbdoc";
+		Returns
+		-------
+		PyCapsule
+			Transform handle. None if error.
+	)pbdoc");
 
-	m.def("set_log_error_handler", [](py::function handler) {
-		ERROR_HANDLER = handler;
-		cmsSetLogErrorHandler(CmmLogErrorHandler);
-	}, "handler"_a, R"pbdoc(
-		Set log error handler.
+	m.def("set_transform_cache_size", [](size_t size) {
+		TRANSFORM_CACHE.set_capacity(size);
+	}, "size"_a, R"pbdoc(
+		Sets the number of transforms kept by the transform cache. 0 disables the cache (default).
+
+		While the cache is enabled, create_transform(), create_proofing_transform(), create_transform_from_device_link()
+		and the multi-profile transforms return the same handle for the same profiles, formats, intents, flags,
+		adaptation state and context. Profiles are compared by the MD5 computed once per handle (again after
+		add_lut16() and link_tag()), not by the profile ID in the header, which is left as it is.
+		Call delete_transform() for each returned handle as usual.
 
 		Parameters
 		----------
-		handler: Callable[[uint32, str], None]
-			uint32:
-				cmsERROR_UNDEFINED           0
-				cmsERROR_FILE                1
-				cmsERROR_RANGE               2
-				cmsERROR_INTERNAL            3
-				cmsERROR_NULL                4
-				cmsERROR_READ                5
-				cmsERROR_SEEK                6
-				cmsERROR_WRITE               7
-				cmsERROR_UNKNOWN_EXTENSION   8
-				cmsERROR_COLORSPACE_CHECK    9
-				cmsERROR_ALREADY_DEFINED     10
-				cmsERROR_BAD_SIGNATURE       11
-				cmsERROR_CORRUPTION_DETECTED 12
-				cmsERROR_NOT_SUITABLE        13
-			str: Error message
+		size: int
 	)pbdoc");
 
-	PY_ATTR_PT(cmsERROR_UNDEFINED);
-	PY_ATTR_PT(cmsERROR_FILE);
-	PY_ATTR_PT(cmsERROR_RANGE);
-	PY_ATTR_PT(cmsERROR_INTERNAL);
-	PY_ATTR_PT(cmsERROR_NULL);
-	PY_ATTR_PT(cmsERROR_READ);
-	PY_ATTR_PT(cmsERROR_SEEK);
-	PY_ATTR_PT(cmsERROR_WRITE);
-	PY_ATTR_PT(cmsERROR_UNKNOWN_EXTENSION);
-	PY_ATTR_PT(cmsERROR_COLORSPACE_CHECK);
-	PY_ATTR_PT(cmsERROR_ALREADY_DEFINED);
-	PY_ATTR_PT(cmsERROR_BAD_SIGNATURE);
-	PY_ATTR_PT(cmsERROR_CORRUPTION_DETECTED);
-	PY_ATTR_PT(cmsERROR_NOT_SUITABLE);
+	m.def("get_transform_cache_info", []() {
+		return TRANSFORM_CACHE.info();
+	}, R"pbdoc(
+		Gets the statistics of the transform cache.
 
-	m.def("unset_log_error_handler", [](void) {
-		cmsSetLogErrorHandler(NULL);
-		ERROR_HANDLER = py::function();
+		Returns
+		-------
+		dict
+			'hits', 'misses', 'size' and 'capacity'
+	)pbdoc");
+
+	m.def("clear_transform_cache", []() {
+		TRANSFORM_CACHE.clear();
 	}, R"pbdoc(
-		Unset log error handler.
+		Drops all transforms from the transform cache. The handles in use are still valid.
 	)pbdoc");
 
-	m.def("open_profile_from_mem", [](py::bytes profile_content) {
-		auto s = (std::string)profile_content;
-		cmsHPROFILE hp = cmsOpenProfileFromMem(s.c_str(), (cmsUInt32Number)s.length());
-		if (!hp) {
-			return (cmsHPROFILE)NULL;
-		}
-		return hp;
-	}, "profile_content"_a, R"pbdoc(
-		Opens ICC profile from memory.
+	m.def("enable_stats", [](bool enabled) {
+		STATS.enabled = enabled;
+	}, "enabled"_a = true, R"pbdoc(
+		Enables or disables the instrumentation of get_stats(). Disabled by default.
+		When disabled, it costs an atomic load per call.
 
 		Parameters
 		----------
-		profile_content: bytes
+		enabled: bool
+	)pbdoc");
+
+	m.def("get_stats", []() {
+		return py::dict(
+			"enabled"_a = STATS.enabled.load(),
+			"do_transform"_a = STATS.transform.info("pixels"),
+			"create_transform"_a = STATS.create.info(nullptr),
+			"open_profile"_a = STATS.open_profile.info(nullptr),
+			"transform_cache"_a = TRANSFORM_CACHE.info());
+	}, R"pbdoc(
+		Gets the counters since enable_stats() or reset_stats().
 
 		Returns
 		-------
-		PyCapsule
-			Profile handle. None if error.
+		dict
+			'do_transform': calls, pixels, ns and max_ns of do_transform_*() and do_transform_image().
+			'create_transform': calls, ns and max_ns of the creation (precalculation) of transforms.
+				Cache hits are not included.
+			'open_profile': calls, ns and max_ns of opening profiles. Little-CMS reads tags lazily,
+				so it is the header and tag directory.
+			'transform_cache': Same as get_transform_cache_info().
 	)pbdoc");
 
-	m.def("close_profile", [](cmsHPROFILE hp) {
-		cmsCloseProfile(hp);
-	}, "hprofile"_a, R"pbdoc(
-		Closes ICC profile.
+	m.def("get_transform_stats", [](TransformArg ht) {
+		return STATS.transform_info(ht);
+	}, "htransform"_a, R"pbdoc(
+		Gets the counters of a transform.
 
 		Parameters
 		----------
-		hp: PyCapsule
-			Profile handle
+		htransform: PyCapsule
+			Transform handle
+
+		Returns
+		-------
+		dict
+			calls, pixels and ns. None if no call is counted.
 	)pbdoc");
 
-	m.def("get_device_class", [](cmsHPROFILE hp) {
-		return (int)cmsGetDeviceClass(hp);
-	}, "hprofile"_a, R"pbdoc(
-		Gets device class of a profile.
+	m.def("reset_stats", []() {
+		STATS.reset();
+	}, R"pbdoc(
+		Resets the counters of get_stats() and get_transform_stats().
+	)pbdoc");
+
+	m.def("delete_transform", [](py::object ht) {
+		if (py::isinstance<Transform>(ht)) {
+			ht.cast<Transform &>().close();
+		} else {
+			delete_transform_handle(ht.cast<TransformArg>());
+		}
+	}, "htransform"_a, R"pbdoc(
+		Deletes transform. A cached transform is deleted when every caller has deleted it
+		and it is out of the cache.
 
 		Parameters
 		----------
-		hp: PyCapsule
-			Profile handle
-
-		Returns
-		-------
-		int
-			cmsSigInputClass 0x73636E72 'scnr'
-			cmsSigDisplayClass 0x6D6E7472 'mntr'
-			cmsSigOutputClass 0x70727472 'prtr'
-			cmsSigLinkClass 0x6C696E6B 'link'
-			cmsSigAbstractClass 0x61627374 'abst'
-			cmsSigColorSpaceClass 0x73706163 'spac'
-			cmsSigNamedColorClass 0x6e6d636c 'nmcl' 
+		htransform: PyCapsule
+			Transform handle
 	)pbdoc");
 
-	PY_ATTR_ENUM(cmsSigInputClass);
-	PY_ATTR_ENUM(cmsSigDisplayClass);
-	PY_ATTR_ENUM(cmsSigOutputClass);
-	PY_ATTR_ENUM(cmsSigLinkClass);
-	PY_ATTR_ENUM(cmsSigAbstractClass);
-	PY_ATTR_ENUM(cmsSigColorSpaceClass);
-	PY_ATTR_ENUM(cmsSigNamedColorClass);
-
-	m.def("get_color_space", [](cmsHPROFILE hp) {
-		return (int)cmsGetColorSpace(hp);
-	}, "hprofile"_a, R"pbdoc(
-		Gets color space.
+	m.def("set_num_threads", [](int n_threads) {
+		if (n_threads <= 0) {
+			n_threads = std::max((int)std::thread::hardware_concurrency(), 1);
+		}
+		NUM_THREADS = n_threads;
+	}, "n_threads"_a, R"pbdoc(
+		Sets the number of threads used by do_transform_*(). The GIL is released while transforming,
+		and the pixels are split into tiles when n_threads > 1. The result is the same as the serial one.
 
 		Parameters
 		----------
-		hp: PyCapsule
-			Profile handle
+		n_threads: int
+			1 for serial (default). 0 or negative for the number of CPUs.
+	)pbdoc");
+
+	m.def("get_num_threads", []() {
+		return NUM_THREADS.load();
+	}, R"pbdoc(
+		Gets the number of threads used by do_transform_*().
 
 		Returns
 		-------
 		int
-			cmsSigXYZData 0x58595A20 'XYZ '
-			cmsSigLabData 0x4C616220 'Lab '
-			cmsSigLuvData 0x4C757620 'Luv '
-			cmsSigYCbCrData 0x59436272 'YCbr'
-			cmsSigYxyData 0x59787920 'Yxy '
-			cmsSigRgbData 0x52474220 'RGB '
-			cmsSigGrayData 0x47524159 'GRAY'
-			cmsSigHsvData 0x48535620 'HSV '
-			cmsSigHlsData 0x484C5320 'HLS '
-			cmsSigCmykData 0x434D594B 'CMYK'
-			cmsSigCmyData 0x434D5920 'CMY '
-			cmsSigMCH1Data 0x4D434831 'MCH1'
-			cmsSigMCH2Data 0x4D434832 'MCH2'
-			cmsSigMCH3Data 0x4D434833 'MCH3'
-			cmsSigMCH4Data 0x4D434834 'MCH4'
-			cmsSigMCH5Data 0x4D434835 'MCH5'
-			cmsSigMCH6Data 0x4D434836 'MCH6'
-			cmsSigMCH7Data 0x4D434837 'MCH7'
-			cmsSigMCH8Data 0x4D434838 'MCH8'
-			cmsSigMCH9Data 0x4D434839 'MCH9'
-			cmsSigMCHAData 0x4D43483A 'MCHA'
-			cmsSigMCHBData 0x4D43483B 'MCHB'
-			cmsSigMCHCData 0x4D43483C 'MCHC'
-			cmsSigMCHDData 0x4D43483D 'MCHD'
-			cmsSigMCHEData 0x4D43483E 'MCHE'
-			cmsSigMCHFData 0x4D43483F 'MCHF'
-			cmsSigNamedData 0x6e6d636c 'nmcl'
-			cmsSig1colorData 0x31434C52 '1CLR'
-			cmsSig2colorData 0x32434C52 '2CLR'
-			cmsSig3colorData 0x33434C52 '3CLR'
-			cmsSig4colorData 0x34434C52 '4CLR'
-			cmsSig5colorData 0x35434C52 '5CLR'
-			cmsSig6colorData 0x36434C52 '6CLR'
-			cmsSig7colorData 0x37434C52 '7CLR'
-			cmsSig8colorData 0x38434C52 '8CLR'
-			cmsSig9colorData 0x39434C52 '9CLR'
-			cmsSig10colorData 0x41434C52 'ACLR'
-			cmsSig11colorData 0x42434C52 'BCLR'
-			cmsSig12colorData 0x43434C52 'CCLR'
-			cmsSig13colorData 0x44434C52 'DCLR'
-			cmsSig14colorData 0x45434C52 'ECLR'
-			cmsSig15colorData 0x46434C52 'FCLR'
-			cmsSigLuvKData 0x4C75764B 'LuvK'
 	)pbdoc");
 
-	PY_ATTR_ENUM(cmsSigXYZData);
-	PY_ATTR_ENUM(cmsSigLabData);
-	PY_ATTR_ENUM(cmsSigLuvData);
-	PY_ATTR_ENUM(cmsSigYCbCrData);
-	PY_ATTR_ENUM(cmsSigYxyData);
-	PY_ATTR_ENUM(cmsSigRgbData);
-	PY_ATTR_ENUM(cmsSigGrayData);
-	PY_ATTR_ENUM(cmsSigHsvData);
-	PY_ATTR_ENUM(cmsSigHlsData);
-	PY_ATTR_ENUM(cmsSigCmykData);
-	PY_ATTR_ENUM(cmsSigCmyData);
-	PY_ATTR_ENUM(cmsSigMCH1Data);
-	PY_ATTR_ENUM(cmsSigMCH2Data);
-	PY_ATTR_ENUM(cmsSigMCH3Data);
-	PY_ATTR_ENUM(cmsSigMCH4Data);
-	PY_ATTR_ENUM(cmsSigMCH5Data);
-	PY_ATTR_ENUM(cmsSigMCH6Data);
-	PY_ATTR_ENUM(cmsSigMCH7Data);
-	PY_ATTR_ENUM(cmsSigMCH8Data);
-	PY_ATTR_ENUM(cmsSigMCH9Data);
-	PY_ATTR_ENUM(cmsSigMCHAData);
-	PY_ATTR_ENUM(cmsSigMCHBData);
-	PY_ATTR_ENUM(cmsSigMCHCData);
-	PY_ATTR_ENUM(cmsSigMCHDData);
-	PY_ATTR_ENUM(cmsSigMCHEData);
-	PY_ATTR_ENUM(cmsSigMCHFData);
-	PY_ATTR_ENUM(cmsSigNamedData);
-	PY_ATTR_ENUM(cmsSig1colorData);
-	PY_ATTR_ENUM(cmsSig2colorData);
-	PY_ATTR_ENUM(cmsSig3colorData);
-	PY_ATTR_ENUM(cmsSig4colorData);
-	PY_ATTR_ENUM(cmsSig5colorData);
-	PY_ATTR_ENUM(cmsSig6colorData);
-	PY_ATTR_ENUM(cmsSig7colorData);
-	PY_ATTR_ENUM(cmsSig8colorData);
-	PY_ATTR_ENUM(cmsSig9colorData);
-	PY_ATTR_ENUM(cmsSig10colorData);
-	PY_ATTR_ENUM(cmsSig11colorData);
-	PY_ATTR_ENUM(cmsSig12colorData);
-	PY_ATTR_ENUM(cmsSig13colorData);
-	PY_ATTR_ENUM(cmsSig14colorData);
-	PY_ATTR_ENUM(cmsSig15colorData);
-	PY_ATTR_ENUM(cmsSigLuvKData);
-
-	m.def("get_available_b2an_list", [](cmsHPROFILE hp) {
-		void *p0 = NULL, *p1 = NULL, *p2 = NULL;
-		if (cmsIsTag(hp, cmsSigBToA0Tag)) {
-			p0 = cmsReadTag(hp, cmsSigBToA0Tag);
-		}
-		if (cmsIsTag(hp, cmsSigBToA1Tag)) {
-			p1 = cmsReadTag(hp, cmsSigBToA1Tag);
-		}
-		if (cmsIsTag(hp, cmsSigBToA2Tag)) {
-			p2 = cmsReadTag(hp, cmsSigBToA2Tag);
-		}
-		std::vector<std::string> r;
-		if (p1) {
-			r.push_back(std::string("B2A1"));
-		}
-		if (p0 != p1) {
-			r.push_back(std::string("B2A0"));
-		}
-		if (p2 != p1) {
-			r.push_back(std::string("B2A2"));
+	m.def("set_clut_engine_isa", [](std::string isa) {
+		for (int i = CLUT_ISA_OFF; i <= CLUT_ISA_AVX2; i++) {
+			if (isa == CLUT_ISA_NAMES[i] && cpu_supports((ClutIsa)i)) {
+				CLUT_ISA = i;
+				return -1;
+			}
 		}
-		return r;
-	}, "hprofile"_a, R"pbdoc(
-		Gets available B2An list
+		return 0;
+	}, "isa"_a, R"pbdoc(
+		Sets the instruction set of the CLUT engine. The engine evaluates [curves] CLUT [curves]
+		pipelines with 16-bit tables by tetrahedral interpolation, bit-exact with Little-CMS.
+		It is used by eval_lut16() and do_transform_16_16() / do_transform_16_8() of large inputs.
+		The best one of the CPU is selected by default.
 
 		Parameters
-		----------
-		hp: PyCapsule
-			Profile handle
+		----------
+		isa: str
+			'avx2', 'sse4.1', 'scalar', or 'off'
 
 		Returns
 		-------
-		[str]
-			'B2A0', 'B2A1', and/or 'B2A2'
+		int
+			0 if the CPU does not support it
 	)pbdoc");
 
-	m.def("create_srgb_profile", []() {
-		return cmsCreate_sRGBProfile();
+	m.def("get_clut_engine_isa", []() {
+		return std::string(CLUT_ISA_NAMES[CLUT_ISA.load()]);
 	}, R"pbdoc(
-		Creates sRGB profile.
+		Gets the instruction set of the CLUT engine.
+
+		Returns
+		-------
+		str
+			'avx2', 'sse4.1', 'scalar', or 'off'
 	)pbdoc");
 
-	m.def("create_lab4_profile", [](py::object wtpt) {
-		if (wtpt.is_none()) {
-			return cmsCreateLab4Profile(NULL);
+	m.def("create_context", [](int n_threads, size_t min_pixels_per_thread, bool raise_errors) {
+		if (n_threads <= 0) {
+			n_threads = std::max((int)std::thread::hardware_concurrency(), 1);
 		}
-		py::array_t<double> wtpt_arr = wtpt.cast<py::array_t<double>>();
-		py::buffer_info wtpt_bi = wtpt_arr.request();
-		if (wtpt_bi.ndim != 1 || wtpt_bi.shape[0] != 3) {
-			return (cmsHPROFILE)NULL;
+		auto data = new CmmContextData(n_threads, std::max(min_pixels_per_thread, (size_t)1), raise_errors);
+		cmsContext context = cmsCreateContext(NULL, data);
+		if (!context) {
+			delete data;
+			return (cmsContext)NULL;
 		}
-		auto wtpt_ptr = static_cast<double *>(wtpt_bi.ptr);
-		cmsCIExyY whitePoint;
-		whitePoint.x = wtpt_ptr[0];
-		whitePoint.y = wtpt_ptr[1];
-		whitePoint.Y = wtpt_ptr[2];
-		return cmsCreateLab4Profile(&whitePoint);
-	}, "wtpt"_a = py::none(), R"pbdoc(
-		Creates a Lab profile based on ICC v4.
+		cmsSetLogErrorHandlerTHR(context, CmmCollectErrorHandler);
+#ifdef CMM_LCMS2_THREADED
+		if (!cmsPluginTHR(context, cmsThreadedExtensions(n_threads, 0))) {
+			cmsDeleteContext(context);
+			delete data;
+			return (cmsContext)NULL;
+		}
+		data->lcms2_threaded = true;
+#endif
+		return context;
+	}, "n_threads"_a = 0, "min_pixels_per_thread"_a = MIN_PIXELS_PER_TILE, "raise_errors"_a = false, R"pbdoc(
+		Creates a context. Transforms created with the context use its thread settings
+		instead of set_num_threads().
+
+		Errors of the context do not go to the handler of set_log_error_handler(). They are collected
+		on each thread without lock, and after the call they raise LcmsError (raise_errors=True) or
+		are kept for get_context_errors().
+
+		If the module is built with CMM_LCMS2_THREADED, the threaded plugin of Little-CMS is
+		registered to the context. The plugin decides the tile size by itself, so min_pixels_per_thread
+		is not used.
 
 		Parameters
 		----------
-		wtpt: Optional[ndarray[float64]]
-			xyY values of white point. Shape=(3,). If None, D50 is used.
+		n_threads: int
+			Number of threads. 0 or negative for the number of CPUs.
+		min_pixels_per_thread: int
+			Minimum number of pixels of a tile. Small transforms are not split.
+		raise_errors: bool
+			Raises LcmsError after a call with errors.
 
 		Returns
 		-------
 		PyCapsule
-			Profile handle. None if error.
+			Context handle. None if error.
 	)pbdoc");
 
-	m.def("create_lab2_profile", [](py::object wtpt) {
-		if (wtpt.is_none()) {
-			return cmsCreateLab2Profile(NULL);
+	m.def("get_context_errors", [](cmsContext context) {
+		std::vector<std::tuple<cmsUInt32Number, std::string>> r;
+		auto data = get_context_data(context);
+		if (!data) {
+			return r;
 		}
-		py::array_t<double> wtpt_arr = wtpt.cast<py::array_t<double>>();
-		py::buffer_info wtpt_bi = wtpt_arr.request();
-		if (wtpt_bi.ndim != 1 || wtpt_bi.shape[0] != 3) {
-			return (cmsHPROFILE)NULL;
+		std::lock_guard<std::mutex> lock(data->errors_mtx);
+		for (auto &e : data->errors) {
+			r.emplace_back(e.code, e.msg);
 		}
-		auto wtpt_ptr = static_cast<double *>(wtpt_bi.ptr);
-		cmsCIExyY whitePoint;
-		whitePoint.x = wtpt_ptr[0];
-		whitePoint.y = wtpt_ptr[1];
-		whitePoint.Y = wtpt_ptr[2];
-		return cmsCreateLab2Profile(&whitePoint);
-	}, "wtpt"_a = py::none(), R"pbdoc(
-		Creates a Lab profile based on ICC v2.
+		data->errors.clear();
+		return r;
+	}, "context"_a, R"pbdoc(
+		Gets and clears the errors of a context.
 
 		Parameters
 		----------
-		wtpt: Optional[ndarray[float64]]
-			xyY values of white point. Shape=(3,). If None, D50 is used.
+		context: PyCapsule
+			Context handle by create_context()
 
 		Returns
 		-------
-		PyCapsule
-			Profile handle. None if error.
+		[(int, str)]
+			Error code and message. See set_log_error_handler().
 	)pbdoc");
 
-	m.def("get_profile_description", [](cmsHPROFILE hp) -> py::object {
-		int len = cmsGetProfileInfoASCII(hp, cmsInfoDescription, "eng", "USA", NULL, 0);
-		if (!len) {
-			return py::cast<py::none>(Py_None);
-		}
+	m.def("delete_context", [](cmsContext context) {
+		auto data = get_context_data(context);
+		TRANSFORM_CACHE.clear_context(context);
+		auto &tls_errors = thread_errors();
+		tls_errors.erase(std::remove_if(tls_errors.begin(), tls_errors.end(), [context](const CmmError &e) {
+			return e.context == context;
+		}), tls_errors.end());
+		cmsDeleteContext(context);
+		delete data;
+	}, "context"_a, R"pbdoc(
+		Deletes a context. Delete the transforms created with the context first.
 
-		std::unique_ptr<char[]> buffer(new char[len]);
-		if (!cmsGetProfileInfoASCII(hp, cmsInfoDescription, "eng", "USA", buffer.get(), len))
-			return py::cast<py::none>(Py_None);
+		Parameters
+		----------
+		context: PyCapsule
+			Context handle
+	)pbdoc");
 
-		auto ret = std::string(buffer.get());
-		stripNonAscii(ret);
-		return (py::str)ret;
-	}, "hprofile"_a, R"pbdoc(
-		Gets profile description. eng/USA only.
+#ifdef CMM_LCMS2_THREADED
+	m.attr("LCMS2_THREADED") = true;
+#else
+	m.attr("LCMS2_THREADED") = false;
+#endif
+
+	m.def("register_fast_float_plugin", [](cmsContext context) {
+#ifdef CMM_LCMS2_FAST_FLOAT
+		return (int)cmsPluginTHR(context, cmsFastFloatExtensions());
+#else
+		return 0;
+#endif
+	}, "context"_a = py::none(), R"pbdoc(
+		Registers the fast_float plugin of Little-CMS. Transforms created after this use the optimized
+		8-bit, 16-bit and float kernels of the plugin. The result may differ slightly from the
+		default Little-CMS.
+
+		The module should be built with CMM_LCMS2_FAST_FLOAT. See LCMS2_FAST_FLOAT.
 
 		Parameters
 		----------
-		hp: PyCapsule
-			Profile handle
+		context: Optional[PyCapsule]
+			Context handle by create_context(). None for the global context.
 
 		Returns
 		-------
-		Optional[str]
-			None if error
+		int
+			0 if fail
 	)pbdoc");
 
-	m.def("create_transform", [](cmsHPROFILE src_hp, int src_format, cmsHPROFILE trg_hp, int trg_format, int intent, int flags) {
-		return cmsCreateTransform(src_hp, src_format, trg_hp, trg_format, intent, flags);
-	}, "src_hp"_a, "src_format"_a, "trg_hp"_a, "trg_format"_a, "intent"_a, "flags"_a, R"pbdoc(
-		Creates transform.
+	m.def("unregister_plugins", []() {
+		cmsUnregisterPlugins();
+	}, R"pbdoc(
+		Unregisters all plugins of the global context. Transforms created before keep working.
+	)pbdoc");
+
+#ifdef CMM_LCMS2_FAST_FLOAT
+	m.attr("LCMS2_FAST_FLOAT") = true;
+#else
+	m.attr("LCMS2_FAST_FLOAT") = false;
+#endif
+
+	m.def("do_transform_8_8", &do_transform<cmsUInt8Number, cmsUInt8Number>,
+		"htransform"_a, "input_buf"_a, "output_buf"_a, "num_pixel"_a,
+	R"pbdoc(
+		Does transform from uint8 to uint8.
 
 		Parameters
 		----------
-		src_hp: PyCapsule
-			Profile handle of source
+		htransform: PyCapsule
+			Transform handle
 
-		src_format: int
-			Source format
+		input_buf: ndarray[uint8]
+		output_buf: ndarray[uint8]
+		num_pixel: int
+	)pbdoc");
 
-		trg_hp: PyCapsule
-			Profile handle of target
+	m.def("do_transform_16_8", &do_transform<cmsUInt16Number, cmsUInt8Number>,
+		"htransform"_a, "input_buf"_a, "output_buf"_a, "num_pixel"_a,
+		R"pbdoc(
+		Does transform from uint16 to uint8.
 
-		trg_format: int
-			Target format
+		Parameters
+		----------
+		htransform: PyCapsule
+			Transform handle
 
-		intent: int
-			Color conversion intent
-			INTENT_PERCEPTUAL				0
-			INTENT_RELATIVE_COLORIMETRIC	1
-			INTENT_SATURATION				2
-			INTENT_ABSOLUTE_COLORIMETRIC	3
+		input_buf: ndarray[uint16]
+		output_buf: ndarray[uint8]
+		num_pixel: int
+	)pbdoc");
 
-		flags: int
-			Conversion flag
-			cmsFLAGS_BLACKPOINTCOMPENSATION	0x2000
-			cmsFLAGS_HIGHRESPRECALC			0x0400
-			cmsFLAGS_NULLTRANSFORM			0x0200
-			cmsFLAGS_NOOPTIMIZE				0x0100
-			cmsFLAGS_KEEP_SEQUENCE			0x0080
+	m.def("do_transform_8_16", &do_transform<cmsUInt8Number, cmsUInt16Number>,
+		"htransform"_a, "input_buf"_a, "output_buf"_a, "num_pixel"_a,
+		R"pbdoc(
+		Does transform from uint8 to uint16.
 
-		Returns
-		-------
-		PyCapsule
+		Parameters
+		----------
+		htransform: PyCapsule
 			Transform handle
+
+		input_buf: ndarray[uint8]
+		output_buf: ndarray[uint16]
+		num_pixel: int
 	)pbdoc");
 
-	PY_ATTR_PT(INTENT_PERCEPTUAL);
-	PY_ATTR_PT(INTENT_RELATIVE_COLORIMETRIC);
-	PY_ATTR_PT(INTENT_SATURATION);
-	PY_ATTR_PT(INTENT_ABSOLUTE_COLORIMETRIC);
+	m.def("do_transform_16_16", &do_transform<cmsUInt16Number, cmsUInt16Number>,
+		"htransform"_a, "input_buf"_a, "output_buf"_a, "num_pixel"_a,
+		R"pbdoc(
+		Does transform from uint16 to uint16.
 
-	PY_ATTR_PT(cmsFLAGS_BLACKPOINTCOMPENSATION);
-	PY_ATTR_PT(cmsFLAGS_HIGHRESPRECALC);
-	PY_ATTR_PT(cmsFLAGS_NULLTRANSFORM);
-	PY_ATTR_PT(cmsFLAGS_NOOPTIMIZE);
-	PY_ATTR_PT(cmsFLAGS_KEEP_SEQUENCE);
+		Parameters
+		----------
+		htransform: PyCapsule
+			Transform handle
 
-	m.def("create_proofing_transform", [](cmsHPROFILE src_hp, int src_format, cmsHPROFILE trg_hp, int trg_format, cmsHPROFILE proof_hp, int intent, int proof_intent, int flags) {
-		return cmsCreateProofingTransform(src_hp, src_format, trg_hp, trg_format, proof_hp, intent, proof_intent, flags | cmsFLAGS_SOFTPROOFING);
-	}, "src_hp"_a, "src_format"_a, "trg_hp"_a, "trg_format"_a, "proof_hp"_a, "intent"_a, "proof_intent"_a, "flags"_a, R"pbdoc(
-		Creates soft proof transform.
+		input_buf: ndarray[uint16]
+		output_buf: ndarray[uint16]
+		num_pixel: int
+	)pbdoc");
+
+	m.def("do_transform_f32_f32", &do_transform<cmsFloat32Number, cmsFloat32Number>,
+		"htransform"_a, "input_buf"_a, py::arg("output_buf").noconvert(), "num_pixel"_a,
+		R"pbdoc(
+		Does transform from float32 to float32. Float formats are made by get_transform_formatter(1, ...)
+		with n_byte=4 for float32, n_byte=0 for float64. ValueError is raised if the formats of
+		the transform do not match the buffer types.
+
+		Float to float keeps float precision through the pipeline. Other combinations are
+		computed in 16-bit precision by Little-CMS.
 
 		Parameters
 		----------
-		src_hp: PyCapsule
-			Profile handle of source
+		htransform: PyCapsule
+			Transform handle
 
-		src_format: int
-			Source format
+		input_buf: ndarray[float32]
+		output_buf: ndarray[float32]
+		num_pixel: int
+	)pbdoc");
 
-		trg_hp: PyCapsule
-			Profile handle of target
+	m.def("do_transform_f32_8", &do_transform<cmsFloat32Number, cmsUInt8Number>,
+		"htransform"_a, "input_buf"_a, py::arg("output_buf").noconvert(), "num_pixel"_a,
+		R"pbdoc(
+		Does transform from float32 to uint8. Float formats are made by get_transform_formatter(1, ...)
+		with n_byte=4 for float32, n_byte=0 for float64. ValueError is raised if the formats of
+		the transform do not match the buffer types.
 
-		trg_format: int
-			Target format
+		Computed in 16-bit precision by Little-CMS.
 
-		proof_hp: PyCapsule
-			Profile handle to proof
+		Parameters
+		----------
+		htransform: PyCapsule
+			Transform handle
 
-		intent: int
-			Color conversion intent
-			INTENT_PERCEPTUAL				0
-			INTENT_RELATIVE_COLORIMETRIC	1
-			INTENT_SATURATION				2
-			INTENT_ABSOLUTE_COLORIMETRIC	3
+		input_buf: ndarray[float32]
+		output_buf: ndarray[uint8]
+		num_pixel: int
+	)pbdoc");
 
-		flags: int
-			Conversion flag
-			cmsFLAGS_BLACKPOINTCOMPENSATION	0x2000
-			cmsFLAGS_HIGHRESPRECALC			0x0400
-			cmsFLAGS_NULLTRANSFORM			0x0200
-			cmsFLAGS_NOOPTIMIZE				0x0100
-			cmsFLAGS_KEEP_SEQUENCE			0x0080
-			cmsFLAGS_GAMUTCHECK				0x1000
-			cmsFLAGS_SOFTPROOFING			0x4000
+	m.def("do_transform_f32_16", &do_transform<cmsFloat32Number, cmsUInt16Number>,
+		"htransform"_a, "input_buf"_a, py::arg("output_buf").noconvert(), "num_pixel"_a,
+		R"pbdoc(
+		Does transform from float32 to uint16. Float formats are made by get_transform_formatter(1, ...)
+		with n_byte=4 for float32, n_byte=0 for float64. ValueError is raised if the formats of
+		the transform do not match the buffer types.
 
-		Returns
-		-------
-		PyCapsule
+		Computed in 16-bit precision by Little-CMS.
+
+		Parameters
+		----------
+		htransform: PyCapsule
 			Transform handle
+
+		input_buf: ndarray[float32]
+		output_buf: ndarray[uint16]
+		num_pixel: int
 	)pbdoc");
 
-	PY_ATTR_PT(cmsFLAGS_GAMUTCHECK);
-	PY_ATTR_PT(cmsFLAGS_SOFTPROOFING);
+	m.def("do_transform_8_f32", &do_transform<cmsUInt8Number, cmsFloat32Number>,
+		"htransform"_a, "input_buf"_a, py::arg("output_buf").noconvert(), "num_pixel"_a,
+		R"pbdoc(
+		Does transform from uint8 to float32. Float formats are made by get_transform_formatter(1, ...)
+		with n_byte=4 for float32, n_byte=0 for float64. ValueError is raised if the formats of
+		the transform do not match the buffer types.
 
-	m.def("set_alarm_codes", [](py::array_t<cmsUInt16Number> alarm_codes) {
-		py::buffer_info alarm_codes_bi = alarm_codes.request();
-		if (alarm_codes_bi.ndim != 1 || alarm_codes_bi.shape[0] != cmsMAXCHANNELS) {
+		Computed in 16-bit precision by Little-CMS.
+
+		Parameters
+		----------
+		htransform: PyCapsule
+			Transform handle
+
+		input_buf: ndarray[uint8]
+		output_buf: ndarray[float32]
+		num_pixel: int
+	)pbdoc");
+
+	m.def("do_transform_16_f32", &do_transform<cmsUInt16Number, cmsFloat32Number>,
+		"htransform"_a, "input_buf"_a, py::arg("output_buf").noconvert(), "num_pixel"_a,
+		R"pbdoc(
+		Does transform from uint16 to float32. Float formats are made by get_transform_formatter(1, ...)
+		with n_byte=4 for float32, n_byte=0 for float64. ValueError is raised if the formats of
+		the transform do not match the buffer types.
+
+		Computed in 16-bit precision by Little-CMS.
+
+		Parameters
+		----------
+		htransform: PyCapsule
+			Transform handle
+
+		input_buf: ndarray[uint16]
+		output_buf: ndarray[float32]
+		num_pixel: int
+	)pbdoc");
+
+	m.def("do_transform_f64_f64", &do_transform<cmsFloat64Number, cmsFloat64Number>,
+		"htransform"_a, "input_buf"_a, py::arg("output_buf").noconvert(), "num_pixel"_a,
+		R"pbdoc(
+		Does transform from float64 to float64. Float formats are made by get_transform_formatter(1, ...)
+		with n_byte=4 for float32, n_byte=0 for float64. ValueError is raised if the formats of
+		the transform do not match the buffer types.
+
+		Float to float keeps float precision through the pipeline. Other combinations are
+		computed in 16-bit precision by Little-CMS.
+
+		Parameters
+		----------
+		htransform: PyCapsule
+			Transform handle
+
+		input_buf: ndarray[float64]
+		output_buf: ndarray[float64]
+		num_pixel: int
+	)pbdoc");
+
+	m.def("do_transform_image", [](TransformArg ht, py::array src, py::array dst) {
+		ImageLayout in_layout, out_layout;
+		if (!get_image_layout(src, cmsGetTransformInputFormat(ht), in_layout)
+			|| !get_image_layout(dst, cmsGetTransformOutputFormat(ht), out_layout)
+			|| in_layout.width != out_layout.width || in_layout.height != out_layout.height
+			|| !dst.writeable()) {
 			return 0;
 		}
-		auto alarm_codes_ptr = static_cast<cmsUInt16Number *>(alarm_codes_bi.ptr);
-		cmsSetAlarmCodes(alarm_codes_ptr);
+		const void *in_ptr = src.data();
+		void *out_ptr = dst.mutable_data();
+		{
+			py::gil_scoped_release release;
+			transform_image(ht, in_ptr, in_layout, out_ptr, out_layout);
+		}
+		surface_errors();
 		return -1;
-	}, "alarm_codes"_a, R"pbdoc(
-		Sets the global codes used to mark out-out-gamut on Proofing transforms. Values are meant to be encoded in 16 bits.
-		Set cmsFLAGS_GAMUTCHECK and cmsFLAGS_SOFTPROOFING in create_proofing_transform().
+	}, "htransform"_a, "src"_a, py::arg("dst").noconvert(), R"pbdoc(
+		Does transform of an image. The shape and the strides of the arrays are used as they are,
+		so sliced views and padded rows can be transformed without copy.
+
+		The dtype should match the formats of the transform. The channels of a pixel should be contiguous
+		(channel-reversed views are not supported; use the swap of get_transform_formatter() instead).
+		Strides by which rows or planes overlap (e.g. by np.lib.stride_tricks.as_strided()) are not supported.
 
 		Parameters
 		----------
-		alarm_codes: [uint16], shape=(16)
+		htransform: PyCapsule
+			Transform handle
+		src: ndarray
+			Shape=(height, width, channels) for chunky formats, (channels, height, width) for planar formats.
+			(height, width) for one channel.
+		dst: ndarray
+			Same as src.
 
 		Returns
 		-------
 		int
 			0 if fail
 	)pbdoc");
-	
-	m.def("get_transform_formatter", [](int fl, int pt, int n_ch, int n_byte, int swap, int extra) {
-		return (FLOAT_SH(fl) | COLORSPACE_SH(pt) | CHANNELS_SH(n_ch) | BYTES_SH(n_byte) | DOSWAP_SH(swap) | EXTRA_SH(extra));
-	}, "is_float"_a, "pixel_type"_a, "n_ch"_a, "n_byte"_a, "swap"_a, "extra"_a, R"pbdoc(
-		Calculates transform formatter.
 
-		Parameters
-		----------
-		is_float: int
-			0 or 1
-		pixel_type: int
-			Colorspace type
-			PT_ANY       0    // Don't check colorspace
-			PT_GRAY      3
-			PT_RGB       4
-			PT_CMY       5
-			PT_CMYK      6
-			PT_YCbCr     7
-			PT_YUV       8      // Lu'v'
-			PT_XYZ       9
-			PT_Lab       10
-			PT_YUVK      11     // Lu'v'K
-			PT_HSV       12
-			PT_HLS       13
-			PT_Yxy       14
+	m.def("do_transform_async", [](py::object htransform, py::array src, py::array dst) {
+		cmsHTRANSFORM ht = htransform.cast<TransformArg>();
+		py::object future = py::module_::import("concurrent.futures").attr("Future")();
+		ImageLayout in_layout, out_layout;
+		if (!ht
+			|| !get_image_layout(src, cmsGetTransformInputFormat(ht), in_layout)
+			|| !get_image_layout(dst, cmsGetTransformOutputFormat(ht), out_layout)
+			|| in_layout.width != out_layout.width || in_layout.height != out_layout.height
+			|| !dst.writeable()) {
+			future.attr("set_result")(0);
+			return future;
+		}
+		const void *in_ptr = src.data();
+		void *out_ptr = dst.mutable_data();
+		submit_async(new AsyncTransform{htransform, src, dst, future, ht, in_ptr, out_ptr, in_layout, out_layout});
+		return future;
+	}, "htransform"_a, "src"_a, py::arg("dst").noconvert(), R"pbdoc(
+		Does transform of an image like do_transform_image(), but on the worker pool.
+		Returns at once, so decoding / encoding of other images can overlap the transform.
+		The pool grows up to the CPU cores (plus the threads of a transform); more calls wait in the queue.
 
-		n_ch: int
-			Number of channel. Alpha channel is not included here.
+		The arrays and the transform are referenced until the future is done. Do not write src or read dst
+		before that. The transform may be deleted or closed meanwhile; the handle is freed after the transform.
+		Use asyncio.wrap_future() to await it.
 
-		n_byte: int
-			Number of byte of a channel. uint16 should be 2.
+		Parameters
+		----------
+		htransform: PyCapsule
+			Transform handle
+		src: ndarray
+			Same as do_transform_image().
+		dst: ndarray
+			Same as do_transform_image().
 
-		swap: int
-			1 if BGR order, not RGB
-		
-		extra: int
-			1 if there is alpha channel
+		Returns
+		-------
+		concurrent.futures.Future
+			The result is 0 if fail, -1 if success. LcmsError of a raise_errors context is set as the exception.
 	)pbdoc");
 
-	PY_ATTR_PT(PT_ANY);
-	PY_ATTR_PT(PT_GRAY);
-	PY_ATTR_PT(PT_RGB);
-	PY_ATTR_PT(PT_CMY);
-	PY_ATTR_PT(PT_CMYK);
-	PY_ATTR_PT(PT_YCbCr);
-	PY_ATTR_PT(PT_YUV);
-	PY_ATTR_PT(PT_XYZ);
-	PY_ATTR_PT(PT_Lab);
-	PY_ATTR_PT(PT_YUVK);
-	PY_ATTR_PT(PT_HSV);
-	PY_ATTR_PT(PT_HLS);
-	PY_ATTR_PT(PT_Yxy);
-
-	m.def("delete_transform", [](cmsHTRANSFORM ht) {
-		return cmsDeleteTransform(ht);
-	}, "htransform"_a, R"pbdoc(
-		Deletes transform.
+	m.def("do_transform_stream", [](TransformArg ht, py::object src, py::object dst, size_t rows_per_strip, size_t max_in_flight) {
+		return transform_stream(ht, src, dst, rows_per_strip, max_in_flight);
+	}, "htransform"_a, "src"_a, "dst"_a, "rows_per_strip"_a = 0, "max_in_flight"_a = 2, R"pbdoc(
+		Does transform of an image strip by strip, for images larger than memory.
+		Strips are transformed on the worker pool in order, while the next strip is read.
+		Only max_in_flight strips are held at once. ValueError is raised if a strip after the first one
+		does not match the image; the rows before it are transformed and delivered.
 
 		Parameters
 		----------
 		htransform: PyCapsule
 			Transform handle
+		src: ndarray or iterable
+			An image like do_transform_image() (np.memmap is read strip by strip),
+			or an iterable of row strips of the image. Strips are ndarray of the same layout as the image.
+		dst: ndarray or callable
+			An image like do_transform_image() (e.g. np.memmap), or a callable which takes each output strip in order.
+			Output strips are new ndarray of the dtype of the output format: (rows, width, channels) for chunky,
+			(channels, rows, width) for planar.
+		rows_per_strip: int
+			Rows of a strip when src is ndarray. 0 for about a million pixels.
+		max_in_flight: int
+			Strips transformed at once.
+
+		Returns
+		-------
+		int
+			0 if fail before any output
 	)pbdoc");
 
-	m.def("do_transform_8_8", &do_transform<cmsUInt8Number, cmsUInt8Number>,
-		"htransform"_a, "input_buf"_a, "output_buf"_a, "num_pixel"_a,
-	R"pbdoc(
-		Does transform from uint8 to uint8.
+	m.def("do_transform_dedup", [](TransformArg ht, py::array src, py::array dst, size_t max_unique) {
+		ImageLayout in_layout, out_layout;
+		if (!get_image_layout(src, cmsGetTransformInputFormat(ht), in_layout)
+			|| !get_image_layout(dst, cmsGetTransformOutputFormat(ht), out_layout)
+			|| in_layout.width != out_layout.width || in_layout.height != out_layout.height
+			|| !dst.writeable()) {
+			return 0;
+		}
+		const void *in_ptr = src.data();
+		void *out_ptr = dst.mutable_data();
+		{
+			py::gil_scoped_release release;
+			if (!transform_dedup(ht, in_ptr, in_layout, out_ptr, out_layout, max_unique)) {
+				transform_image(ht, in_ptr, in_layout, out_ptr, out_layout);
+			}
+		}
+		surface_errors();
+		return -1;
+	}, "htransform"_a, "src"_a, py::arg("dst").noconvert(), "max_unique"_a = 65536, R"pbdoc(
+		Does transform of an image like do_transform_image(), transforming each unique color only once.
+		Much faster for logos, UI assets and flat graphics. The result is the same as do_transform_image().
+
+		Colors are collected by hash tables per tile of rows at first. If there are more than max_unique colors,
+		or a pixel of the input is larger than 8 bytes, or the format is planar, or the output has extra channels
+		which are not copied from the input by cmsFLAGS_COPY_ALPHA, it falls back to do_transform_image().
 
 		Parameters
 		----------
 		htransform: PyCapsule
 			Transform handle
+		src: ndarray
+			Same as do_transform_image().
+		dst: ndarray
+			Same as do_transform_image().
+		max_unique: int
+			Unique colors to give up at.
 
-		input_buf: ndarray[uint8]
-		output_buf: ndarray[uint8]
-		num_pixel: int
+		Returns
+		-------
+		int
+			0 if fail
 	)pbdoc");
 
-	m.def("do_transform_16_8", &do_transform<cmsUInt16Number, cmsUInt8Number>,
-		"htransform"_a, "input_buf"_a, "output_buf"_a, "num_pixel"_a,
-		R"pbdoc(
-		Does transform from uint16 to uint8.
+	m.def("do_transform_gamut_mask", [](TransformArg ht, py::array src, py::array dst, py::array mask, py::object alarm_codes) {
+		ImageLayout in_layout, out_layout;
+		MaskLayout mask_layout;
+		if (!get_image_layout(src, cmsGetTransformInputFormat(ht), in_layout)
+			|| !get_image_layout(dst, cmsGetTransformOutputFormat(ht), out_layout)
+			|| !get_mask_layout(mask, mask_layout)
+			|| in_layout.width != out_layout.width || in_layout.height != out_layout.height
+			|| in_layout.width != mask_layout.width || in_layout.height != mask_layout.height
+			|| !dst.writeable()) {
+			return 0;
+		}
+		cmsUInt16Number codes[cmsMAXCHANNELS];
+		bool has_codes = !alarm_codes.is_none();
+		if (has_codes) {
+			auto a = py::array_t<cmsUInt16Number, py::array::c_style | py::array::forcecast>::ensure(alarm_codes);
+			if (!a || a.ndim() != 1 || a.shape(0) != cmsMAXCHANNELS) {
+				return 0;
+			}
+			memcpy(codes, a.data(), sizeof(codes));
+		}
+		const void *in_ptr = src.data();
+		void *out_ptr = dst.mutable_data();
+		void *mask_ptr = mask.mutable_data();
+		bool ok;
+		{
+			py::gil_scoped_release release;
+			ok = transform_gamut_mask(ht, in_ptr, in_layout, out_ptr, out_layout, mask_ptr, mask_layout, has_codes ? codes : NULL);
+		}
+		surface_errors();
+		return ok ? -1 : 0;
+	}, "htransform"_a, "src"_a, py::arg("dst").noconvert(), py::arg("mask").noconvert(), "alarm_codes"_a = py::none(), R"pbdoc(
+		Does proofing transform of an image and writes the gamut check into a mask in the same pass.
+		The transform should be made by create_proofing_transform() with cmsFLAGS_GAMUTCHECK,
+		with integer chunky formats.
+
+		The global alarm codes of set_alarm_codes() are not used, so proofs with different alarms can run at once.
 
 		Parameters
 		----------
 		htransform: PyCapsule
 			Transform handle
+		src: ndarray
+			Same as do_transform_image().
+		dst: ndarray
+			Same as do_transform_image().
+		mask: ndarray[uint8] or ndarray[uint16], shape=(height, width)
+			uint8: 255 if out of gamut, 0 if not.
+			uint16: the output of the gamut check of Little-CMS, 0 if in gamut and larger if farther.
+		alarm_codes: Optional[ndarray[uint16]], shape=(16)
+			Written to dst for out-of-gamut pixels. None to write the proof colors.
 
-		input_buf: ndarray[uint16]
-		output_buf: ndarray[uint8]
-		num_pixel: int
+		Returns
+		-------
+		int
+			0 if fail
 	)pbdoc");
 
-	m.def("do_transform_8_16", &do_transform<cmsUInt8Number, cmsUInt16Number>,
-		"htransform"_a, "input_buf"_a, "output_buf"_a, "num_pixel"_a,
-		R"pbdoc(
-		Does transform from uint8 to uint16.
+	m.def("delta_e", [](py::array lab1, py::array lab2, py::object out, std::string method, double kl, double kc, double kh) -> py::object {
+		DeltaEParams params{DELTA_E_2000, kl, kc, kh};
+		auto is_float_array = [](const py::array &a) {
+			return a.dtype().kind() == 'f' && (a.itemsize() == 4 || a.itemsize() == 8) && (a.flags() & py::array::c_style);
+		};
+		if (!parse_delta_e_method(method, params.method) || !is_float_array(lab1) || !is_float_array(lab2)
+			|| lab1.itemsize() != lab2.itemsize() || lab1.ndim() < 1 || lab1.ndim() != lab2.ndim()
+			|| !std::equal(lab1.shape(), lab1.shape() + lab1.ndim(), lab2.shape()) || lab1.shape(lab1.ndim() - 1) != 3) {
+			return py::none();
+		}
+		size_t n = (size_t)lab1.size() / 3;
+		void *out_ptr = NULL;
+		bool out_double = false;
+		if (!out.is_none()) {
+			auto out_arr = py::cast<py::array>(out);
+			if (!is_float_array(out_arr) || !out_arr.writeable() || out_arr.ndim() != lab1.ndim() - 1
+				|| !std::equal(out_arr.shape(), out_arr.shape() + out_arr.ndim(), lab1.shape())) {
+				return py::none();
+			}
+			out_ptr = out_arr.mutable_data();
+			out_double = out_arr.itemsize() == 8;
+		}
+		const void *lab1_ptr = lab1.data(), *lab2_ptr = lab2.data();
+		bool lab_double = lab1.itemsize() == 8;
+		DeltaEStats stats;
+		{
+			py::gil_scoped_release release;
+			stats = delta_e_pixels(params, lab1_ptr, lab2_ptr, lab_double, out_ptr, out_double, n, NUM_THREADS.load());
+		}
+		return stats.dict();
+	}, "lab1"_a, "lab2"_a, "out"_a = py::none(), "method"_a = "2000", "kl"_a = 1.0, "kc"_a = 1.0, "kh"_a = 1.0, R"pbdoc(
+		Calculates DeltaE of Lab pairs in parallel, by the formulas of Little-CMS.
 
 		Parameters
 		----------
-		htransform: PyCapsule
-			Transform handle
+		lab1: ndarray[float32] or ndarray[float64], shape=(..., 3), C-contiguous
+			L*a*b* (L* is 0 to 100)
+		lab2: ndarray
+			Same shape and dtype as lab1.
+		out: Optional[ndarray[float32] or ndarray[float64]], shape=lab1.shape[:-1], C-contiguous
+			DeltaE of each pair. None for the summary only.
+		method: str
+			'76', '94', '2000' or 'CMC'
+		kl, kc, kh: float
+			Weights of DeltaE 2000. l and c of CMC are kl and kc (CMC(2:1) is kl=2).
 
-		input_buf: ndarray[uint8]
-		output_buf: ndarray[uint16]
-		num_pixel: int
+		Returns
+		-------
+		Optional[dict]
+			count, mean, std and max of DeltaE. None if fail.
 	)pbdoc");
 
-	m.def("do_transform_16_16", &do_transform<cmsUInt16Number, cmsUInt16Number>,
-		"htransform"_a, "input_buf"_a, "output_buf"_a, "num_pixel"_a,
-		R"pbdoc(
-		Does transform from uint16 to uint16.
+	m.def("delta_e_transforms", [](TransformArg ht1, py::array src1, TransformArg ht2, py::array src2, py::object out,
+		std::string method, double kl, double kc, double kh) -> py::object {
+		DeltaEParams params{DELTA_E_2000, kl, kc, kh};
+		ImageLayout layout1, layout2;
+		if (!parse_delta_e_method(method, params.method)
+			|| !is_float_lab(cmsGetTransformOutputFormat(ht1)) || !is_float_lab(cmsGetTransformOutputFormat(ht2))
+			|| !get_image_layout(src1, cmsGetTransformInputFormat(ht1), layout1)
+			|| !get_image_layout(src2, cmsGetTransformInputFormat(ht2), layout2)
+			|| layout1.width != layout2.width || layout1.height != layout2.height) {
+			return py::none();
+		}
+		void *out_ptr = NULL;
+		bool out_double = false;
+		ptrdiff_t out_row_stride = 0;
+		if (!out.is_none()) {
+			auto out_arr = py::cast<py::array>(out);
+			if (out_arr.dtype().kind() != 'f' || (out_arr.itemsize() != 4 && out_arr.itemsize() != 8) || !out_arr.writeable()
+				|| out_arr.ndim() != 2 || out_arr.shape(0) != (py::ssize_t)layout1.height || out_arr.shape(1) != (py::ssize_t)layout1.width
+				|| (out_arr.shape(1) > 1 && out_arr.strides(1) != out_arr.itemsize())) {
+				return py::none();
+			}
+			out_ptr = out_arr.mutable_data();
+			out_double = out_arr.itemsize() == 8;
+			out_row_stride = out_arr.strides(0);
+		}
+		const void *in1 = src1.data(), *in2 = src2.data();
+		DeltaEStats stats;
+		{
+			py::gil_scoped_release release;
+			stats = delta_e_transforms(params, ht1, in1, layout1, ht2, in2, layout2, out_ptr, out_double, out_row_stride);
+		}
+		surface_errors();
+		return stats.dict();
+	}, "htransform1"_a, "src1"_a, "htransform2"_a, "src2"_a, "out"_a = py::none(),
+	"method"_a = "2000", "kl"_a = 1.0, "kc"_a = 1.0, "kh"_a = 1.0, R"pbdoc(
+		Transforms two images to Lab and calculates DeltaE between them, in chunks,
+		without making the Lab images. E.g. the original and its soft proof.
 
 		Parameters
 		----------
-		htransform: PyCapsule
-			Transform handle
+		htransform1: PyCapsule
+			Transform handle to float Lab (get_transform_formatter(1, PT_Lab, 3, 4 or 0, 0, 0)),
+			e.g. to create_lab4_profile().
+		src1: ndarray
+			Same as do_transform_image().
+		htransform2: PyCapsule
+			Same as htransform1.
+		src2: ndarray
+			Same width and height as src1.
+		out: Optional[ndarray[float32] or ndarray[float64]], shape=(height, width)
+			DeltaE of each pixel. None for the summary only.
+		method, kl, kc, kh:
+			Same as delta_e().
 
-		input_buf: ndarray[uint16]
-		output_buf: ndarray[uint16]
-		num_pixel: int
+		Returns
+		-------
+		Optional[dict]
+			count, mean, std and max of DeltaE. None if fail.
 	)pbdoc");
 
+	py::module_::import("atexit").attr("register")(py::cpp_function([]() {
+		py::gil_scoped_release release;
+		ASYNC_JOBS.wait();
+	}));
+
 	m.def("create_partial_profile", [](std::string desc, std::string cprt, bool is_glossy, py::array_t<double> wtpt) {
 		py::buffer_info wtpt_bi = wtpt.request();
 		if (wtpt_bi.ndim != 1 || wtpt_bi.shape[0] != 3) {
@@ -716,105 +4878,110 @@ PYBIND11_MODULE(cmm, m) {
 			Profile handle
 	)pbdoc");
 
-	m.def("add_lut16", [](cmsHPROFILE hp, std::string tag, int n_out_ch,
-		py::array_t<cmsUInt16Number> clut, py::array_t<cmsUInt16Number> pre_table, py::array_t<cmsUInt16Number> post_table) {
-		const int N_IN_CH = 3;
-		auto pre_table_bi = pre_table.request();
-		auto clut_bi = clut.request();
-		auto post_table_bi = post_table.request();
-		if (pre_table_bi.ndim != 2 || pre_table_bi.shape[1] != N_IN_CH
-			|| clut_bi.ndim != N_IN_CH + 1 || clut_bi.shape[3] != n_out_ch 
-			|| clut_bi.shape[0] != clut_bi.shape[1] || clut_bi.shape[1] != clut_bi.shape[2]
-			|| post_table_bi.ndim != 2 || post_table_bi.shape[1] != n_out_ch) {
-			return 0;
+	m.def("add_lut16", [](ProfileArg hp, py::object tag, int n_out_ch, py::object clut, py::object pre_table, py::object post_table) {
+		// (tag, [clut, pre_table, post_table]) in the order to write.
+		std::vector<std::pair<std::string, std::array<py::object, 3>>> entries;
+		if (py::isinstance<py::dict>(tag)) {
+			if (!clut.is_none() || !pre_table.is_none() || !post_table.is_none()) {
+				return 0;
+			}
+			for (auto item : tag.cast<py::dict>()) {
+				if (!py::isinstance<py::sequence>(item.second)) {
+					return 0;
+				}
+				auto arrays = py::reinterpret_borrow<py::sequence>(item.second);
+				if (arrays.size() != 3) {
+					return 0;
+				}
+				entries.push_back({item.first.cast<std::string>(), {arrays[0], arrays[1], arrays[2]}});
+			}
+		} else if (py::isinstance<py::str>(tag)) {
+			entries.push_back({tag.cast<std::string>(), {clut, pre_table, post_table}});
+		} else {
+			for (auto t : tag) {
+				entries.push_back({t.cast<std::string>(), {clut, pre_table, post_table}});
+			}
 		}
-		auto lut_tag_map = get_lut_tag_map();
-		if (!lut_tag_map.count(tag)) {
+		auto &lut_tag_map = get_lut_tag_map();
+		if (entries.empty()) {
 			return 0;
 		}
-		cmsTagSignature tag_sig = lut_tag_map[tag];
-		auto n_clut_point = clut_bi.shape[0];
-		auto pre_c = pre_table.unchecked<2>();
-		auto clut_c = clut.unchecked<N_IN_CH + 1>();
-		auto post_c = post_table.unchecked<2>();
-		auto pipeline = cmsPipelineAlloc(NULL, N_IN_CH, n_out_ch);
-		if (!pipeline) {
-			return 0;
+		for (auto &e : entries) {
+			if (!lut_tag_map.count(e.first)) {
+				return 0;
+			}
 		}
-		auto _table_stage = [](py::detail::unchecked_reference<cmsUInt16Number, 2> table_c) {
-			auto nEntries = table_c.shape(0);
-			auto nCh = table_c.shape(1);
-			std::vector<cmsToneCurve *> tc(nCh);
-			for (int i = 0; i < nCh; i++) {
-				std::vector <cmsUInt16Number> values(nEntries);
-				for (int ii = 0; ii < nEntries; ii++) {
-					values[ii] = table_c(ii, i);
+		// Tags given the same array objects as an earlier tag are linked to it. Pipelines are
+		// made before writing, not to leave a half-written profile for wrong arrays.
+		std::vector<cmsPipeline *> pipelines(entries.size(), nullptr);
+		std::vector<size_t> link_to(entries.size());
+		bool ok = true;
+		for (size_t i = 0; ok && i < entries.size(); i++) {
+			link_to[i] = i;
+			for (size_t j = 0; j < i; j++) {
+				if (link_to[j] == j && entries[j].second[0].is(entries[i].second[0])
+					&& entries[j].second[1].is(entries[i].second[1]) && entries[j].second[2].is(entries[i].second[2])) {
+					link_to[i] = j;
+					break;
 				}
-				tc[i] = cmsBuildTabulatedToneCurve16(NULL, (cmsUInt32Number)nEntries, values.data());
 			}
-			auto stage = cmsStageAllocToneCurves(NULL, (cmsUInt32Number)nCh, tc.data());
-			return stage;
-		};
-		auto pre_stage = _table_stage(pre_c);
-		cmsPipelineInsertStage(pipeline, cmsAT_BEGIN, pre_stage);
-		std::vector<cmsUInt16Number> clut_table(n_clut_point * n_clut_point * n_clut_point * n_out_ch);
-		for (int i = 0; i < n_clut_point; i++) {
-			for (int ii = 0; ii < n_clut_point; ii++) {
-				for (int iii = 0; iii < n_clut_point; iii++) {
-					auto pos = i * n_clut_point * n_clut_point + ii * n_clut_point + iii;
-					for (int a = 0; a < n_out_ch; a++) {
-						clut_table[pos * n_out_ch + a] = clut_c(i, ii, iii, a);
-					}
-					int r = clut_c(i, ii, iii, 0);
-					int g = clut_c(i, ii, iii, 1);
-					int b = clut_c(i, ii, iii, 2);
-					if (r > 32768 && g > 32768 && b > 32768) {
-						int k = 0;
-						k++;
-					}
-				}
+			if (link_to[i] == i) {
+				pipelines[i] = alloc_lut16_pipeline(hp, n_out_ch, entries[i].second[0], entries[i].second[1], entries[i].second[2]);
+				ok = pipelines[i] != NULL;
 			}
 		}
-		auto clut_stage = cmsStageAllocCLut16bit(NULL, (cmsUInt32Number)n_clut_point, N_IN_CH, n_out_ch, clut_table.data());
-		cmsPipelineInsertStage(pipeline, cmsAT_END, clut_stage);
-		auto post_stage = _table_stage(post_c);
-		cmsPipelineInsertStage(pipeline, cmsAT_END, post_stage);
-		if (!cmsWriteTag(hp, tag_sig, (void*)pipeline)) {
-			cmsPipelineFree(pipeline);
-			return 0;
+		for (size_t i = 0; ok && i < entries.size(); i++) {
+			cmsTagSignature tag_sig = lut_tag_map.at(entries[i].first);
+			if (link_to[i] == i) {
+				ok = cmsWriteTag(hp, tag_sig, (void*)pipelines[i]);
+			} else {
+				ok = cmsLinkTag(hp, tag_sig, lut_tag_map.at(entries[link_to[i]].first));
+			}
+			profile_modified(hp);
 		}
-		cmsPipelineFree(pipeline);
-		return -1;
-	}, "hprofile"_a, "tag"_a, "n_out_ch"_a, "clut"_a, "pre_table"_a, "post_table"_a, R"pbdoc(
-		Adds a lut16 to a profile.
+		for (auto pipeline : pipelines) {
+			if (pipeline) {
+				cmsPipelineFree(pipeline);
+			}
+		}
+		return ok ? -1 : 0;
+	}, "hprofile"_a, "tag"_a, "n_out_ch"_a, "clut"_a = py::none(), "pre_table"_a = py::none(), "post_table"_a = py::none(), R"pbdoc(
+		Adds lut16 tags to a profile. C-contiguous uint16 CLUT is read without copy.
 
 		Parameters
 		----------
 		hprofile: PyCapsule
 			Profile handle
-		tag: str
-			AnBm, BnAm, or 'gamt'
+		tag: str | [str] | {str: (clut, pre_table, post_table)}
+			AnBm, BnAm, or 'gamt'. For a list, the first tag is written with clut, pre_table and post_table,
+			and the others are linked to it.
+			For a dict, each tag is written with its own arrays, and clut, pre_table and post_table are not given.
+			A tag with the same array objects as an earlier tag is linked to it.
 		n_out_ch: int
 			Number of output channel
-		clut: ndarray[uint16]
-			CLUT
+		clut: ndarray[uint16 | float32 | float64]
+			CLUT of shape (grid points of input 0, ..., grid points of input N - 1, n_out_ch).
+			Float 0.0 - 1.0 is quantized to 16-bit.
+			The grid points should be the same for all inputs, except ICC v4 profiles.
 		pre_table: ndarray[uint16]
-			Tone curve before CLUT stage
+			Tone curve before CLUT stage, of shape (entries, N)
 		post_table: ndarray[uint16]
-			Tone curve after CLUT stage
+			Tone curve after CLUT stage, of shape (entries, n_out_ch)
 
 		Returns
 		-------
 		int
-			0 if fail
+			0 if fail. No tag is written if any array does not fit.
 	)pbdoc");
 
-	m.def("link_tag", [](cmsHPROFILE hp, std::string link_tag, std::string dest_tag) {
-		auto lut_tag_map = get_lut_tag_map();
+	m.def("link_tag", [](ProfileArg hp, std::string link_tag, std::string dest_tag) {
+		auto &lut_tag_map = get_lut_tag_map();
 		if (!lut_tag_map.count(link_tag) || !lut_tag_map.count(dest_tag)) {
 			return 0;
 		}
-		return cmsLinkTag(hp, lut_tag_map[link_tag], lut_tag_map[dest_tag]);
+		auto rc = cmsLinkTag(hp, lut_tag_map.at(link_tag), lut_tag_map.at(dest_tag));
+		profile_modified(hp);
+		return rc;
 	}, "hprofile"_a, "link_tag"_a, "dest_tag"_a, R"pbdoc(
 		Links a tag to another tag.
 
@@ -833,29 +5000,27 @@ PYBIND11_MODULE(cmm, m) {
 			0 if fail
 	)pbdoc");
 
-	m.def("eval_lut16", [](cmsHPROFILE hp, std::string tag, py::array_t<cmsUInt16Number> input_array, py::array_t<cmsUInt16Number> output_array) {
-		auto lut_tag_map = get_lut_tag_map();
-		if (!lut_tag_map.count(tag)) {
-			return 0;
-		}
-		cmsPipeline *pipeline = (cmsPipeline *)cmsReadTag(hp, lut_tag_map[tag]);
-		int inCh = cmsPipelineInputChannels(pipeline);
-		int outCh = cmsPipelineOutputChannels(pipeline);
-		auto input_array_bi = input_array.request();
-		auto output_array_bi = output_array.request();
-		if (input_array_bi.ndim != 2 || input_array_bi.shape[1] != inCh
-			|| output_array_bi.ndim != 2 || output_array_bi.shape[1] != outCh 
-			|| input_array_bi.shape[0] != output_array_bi.shape[0]) {
+	m.def("eval_lut16", [](ProfileArg hp, std::string tag, py::array_t<cmsUInt16Number> input_array, py::array_t<cmsUInt16Number> output_array) {
+		cmsPipeline *pipeline = read_lut_pipeline(hp, tag);
+		if (!pipeline) {
 			return 0;
 		}
-		auto input_c = input_array.unchecked<2>();
-		auto output_c = output_array.mutable_unchecked<2>();
-		for (int i = 0; i < input_array_bi.shape[0]; i++) {
-			cmsPipelineEval16(input_c.data(i, 0), output_c.mutable_data(i, 0), pipeline);
+		std::shared_ptr<ClutEngine> engine;
+		if (CLUT_ISA.load() != CLUT_ISA_OFF && input_array.size() >= (py::ssize_t)(3 * CLUT_ENGINE_MIN_ROWS)) {
+			engine = LUT_ENGINES.get(hp, pipeline);
 		}
-		return -1;
+		return eval_rows(cmsPipelineInputChannels(pipeline), cmsPipelineOutputChannels(pipeline), input_array, output_array,
+			[pipeline, &engine](const cmsUInt16Number *in, ptrdiff_t in_stride, cmsUInt16Number *out, ptrdiff_t out_stride, size_t n) {
+				if (engine) {
+					clut_eval(*engine, in, in_stride, out, out_stride, n);
+					return;
+				}
+				for (size_t i = 0; i < n; i++, in += in_stride, out += out_stride) {
+					cmsPipelineEval16(in, out, pipeline);
+				}
+			});
 	}, "hprofile"_a, "tag"_a, "input_array"_a, py::arg("output_array").noconvert(), R"pbdoc(
-		Evaluates lut16 by input_array.
+		Evaluates lut16 by input_array. Rows are evaluated in parallel by set_num_threads().
 
 		Parameters
 		----------
@@ -872,32 +5037,127 @@ PYBIND11_MODULE(cmm, m) {
 			0 if fail
 	)pbdoc");
 
-	m.def("eval_pre_table", [](cmsHPROFILE hp, std::string tag, py::array_t<cmsUInt16Number> input_array, py::array_t<cmsUInt16Number> output_array) {
-		auto lut_tag_map = get_lut_tag_map();
-		if (!lut_tag_map.count(tag)) {
+	m.def("eval_lut_float", [](ProfileArg hp, std::string tag, py::array_t<cmsFloat32Number> input_array, py::array_t<cmsFloat32Number> output_array) {
+		cmsPipeline *pipeline = read_lut_pipeline(hp, tag);
+		if (!pipeline) {
 			return 0;
 		}
-		cmsPipeline *pipeline = (cmsPipeline *)cmsReadTag(hp, lut_tag_map[tag]);
-		cmsStage *preStage = cmsPipelineGetPtrToFirstStage(pipeline);
-		_cmsStageToneCurvesData* tcData = (_cmsStageToneCurvesData*)preStage->Data;
-		auto input_array_bi = input_array.request();
-		auto output_array_bi = output_array.request();
-		if (input_array_bi.ndim != 2 || input_array_bi.shape[1] != tcData->nCurves
-			|| output_array_bi.ndim != 2 || output_array_bi.shape[1] != tcData->nCurves
-			|| input_array_bi.shape[0] != output_array_bi.shape[0]) {
+		return eval_rows(cmsPipelineInputChannels(pipeline), cmsPipelineOutputChannels(pipeline), input_array, output_array,
+			[pipeline](const cmsFloat32Number *in, ptrdiff_t in_stride, cmsFloat32Number *out, ptrdiff_t out_stride, size_t n) {
+				for (size_t i = 0; i < n; i++, in += in_stride, out += out_stride) {
+					cmsPipelineEvalFloat(in, out, pipeline);
+				}
+			});
+	}, "hprofile"_a, "tag"_a, "input_array"_a, py::arg("output_array").noconvert(), R"pbdoc(
+		Evaluates the LUT of the tag in float, without 16-bit quantization.
+		Rows are evaluated in parallel by set_num_threads().
+
+		Parameters
+		----------
+		hprofile: PyCapsule
+			Profile handle
+		tag: str
+			AnBm, BnAm, or 'gamt'
+		input_array: ndarray[float32]
+			0.0 - 1.0 for 0 - 0xffff of eval_lut16().
+		output_array: ndarray[float32]
+
+		Returns
+		-------
+		int
+			0 if fail
+	)pbdoc");
+
+	m.def("eval_stage_curves16", [](ProfileArg hp, std::string tag, int stage, py::array_t<cmsUInt16Number> input_array, py::array_t<cmsUInt16Number> output_array) {
+		cmsPipeline *pipeline = read_lut_pipeline(hp, tag);
+		auto curves = pipeline ? get_stage_curves(pipeline, stage) : NULL;
+		if (!curves) {
 			return 0;
 		}
-		auto input_c = input_array.unchecked<2>();
-		auto output_c = output_array.mutable_unchecked<2>();
-		for (cmsUInt32Number i = 0; i < tcData->nCurves; i++) {
-			cmsToneCurve *tc = tcData->TheCurves[i];
-			for (int ii = 0; ii < input_array_bi.shape[0]; ii++) {
-				*output_c.mutable_data(ii, i) = cmsEvalToneCurve16(tc, input_c(ii, i));
-			}
+		return eval_stage_curves16(curves, input_array, output_array);
+	}, "hprofile"_a, "tag"_a, "stage"_a, "input_array"_a, py::arg("output_array").noconvert(), R"pbdoc(
+		Evaluates the curves of a stage of the tag by input_array.
+		Large inputs are evaluated by tables of 65536 entries, in parallel by set_num_threads().
+
+		Parameters
+		----------
+		hprofile: PyCapsule
+			Profile handle
+		tag: str
+			AnBm, BnAm, or 'gamt'
+		stage: int
+			Index of the stage in the pipeline. Negative index counts from the end.
+		input_array: ndarray[uint16]
+		output_array: ndarray[uint16]
+
+		Returns
+		-------
+		int
+			0 if fail, including the stage is not curves
+	)pbdoc");
+
+	m.def("eval_stage_curves_float", [](ProfileArg hp, std::string tag, int stage, py::array_t<cmsFloat32Number> input_array, py::array_t<cmsFloat32Number> output_array) {
+		cmsPipeline *pipeline = read_lut_pipeline(hp, tag);
+		auto curves = pipeline ? get_stage_curves(pipeline, stage) : NULL;
+		if (!curves) {
+			return 0;
 		}
-		return -1;
+		return eval_stage_curves_float(curves, input_array, output_array);
+	}, "hprofile"_a, "tag"_a, "stage"_a, "input_array"_a, py::arg("output_array").noconvert(), R"pbdoc(
+		Evaluates the curves of a stage of the tag in float by input_array,
+		in parallel by set_num_threads().
+
+		Parameters
+		----------
+		hprofile: PyCapsule
+			Profile handle
+		tag: str
+			AnBm, BnAm, or 'gamt'
+		stage: int
+			Index of the stage in the pipeline. Negative index counts from the end.
+		input_array: ndarray[float32]
+		output_array: ndarray[float32]
+
+		Returns
+		-------
+		int
+			0 if fail, including the stage is not curves
+	)pbdoc");
+
+	m.def("eval_pre_table", [](ProfileArg hp, std::string tag, py::array_t<cmsUInt16Number> input_array, py::array_t<cmsUInt16Number> output_array) {
+		cmsPipeline *pipeline = read_lut_pipeline(hp, tag);
+		auto curves = pipeline ? get_stage_curves(pipeline, 0) : NULL;
+		if (!curves) {
+			return 0;
+		}
+		return eval_stage_curves16(curves, input_array, output_array);
+	}, "hprofile"_a, "tag"_a, "input_array"_a, py::arg("output_array").noconvert(), R"pbdoc(
+		Evaluates pre_table of the tag by input_array. Same as eval_stage_curves16() of stage 0.
+
+		Parameters
+		----------
+		hprofile: PyCapsule
+			Profile handle
+		tag: str
+			AnBm, BnAm, or 'gamt'
+		input_array: ndarray[uint16]
+		output_array: ndarray[uint16]
+
+		Returns
+		-------
+		int
+			0 if fail
+	)pbdoc");
+
+	m.def("eval_post_table", [](ProfileArg hp, std::string tag, py::array_t<cmsUInt16Number> input_array, py::array_t<cmsUInt16Number> output_array) {
+		cmsPipeline *pipeline = read_lut_pipeline(hp, tag);
+		auto curves = pipeline ? get_stage_curves(pipeline, -1) : NULL;
+		if (!curves) {
+			return 0;
+		}
+		return eval_stage_curves16(curves, input_array, output_array);
 	}, "hprofile"_a, "tag"_a, "input_array"_a, py::arg("output_array").noconvert(), R"pbdoc(
-		Evaluates pre_table of the tag by input_array.
+		Evaluates post_table of the tag by input_array. Same as eval_stage_curves16() of stage -1.
 
 		Parameters
 		----------
@@ -914,12 +5174,29 @@ PYBIND11_MODULE(cmm, m) {
 			0 if fail
 	)pbdoc");
 
-	m.def("dump_profile", [](cmsHPROFILE hp) {
-		cmsUInt32Number bytesNeeded;
-		cmsSaveProfileToMem(hp, NULL, &bytesNeeded);
-		auto buf = std::vector<char>(bytesNeeded);
-		cmsSaveProfileToMem(hp, buf.data(), &bytesNeeded);
-		return py::bytes(buf.data(), bytesNeeded);
+	m.def("dump_profile", [](ProfileArg hp) {
+		SaveIO s;
+		s.kind = SaveIO::BYTES;
+		s.capacity = 65536;
+		s.obj = PyBytes_FromStringAndSize(NULL, s.capacity);
+		if (!s.obj) {
+			throw py::error_already_set();
+		}
+		s.data = PyBytes_AS_STRING(s.obj);
+		// Written into the bytes without a copy, and shrunk to the size at the end.
+		cmsUInt32Number n;
+		try {
+			n = save_profile(hp, s);
+		} catch (...) {
+			Py_XDECREF(s.obj);
+			throw;
+		}
+		if (n == 0 || _PyBytes_Resize(&s.obj, n) != 0) {
+			Py_XDECREF(s.obj);
+			PyErr_Clear();
+			return py::object(py::none());
+		}
+		return py::reinterpret_steal<py::object>(s.obj);
 	}, "hprofile"_a, R"pbdoc(
 		Dumps a profile.
 
@@ -931,7 +5208,78 @@ PYBIND11_MODULE(cmm, m) {
 		Returns
 		-------
 		bytes
-			Profile content
+			Profile content. None if error.
+	)pbdoc");
+
+	m.def("dump_profile_into", [](ProfileArg hp, py::buffer buffer) {
+		SaveIO s;
+		if (PyByteArray_Check(buffer.ptr())) {
+			s.kind = SaveIO::BYTEARRAY;
+			s.obj = buffer.ptr();
+			s.data = PyByteArray_AS_STRING(s.obj);
+			s.capacity = (cmsUInt32Number)std::min<Py_ssize_t>(PyByteArray_GET_SIZE(s.obj), 0xFFFFFFFF);
+			cmsUInt32Number n = save_profile(hp, s);
+			if (n == 0 || PyByteArray_Resize(s.obj, n) != 0) {
+				PyErr_Clear();
+				return (cmsUInt32Number)0;
+			}
+			return n;
+		}
+		auto bi = buffer.request(true);
+		if (!PyBuffer_IsContiguous(bi.view(), 'C')) {
+			return (cmsUInt32Number)0;
+		}
+		s.kind = SaveIO::FIXED;
+		s.data = static_cast<char *>(bi.ptr);
+		s.capacity = (cmsUInt32Number)std::min<py::ssize_t>(bi.size * bi.itemsize, 0xFFFFFFFF);
+		return save_profile(hp, s);
+	}, "hprofile"_a, "buffer"_a, R"pbdoc(
+		Dumps a profile into a buffer without intermediate copy.
+
+		Parameters
+		----------
+		hprofile: PyCapsule
+			Profile handle
+		buffer: bytearray | writable buffer
+			bytearray is resized to the profile. Other buffers should be C-contiguous and large enough.
+
+		Returns
+		-------
+		int
+			Size of the profile. 0 if fail, including the buffer is too small; the buffer is not written then.
+	)pbdoc");
+
+	m.def("dump_profile_to_file", [](ProfileArg hp, py::object file) {
+		if (!py::hasattr(file, "write")) {
+			cmsIOHANDLER *io = open_native_io_handler(cmsGetProfileContextID(hp), native_path(file), true);
+			if (!io) {
+				return (cmsUInt32Number)0;
+			}
+			cmsUInt32Number n = cmsSaveProfileToIOhandler(hp, io);
+			if (!cmsCloseIOhandler(io)) {
+				return (cmsUInt32Number)0;
+			}
+			return n;
+		}
+		SaveIO s;
+		s.kind = SaveIO::STREAM;
+		s.obj = file.ptr();
+		s.base = file.attr("tell")().cast<Py_ssize_t>();
+		return save_profile(hp, s);
+	}, "hprofile"_a, "file"_a, R"pbdoc(
+		Dumps a profile to a file, or to a seekable binary stream from its current position.
+
+		Parameters
+		----------
+		hprofile: PyCapsule
+			Profile handle
+		file: path-like | binary stream
+			Path, or an object with write(), seek() and tell()
+
+		Returns
+		-------
+		int
+			Size of the profile. 0 if fail
 	)pbdoc");
 
 	m.attr("__lcms_version__") = LCMS_VERSION;
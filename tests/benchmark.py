@@ -0,0 +1,145 @@
+"""
+Throughput benchmark of the hot paths. Not a unit test.
+
+python tests/benchmark.py --threads 1,4 --sizes 512,2048 --json result.json
+"""
+import sys
+from pathlib import Path
+import argparse
+import json
+import os
+import platform
+import time
+import numpy as np
+
+
+CURRENT_DIR = Path(__file__).parent.parent
+sys.path.append(str(CURRENT_DIR / 'build'))
+import cmm
+
+
+TEST_PROFILE = CURRENT_DIR / 'tests/resource/profile.icc'
+
+# depth: (do_transform_*, input bytes per sample, output bytes per sample, input dtype, output dtype)
+DEPTHS = {
+    '8_8': (cmm.do_transform_8_8, 1, 1, np.uint8, np.uint8),
+    '16_16': (cmm.do_transform_16_16, 2, 2, np.uint16, np.uint16),
+    '16_8': (cmm.do_transform_16_8, 2, 1, np.uint16, np.uint8),
+    'f32_f32': (cmm.do_transform_f32_f32, 4, 4, np.float32, np.float32),
+}
+
+
+def fmt(n_byte: int) -> int:
+    return cmm.get_transform_formatter(1 if n_byte == 4 else 0, cmm.PT_RGB, 3, n_byte, 0, 0)
+
+
+def best_time(fn, repeat: int) -> float:
+    fn()
+    times = []
+    for _ in range(repeat):
+        t = time.perf_counter()
+        fn()
+        times.append(time.perf_counter() - t)
+    return min(times)
+
+
+def random_image(size: int, dtype) -> np.ndarray:
+    rng = np.random.default_rng(0)
+    if np.issubdtype(dtype, np.floating):
+        return rng.random((size, size, 3), dtype=dtype)
+    return rng.integers(0, np.iinfo(dtype).max + 1, (size, size, 3), dtype=dtype)
+
+
+def bench_transforms(results: list, srgb, printer, threads: list, sizes: list, repeat: int):
+    for depth, (do_transform, in_byte, out_byte, in_dtype, out_dtype) in DEPTHS.items():
+        for proofing in (False, True):
+            if proofing:
+                tr = cmm.create_proofing_transform(
+                    srgb, fmt(in_byte), srgb, fmt(out_byte), printer,
+                    cmm.INTENT_RELATIVE_COLORIMETRIC, cmm.INTENT_RELATIVE_COLORIMETRIC,
+                    cmm.cmsFLAGS_BLACKPOINTCOMPENSATION)
+            else:
+                tr = cmm.create_transform(
+                    srgb, fmt(in_byte), printer, fmt(out_byte),
+                    cmm.INTENT_RELATIVE_COLORIMETRIC, cmm.cmsFLAGS_BLACKPOINTCOMPENSATION)
+            for size in sizes:
+                src = random_image(size, in_dtype)
+                trg = np.zeros((size, size, 3), dtype=out_dtype)
+                for n_threads in threads:
+                    cmm.set_num_threads(n_threads)
+                    t = best_time(lambda: do_transform(tr, src, trg, size * size), repeat)
+                    results.append({
+                        'bench': 'proofing' if proofing else 'transform', 'depth': depth,
+                        'size': size, 'threads': n_threads, 'seconds': t, 'mpx_per_s': size * size / t / 1e6})
+            cmm.delete_transform(tr)
+
+
+def bench_eval_lut16(results: list, printer, threads: list, sizes: list, repeat: int):
+    for size in sizes:
+        src = random_image(size, np.uint16).reshape((-1, 3))
+        trg = np.zeros_like(src)
+        for n_threads in threads:
+            cmm.set_num_threads(n_threads)
+            t = best_time(lambda: cmm.eval_lut16(printer, 'A2B0', src, trg), repeat)
+            results.append({
+                'bench': 'eval_lut16', 'depth': '16_16',
+                'size': size, 'threads': n_threads, 'seconds': t, 'mpx_per_s': size * size / t / 1e6})
+
+
+def bench_creation(results: list, srgb, printer, repeat: int):
+    cmm.set_transform_cache_size(0)
+    for depth, (_, in_byte, out_byte, _, _) in DEPTHS.items():
+        def create():
+            cmm.delete_transform(cmm.create_transform(
+                srgb, fmt(in_byte), printer, fmt(out_byte),
+                cmm.INTENT_RELATIVE_COLORIMETRIC, cmm.cmsFLAGS_BLACKPOINTCOMPENSATION))
+        results.append({'bench': 'create_transform', 'depth': depth, 'seconds': best_time(create, repeat)})
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--threads', default=f'1,{os.cpu_count() or 1}', help='Comma separated thread counts')
+    parser.add_argument('--sizes', default='256,1024,2048', help='Comma separated image widths (square)')
+    parser.add_argument('--repeat', type=int, default=5, help='Best of n runs')
+    parser.add_argument('--json', help='Writes the results to the file. "-" for stdout.')
+    args = parser.parse_args()
+    threads = sorted({int(s) for s in args.threads.split(',')})
+    sizes = [int(s) for s in args.sizes.split(',')]
+
+    srgb = cmm.create_srgb_profile()
+    printer = cmm.open_profile_from_file(TEST_PROFILE)
+    results = []
+    cache_size = cmm.get_transform_cache_info()['capacity']
+    num_threads = cmm.get_num_threads()
+    try:
+        bench_transforms(results, srgb, printer, threads, sizes, args.repeat)
+        bench_eval_lut16(results, printer, threads, sizes, args.repeat)
+        bench_creation(results, srgb, printer, args.repeat)
+    finally:
+        cmm.set_num_threads(num_threads)
+        cmm.set_transform_cache_size(cache_size)
+        cmm.close_profile(printer)
+        cmm.close_profile(srgb)
+
+    out = sys.stderr if args.json == '-' else sys.stdout
+    for r in results:
+        if 'mpx_per_s' in r:
+            print(f"{r['bench']:16} {r['depth']:8} {r['size']:6} x{r['threads']:<3} {r['mpx_per_s']:10.2f} Mpx/s", file=out)
+        else:
+            print(f"{r['bench']:16} {r['depth']:8} {r['seconds'] * 1e3:10.2f} ms", file=out)
+    if args.json:
+        report = {
+            'version': cmm.__version__, 'lcms_version': cmm.__lcms_version__,
+            'clut_engine_isa': cmm.get_clut_engine_isa(),
+            'platform': platform.platform(), 'python': platform.python_version(), 'cpu_count': os.cpu_count(),
+            'results': results,
+        }
+        if args.json == '-':
+            json.dump(report, sys.stdout, indent=2)
+        else:
+            with open(args.json, 'w') as f:
+                json.dump(report, f, indent=2)
+
+
+if __name__ == '__main__':
+    main()
@@ -2,7 +2,9 @@ import sys
 from pathlib import Path
 import faulthandler
 faulthandler.enable()
+import io
 import os
+import tempfile
 import unittest
 import PIL.Image as PILImageModule
 import numpy as np
@@ -30,6 +32,31 @@ class TestSimple(unittest.TestCase):
         self.assertIsNotNone(hp)
         cmm.close_profile(hp)
 
+    def test_open_from_buffer_and_file(self):
+        with open(TEST_PROFILE, 'rb') as f:
+            content = f.read()
+        for buf in (bytearray(content), memoryview(content), np.frombuffer(content, dtype=np.uint8)):
+            hp = cmm.open_profile_from_mem(buf)
+            self.assertIsNotNone(hp)
+            self.assertEqual(cmm.get_profile_description(hp), 'sub20191126@sRGB')
+            cmm.close_profile(hp)
+        for use_mmap in (False, True):
+            hp = cmm.open_profile_from_file(TEST_PROFILE, use_mmap)
+            self.assertIsNotNone(hp)
+            self.assertEqual(cmm.get_profile_description(hp), 'sub20191126@sRGB')
+            cmm.close_profile(hp)
+        with tempfile.TemporaryDirectory() as d:
+            path = Path(d) / 'プロファイル.icc'
+            try:
+                path.write_bytes(content)
+            except UnicodeEncodeError:
+                self.skipTest('The file system encoding cannot name the file.')
+            for use_mmap in (False, True):
+                hp = cmm.open_profile_from_file(path, use_mmap)
+                self.assertIsNotNone(hp)
+                cmm.close_profile(hp)
+            self.assertIsNone(cmm.open_profile_from_file(Path(d) / 'none.icc'))
+
     def test_error_handler(self):
         code = 0
         msg = ''
@@ -45,6 +72,71 @@ class TestSimple(unittest.TestCase):
         self.assertEqual(msg, 'Read from memory error')
         cmm.unset_log_error_handler()
 
+    def test_dump_profile(self):
+        hp = cmm.create_srgb_profile()
+        b = cmm.dump_profile(hp)
+        self.assertIsInstance(b, bytes)
+        ba = bytearray()
+        self.assertEqual(cmm.dump_profile_into(hp, ba), len(b))
+        self.assertEqual(bytes(ba), b)
+        buf = np.zeros(len(b) + 10, dtype=np.uint8)
+        self.assertEqual(cmm.dump_profile_into(hp, buf), len(b))
+        self.assertEqual(buf[:len(b)].tobytes(), b)
+        buf[:] = 0xAA
+        self.assertEqual(cmm.dump_profile_into(hp, buf[:len(b) - 1]), 0)
+        self.assertTrue(np.all(buf == 0xAA))
+        self.assertEqual(cmm.dump_profile_into(hp, buf[:10]), 0)
+        stream = io.BytesIO()
+        stream.write(b'head')
+        self.assertEqual(cmm.dump_profile_to_file(hp, stream), len(b))
+        self.assertEqual(stream.getvalue(), b'head' + b)
+        with tempfile.TemporaryDirectory() as d:
+            path = Path(d) / 'srgb.icc'
+            self.assertEqual(cmm.dump_profile_to_file(hp, path), len(b))
+            self.assertEqual(path.read_bytes(), b)
+            path = Path(d) / 'プロファイル.icc'
+            try:
+                os.fsencode(path)
+            except UnicodeEncodeError:
+                pass
+            else:
+                self.assertEqual(cmm.dump_profile_to_file(hp, path), len(b))
+                self.assertEqual(path.read_bytes(), b)
+        cmm.close_profile(hp)
+
+    def test_inspect_profile(self):
+        with open(TEST_PROFILE, 'rb') as f:
+            content = f.read()
+        info = cmm.inspect_profile(content)
+        self.assertEqual(info['description'], 'sub20191126@sRGB')
+        self.assertEqual(info['device_class'], cmm.cmsSigOutputClass)
+        self.assertEqual(info['color_space'], cmm.cmsSigRgbData)
+        self.assertEqual(info['size'], len(content))
+        self.assertEqual(info['header_profile_id'], content[84:100] if any(content[84:100]) else None)
+        self.assertEqual(info['tags']['A2B0']['linked'], 'A2B1')
+        # A2B2 is linked to A2B0, which is linked to A2B1.
+        self.assertEqual(info['tags']['A2B2']['linked'], 'A2B1')
+        self.assertIsNone(info['tags']['B2A0']['linked'])
+        self.assertTrue(info['tags']['A2B0']['type_supported'])
+        desc_offset = info['tags']['desc']['offset']
+        broken = content[:desc_offset] + b'XYZ ' + content[desc_offset + 4:]
+        self.assertFalse(cmm.inspect_profile(broken)['tags']['desc']['type_supported'])
+        self.assertEqual(info['tags']['B2A0']['type'], 'mft2')
+        self.assertIsNone(cmm.inspect_profile(b'    '))
+        self.assertEqual(cmm.inspect_profile_files([TEST_PROFILE, CURRENT_DIR / 'no_such.icc']), [info, None])
+
+        hp = cmm.open_profile_from_mem(content)
+        self.assertEqual(cmm.get_available_b2an_list(hp), ['B2A1', 'B2A0', 'B2A2'])
+        cmm.close_profile(hp)
+
+        hp = cmm.create_srgb_profile()
+        table = np.repeat(np.linspace(0, 65535, 256).astype(np.uint16)[:, np.newaxis], 3, axis=1)
+        self.assertEqual(cmm.add_lut16(hp, 'B2A0', 3, np.zeros((2, 2, 2, 3), dtype=np.uint16), table, table), -1)
+        self.assertEqual(cmm.link_tag(hp, 'B2A1', 'B2A0'), 1)
+        self.assertEqual(cmm.link_tag(hp, 'B2A2', 'B2A1'), 1)
+        self.assertEqual(cmm.get_available_b2an_list(hp), ['B2A1'])
+        cmm.close_profile(hp)
+
     def test_fmt(self):
         cmm.get_transform_formatter(0, cmm.PT_RGB, 3, 1, 0, 0)
 
@@ -94,6 +186,171 @@ class TestCombined(unittest.TestCase):
         self.assertIsNotNone(tr)
         cmm.delete_transform(tr)
 
+    def test_eval_lut(self):
+        rng = np.random.default_rng(0)
+        src = rng.integers(0, 65536, (5000, 3), dtype=np.uint16)
+        out16 = np.zeros((5000, 3), dtype=np.uint16)
+        self.assertEqual(cmm.eval_lut16(self.hp, 'A2B0', src, out16), -1)
+        out_f = np.zeros((5000, 3), dtype=np.float32)
+        self.assertEqual(cmm.eval_lut_float(self.hp, 'A2B0', (src / 65535).astype(np.float32), out_f), -1)
+        self.assertLess(np.abs(out_f * 65535 - out16).max(), 64)
+        self.assertEqual(cmm.eval_lut16(self.hp, 'XXXX', src, out16), 0)
+        # Channels which are not contiguous
+        out_rev = np.zeros((5000, 3), dtype=np.uint16)
+        self.assertEqual(cmm.eval_lut16(self.hp, 'A2B0', src[:, ::-1].copy()[:, ::-1], out_rev[:, ::-1]), -1)
+        self.assertTrue(np.array_equal(out_rev[:, ::-1], out16))
+
+        # The engine of large calls is cached per LUT and dropped when the tag is written again.
+        hp = cmm.create_srgb_profile()
+        grid = np.linspace(0, 65535, 5).astype(np.uint16)
+        clut = np.stack(np.meshgrid(grid, grid, grid, indexing='ij'), axis=-1)[..., ::-1].copy()
+        table = np.repeat(np.linspace(0, 65535, 256).astype(np.uint16)[:, np.newaxis], 3, axis=1)
+        src = rng.integers(0, 65536, (70000, 3), dtype=np.uint16)
+        for c in (clut, 65535 - clut, clut):
+            self.assertEqual(cmm.add_lut16(hp, 'A2B0', 3, c, table, table), -1)
+            for _ in range(2):
+                out = np.zeros_like(src)
+                self.assertEqual(cmm.eval_lut16(hp, 'A2B0', src, out), -1)
+                oracle = np.zeros((100, 3), dtype=np.uint16)
+                self.assertEqual(cmm.eval_lut16(hp, 'A2B0', src[:100], oracle), -1)
+                self.assertTrue(np.array_equal(out[:100], oracle))
+        cmm.close_profile(hp)
+
+    def test_eval_stage_curves(self):
+        src = np.random.default_rng(0).integers(0, 65536, (20000, 3), dtype=np.uint16)
+        out = np.zeros_like(src)
+        self.assertEqual(cmm.eval_pre_table(self.hp, 'A2B0', src, out), -1)
+        small = np.zeros((100, 3), dtype=np.uint16)
+        self.assertEqual(cmm.eval_stage_curves16(self.hp, 'A2B0', 0, src[:100], small), -1)
+        self.assertTrue(np.array_equal(out[:100], small))
+        out_f = np.zeros(src.shape, dtype=np.float32)
+        self.assertEqual(cmm.eval_stage_curves_float(self.hp, 'A2B0', 0, (src / 65535).astype(np.float32), out_f), -1)
+        self.assertLess(np.abs(out_f * 65535 - out).max(), 2)
+        self.assertEqual(cmm.eval_stage_curves16(self.hp, 'A2B0', 99, src, out), 0)
+
+    def test_add_lut16(self):
+        grid = np.linspace(0, 1, 9)
+        clut_f = np.stack(np.meshgrid(grid, grid, grid, indexing='ij'), axis=-1)[..., ::-1].copy()
+        clut16 = np.round(clut_f * 65535).astype(np.uint16)
+        table = np.repeat(np.linspace(0, 65535, 256).astype(np.uint16)[:, np.newaxis], 3, axis=1)
+        src = np.random.default_rng(0).integers(0, 65536, (1000, 3), dtype=np.uint16)
+        outs = []
+        for clut in (clut16, clut_f, clut_f.astype(np.float32)):
+            hp = cmm.create_srgb_profile()
+            self.assertEqual(cmm.add_lut16(hp, ['A2B0', 'A2B1'], 3, clut, table, table), -1)
+            out0 = np.zeros_like(src)
+            out1 = np.zeros_like(src)
+            self.assertEqual(cmm.eval_lut16(hp, 'A2B0', src, out0), -1)
+            self.assertEqual(cmm.eval_lut16(hp, 'A2B1', src, out1), -1)
+            self.assertTrue(np.array_equal(out0, out1))
+            outs.append(out0)
+            cmm.close_profile(hp)
+        self.assertTrue(np.array_equal(outs[0], outs[1]))
+        self.assertTrue(np.array_equal(outs[0], outs[2]))
+        self.assertLess(np.abs(outs[0][:, ::-1].astype(int) - src).max(), 2)
+
+        hp = cmm.create_srgb_profile()
+        inverted = (65535 - clut16).astype(np.uint16)
+        self.assertEqual(cmm.add_lut16(hp, {
+            'A2B0': (clut16, table, table),
+            'A2B1': (inverted, table, table),
+            'A2B2': (clut16, table, table),
+        }, 3), -1)
+        out = [np.zeros_like(src) for _ in range(3)]
+        for tag, o in zip(('A2B0', 'A2B1', 'A2B2'), out):
+            self.assertEqual(cmm.eval_lut16(hp, tag, src, o), -1)
+        self.assertTrue(np.array_equal(out[0], outs[0]))
+        self.assertTrue(np.array_equal(out[2], outs[0]))
+        self.assertLess(np.abs(out[1].astype(int) + out[0] - 65535).max(), 2)
+        self.assertEqual(cmm.add_lut16(hp, {'A2B0': (clut16[..., :2], table, table)}, 3), 0)
+        cmm.close_profile(hp)
+
+    def test_transform_cache(self):
+        cmm.set_transform_cache_size(2)
+        try:
+            # The MD5 of the key is computed from a copy, without writing the header.
+            content = cmm.dump_profile(self.hp)
+            trs = [cmm.create_transform(
+                self.srgb, self.fmt,
+                self.hp, self.fmt,
+                cmm.INTENT_RELATIVE_COLORIMETRIC,
+                cmm.cmsFLAGS_BLACKPOINTCOMPENSATION) for _ in range(3)]
+            trs.append(cmm.create_transform(
+                self.srgb, self.fmt,
+                self.hp, self.fmt,
+                cmm.INTENT_PERCEPTUAL,
+                cmm.cmsFLAGS_BLACKPOINTCOMPENSATION))
+            info = cmm.get_transform_cache_info()
+            self.assertEqual(info['hits'], 2)
+            self.assertEqual(info['misses'], 2)
+            self.assertEqual(info['size'], 2)
+            self.assertEqual(cmm.dump_profile(self.hp), content)
+            cmm.clear_transform_cache()
+            self.assertEqual(cmm.get_transform_cache_info()['size'], 0)
+            for tr in trs:
+                cmm.delete_transform(tr)
+
+            def absolute():
+                return cmm.create_transform(
+                    self.srgb, self.fmt,
+                    self.hp, self.fmt,
+                    cmm.INTENT_ABSOLUTE_COLORIMETRIC, 0)
+            tr0 = absolute()
+            self.assertEqual(cmm.set_adaptation_state(0.), 1.)
+            try:
+                tr1 = absolute()
+            finally:
+                cmm.set_adaptation_state(1.)
+            self.assertEqual(cmm.get_transform_cache_info()['hits'], 2)
+            trg0 = np.zeros_like(self.src_img)
+            trg1 = np.zeros_like(self.src_img)
+            cmm.do_transform_8_8(tr0, self.src_img, trg0, self.src_img.size // 3)
+            cmm.do_transform_8_8(tr1, self.src_img, trg1, self.src_img.size // 3)
+            self.assertFalse(np.array_equal(trg0, trg1))
+            cmm.delete_transform(tr0)
+            cmm.delete_transform(tr1)
+
+            # Device links are keyed apart from the other kinds, and by the adaptation state.
+            tr = absolute()
+            link = cmm.transform_to_device_link(tr)
+            cmm.delete_transform(tr)
+            info = cmm.get_transform_cache_info()
+            trs = [cmm.create_transform_from_device_link(link, self.fmt, self.fmt) for _ in range(2)]
+            cmm.set_adaptation_state(0.)
+            try:
+                trs.append(cmm.create_transform_from_device_link(link, self.fmt, self.fmt))
+            finally:
+                cmm.set_adaptation_state(1.)
+            self.assertEqual(cmm.get_transform_cache_info()['hits'], info['hits'] + 1)
+            self.assertEqual(cmm.get_transform_cache_info()['misses'], info['misses'] + 2)
+            for tr in trs:
+                cmm.delete_transform(tr)
+            cmm.close_profile(link)
+        finally:
+            cmm.set_transform_cache_size(0)
+
+    def test_context_errors(self):
+        cmyk_fmt = cmm.get_transform_formatter(0, cmm.PT_CMYK, 4, 1, 0, 0)
+        ctx = cmm.create_context()
+        tr = cmm.create_transform(
+            self.srgb, cmyk_fmt,
+            self.hp, self.fmt,
+            cmm.INTENT_RELATIVE_COLORIMETRIC, 0, context=ctx)
+        self.assertIsNone(tr)
+        errors = cmm.get_context_errors(ctx)
+        self.assertEqual(len(errors), 1)
+        self.assertEqual(errors[0][0], cmm.cmsERROR_COLORSPACE_CHECK)
+        self.assertEqual(cmm.get_context_errors(ctx), [])
+        cmm.delete_context(ctx)
+
+        ctx = cmm.create_context(raise_errors=True)
+        with self.assertRaises(cmm.LcmsError):
+            cmm.create_transform(
+                self.srgb, cmyk_fmt,
+                self.hp, self.fmt,
+                cmm.INTENT_RELATIVE_COLORIMETRIC, 0, context=ctx)
+        cmm.delete_context(ctx)
+
     def test_create_delete_proofing_transform(self):
         tr = cmm.create_proofing_transform(
             self.srgb, self.fmt,
@@ -167,6 +424,415 @@ class TestConversion(unittest.TestCase):
         self.assert_image('test_8_8_proofing.png')
         cmm.delete_transform(tr)
 
+    @unittest.skipIf(sys.platform == 'emscripten',
+                     "Emscripten float seems different from other CPUs.")
+    def test_gamut_mask(self):
+        self.assertNotEqual(cmm.set_alarm_codes(np.full(16, 0xffff, dtype=np.uint16)), 0)
+        tr = cmm.create_proofing_transform(
+            self.srgb, self.fmt,
+            self.srgb, self.fmt,
+            self.hp,
+            cmm.INTENT_RELATIVE_COLORIMETRIC,
+            cmm.INTENT_RELATIVE_COLORIMETRIC,
+            cmm.cmsFLAGS_BLACKPOINTCOMPENSATION | cmm.cmsFLAGS_GAMUTCHECK | cmm.cmsFLAGS_SOFTPROOFING)
+        mask = np.zeros(self.src_img.shape[:2], dtype=np.uint8)
+        self.assertEqual(cmm.do_transform_gamut_mask(tr, self.src_img, self.trg_img, mask, np.zeros(16, dtype=np.uint16)), -1)
+        self.assert_image('test_8_8_proofing.png')
+        self.assertTrue(np.any(mask == 255) and np.any(mask == 0))
+        self.assertTrue(np.all(self.trg_img[mask == 255] == 0))
+
+        distance = np.zeros(mask.shape, dtype=np.uint16)
+        proof = np.zeros_like(self.trg_img)
+        self.assertEqual(cmm.do_transform_gamut_mask(tr, self.src_img, proof, distance), -1)
+        self.assertTrue(np.array_equal(distance > 0, mask == 255))
+        self.assertTrue(np.array_equal(proof[mask == 0], self.trg_img[mask == 0]))
+        self.assertEqual(cmm.do_transform_gamut_mask(tr, self.src_img, proof, distance[:, :-1]), 0)
+        cmm.delete_transform(tr)
+        cmm.set_alarm_codes(np.zeros(16, dtype=np.uint16))
+
+    def test_transform_dedup(self):
+        rng = np.random.default_rng(0)
+        colors = rng.integers(0, 65536, (300, 4), dtype=np.uint16)
+        img = colors[rng.integers(0, 300, (200, 300))]
+        img[50:100] = colors[0]
+        fmt16 = cmm.get_transform_formatter(0, cmm.PT_RGB, 3, 2, 0, 1)
+        tr = cmm.create_transform(
+            self.srgb, fmt16,
+            self.hp, self.fmt,
+            cmm.INTENT_RELATIVE_COLORIMETRIC,
+            cmm.cmsFLAGS_BLACKPOINTCOMPENSATION)
+        oracle = np.zeros(img.shape[:2] + (3,), dtype=np.uint8)
+        cmm.do_transform_image(tr, img, oracle)
+        cmm.delete_transform(tr)
+
+        fmt_rgba = cmm.get_transform_formatter(0, cmm.PT_RGB, 3, 1, 0, 1)
+        tr = cmm.create_transform(
+            self.srgb, fmt16,
+            self.hp, fmt_rgba,
+            cmm.INTENT_RELATIVE_COLORIMETRIC,
+            cmm.cmsFLAGS_BLACKPOINTCOMPENSATION | cmm.cmsFLAGS_COPY_ALPHA)
+        for max_unique in (65536, 10):
+            trg = np.zeros(img.shape, dtype=np.uint8)
+            self.assertEqual(cmm.do_transform_dedup(tr, img, trg, max_unique), -1)
+            self.assertTrue(np.array_equal(trg[:, :, :3], oracle))
+            alpha = (img[:, :, 3].astype(np.uint32) * 65281 + 8388608) >> 24
+            self.assertTrue(np.array_equal(trg[:, :, 3], alpha))
+        self.assertEqual(cmm.do_transform_dedup(tr, img, trg[:-1]), 0)
+        cmm.delete_transform(tr)
+
+        # Extra channels of dst which are not copied are kept, and extra channels of src are a part of colors.
+        for src, fmt_in, fmt_out, n_out in [
+                (np.ascontiguousarray(img[:, :, :3]), cmm.get_transform_formatter(0, cmm.PT_RGB, 3, 2, 0, 0), fmt_rgba, 4),
+                (img, fmt16, self.fmt, 3)]:
+            tr = cmm.create_transform(
+                self.srgb, fmt_in,
+                self.hp, fmt_out,
+                cmm.INTENT_RELATIVE_COLORIMETRIC,
+                cmm.cmsFLAGS_BLACKPOINTCOMPENSATION)
+            oracle = np.full(img.shape[:2] + (n_out,), 77, dtype=np.uint8)
+            cmm.do_transform_image(tr, src, oracle)
+            trg = np.full(oracle.shape, 77, dtype=np.uint8)
+            self.assertEqual(cmm.do_transform_dedup(tr, src, trg), -1)
+            self.assertTrue(np.array_equal(trg, oracle))
+            cmm.delete_transform(tr)
+
+    def test_delta_e(self):
+        # Pair 1 of Sharma, Wu and Dalal (2005)
+        lab1 = np.array([[50, 2.6772, -79.7751]] * 3)
+        lab2 = np.array([[50, 0, -82.7485]] * 3)
+        out = np.zeros(3)
+        stats = cmm.delta_e(lab1, lab2, out)
+        self.assertTrue(np.allclose(out, 2.0425, atol=1e-4))
+        self.assertEqual(stats['count'], 3)
+        self.assertAlmostEqual(stats['max'], 2.0425, places=4)
+        stats = cmm.delta_e(lab1.astype(np.float32), lab2.astype(np.float32), method='76')
+        self.assertAlmostEqual(stats['mean'], np.hypot(2.6772, 82.7485 - 79.7751), places=4)
+        self.assertIsNone(cmm.delta_e(lab1, lab2, method='99'))
+
+        # Many chunks and tiles, large mean with a small spread
+        rng = np.random.default_rng(0)
+        lab1 = np.column_stack([rng.uniform(0, 100, 100003), rng.uniform(-128, 127, (100003, 2))])
+        lab2 = lab1 + [1e4, 0, 0] + rng.normal(0, 1e-3, (100003, 3))
+        for method in ['76', '94', '2000', 'CMC']:
+            out = np.zeros(len(lab1))
+            stats = cmm.delta_e(lab1, lab2, out, method=method)
+            self.assertEqual(stats['count'], len(out))
+            self.assertAlmostEqual(stats['mean'], out.mean(), delta=1e-9 * out.mean())
+            self.assertAlmostEqual(stats['std'], out.std(), delta=1e-6 * out.std())
+            self.assertEqual(stats['max'], out.max())
+
+        lab = cmm.create_lab4_profile(None)
+        fmt_lab = cmm.get_transform_formatter(1, cmm.PT_Lab, 3, 0, 0, 0)
+        tr1 = cmm.create_transform(
+            self.srgb, self.fmt, lab, fmt_lab,
+            cmm.INTENT_RELATIVE_COLORIMETRIC, cmm.cmsFLAGS_BLACKPOINTCOMPENSATION)
+        tr2 = cmm.create_proofing_transform(
+            self.srgb, self.fmt, lab, fmt_lab, self.hp,
+            cmm.INTENT_RELATIVE_COLORIMETRIC, cmm.INTENT_RELATIVE_COLORIMETRIC,
+            cmm.cmsFLAGS_BLACKPOINTCOMPENSATION | cmm.cmsFLAGS_SOFTPROOFING)
+        lab_img1 = np.zeros(self.src_img.shape, dtype=np.float64)
+        lab_img2 = np.zeros(self.src_img.shape, dtype=np.float64)
+        cmm.do_transform_image(tr1, self.src_img, lab_img1)
+        cmm.do_transform_image(tr2, self.src_img, lab_img2)
+        oracle = np.zeros(self.src_img.shape[:2])
+        oracle_stats = cmm.delta_e(lab_img1, lab_img2, oracle)
+        out = np.zeros(self.src_img.shape[:2])
+        stats = cmm.delta_e_transforms(tr1, self.src_img, tr2, self.src_img, out)
+        self.assertTrue(np.array_equal(out, oracle))
+        self.assertAlmostEqual(stats['mean'], oracle_stats['mean'])
+        self.assertGreater(stats['max'], 0)
+        self.assertIsNone(cmm.delta_e_transforms(tr1, self.src_img, tr2, self.src_img[:-1]))
+        cmm.delete_transform(tr1)
+        cmm.delete_transform(tr2)
+        cmm.close_profile(lab)
+
+    @unittest.skipIf(sys.platform == 'emscripten',
+                     "Emscripten float seems different from other CPUs.")
+    def test_float(self):
+        fmt_f32 = cmm.get_transform_formatter(1, cmm.PT_RGB, 3, 4, 0, 0)
+        tr = cmm.create_transform(
+            self.srgb, fmt_f32,
+            self.hp, fmt_f32,
+            cmm.INTENT_RELATIVE_COLORIMETRIC,
+            cmm.cmsFLAGS_BLACKPOINTCOMPENSATION)
+        src_f32 = self.src_img.astype(np.float32) / 255
+        trg_f32 = np.zeros_like(src_f32)
+        cmm.do_transform_f32_f32(tr, src_f32, trg_f32, src_f32.size // 3)
+        cmm.delete_transform(tr)
+        oracle = np.array(PILImageModule.open(ORACLE_DIR / 'test_8_8.png'), dtype=np.float32)
+        self.assertTrue(np.all(np.isclose(trg_f32 * 255, oracle, atol=3)))
+
+        tr = cmm.create_transform(
+            self.srgb, self.fmt,
+            self.hp, fmt_f32,
+            cmm.INTENT_RELATIVE_COLORIMETRIC,
+            cmm.cmsFLAGS_BLACKPOINTCOMPENSATION)
+        trg_f32[:] = 0
+        cmm.do_transform_8_f32(tr, self.src_img, trg_f32, self.src_img.size // 3)
+        cmm.delete_transform(tr)
+        self.assertTrue(np.all(np.isclose(trg_f32 * 255, oracle, atol=1)))
+
+        tr = cmm.create_transform(
+            self.srgb, self.fmt,
+            self.hp, self.fmt,
+            cmm.INTENT_RELATIVE_COLORIMETRIC,
+            cmm.cmsFLAGS_BLACKPOINTCOMPENSATION)
+        with self.assertRaises(ValueError):
+            cmm.do_transform_f32_f32(tr, src_f32, trg_f32, src_f32.size // 3)
+        with self.assertRaises(TypeError):
+            cmm.do_transform_8_f32(tr, self.src_img, np.zeros_like(src_f32, dtype=np.float64), self.src_img.size // 3)
+        cmm.delete_transform(tr)
+
+    @unittest.skipUnless(cmm.LCMS2_FAST_FLOAT, "Built without CMM_LCMS2_FAST_FLOAT.")
+    def test_8_8_fast_float(self):
+        ctx = cmm.create_context(1)
+        self.assertNotEqual(cmm.register_fast_float_plugin(ctx), 0)
+        tr = cmm.create_transform(
+            self.srgb, self.fmt,
+            self.hp, self.fmt,
+            cmm.INTENT_RELATIVE_COLORIMETRIC,
+            cmm.cmsFLAGS_BLACKPOINTCOMPENSATION,
+            context=ctx)
+        cmm.do_transform_8_8(tr, self.src_img, self.trg_img, self.src_img.size // 3)
+        oracle = np.array(PILImageModule.open(ORACLE_DIR / 'test_8_8.png'), dtype=np.int16)
+        self.assertLessEqual(np.abs(self.trg_img.astype(np.int16) - oracle).max(), 2)
+        cmm.delete_transform(tr)
+        cmm.delete_context(ctx)
+
+    @unittest.skipIf(sys.platform == 'emscripten',
+                     "Emscripten float seems different from other CPUs.")
+    def test_8_8_device_link(self):
+        tr = cmm.create_transform(
+            self.srgb, self.fmt,
+            self.hp, self.fmt,
+            cmm.INTENT_RELATIVE_COLORIMETRIC,
+            cmm.cmsFLAGS_BLACKPOINTCOMPENSATION)
+        link = cmm.transform_to_device_link(tr)
+        self.assertIsNotNone(link)
+        cmm.delete_transform(tr)
+        link_content = cmm.dump_profile(link)
+        cmm.close_profile(link)
+
+        link = cmm.open_profile_from_mem(link_content)
+        self.assertEqual(cmm.get_device_class(link), cmm.cmsSigLinkClass)
+        tr = cmm.create_transform_from_device_link(link, self.fmt, self.fmt, cmm.cmsFLAGS_NOOPTIMIZE)
+        self.assertIsNotNone(tr)
+        cmm.do_transform_8_8(tr, self.src_img, self.trg_img, self.src_img.size // 3)
+        oracle = np.array(PILImageModule.open(ORACLE_DIR / 'test_8_8.png'), dtype=np.int16)
+        self.assertLessEqual(np.abs(self.trg_img.astype(np.int16) - oracle).max(), 2)
+        cmm.delete_transform(tr)
+        cmm.close_profile(link)
+
+    @unittest.skipIf(sys.platform == 'emscripten',
+                     "Emscripten float seems different from other CPUs.")
+    def test_8_8_objects(self):
+        with cmm.Profile(cmm.create_srgb_profile()) as srgb:
+            tr = cmm.Transform.create(
+                srgb, self.fmt,
+                cmm.Profile.from_file(TEST_PROFILE), self.fmt,
+                cmm.INTENT_RELATIVE_COLORIMETRIC,
+                cmm.cmsFLAGS_BLACKPOINTCOMPENSATION)
+            self.assertEqual(len(tr.profiles), 2)
+            self.assertEqual(cmm.get_color_space(tr.profiles[1]), cmm.cmsSigRgbData)
+        self.assertTrue(srgb.closed)
+        with tr:
+            cmm.do_transform_8_8(tr, self.src_img, self.trg_img, self.src_img.size // 3)
+        self.assertTrue(tr.closed)
+        self.assertRaises(ValueError, lambda: cmm.do_transform_8_8(tr, self.src_img, self.trg_img, 1))
+        self.assert_image('test_8_8.png')
+
+    @unittest.skipIf(sys.platform == 'emscripten',
+                     "Emscripten float seems different from other CPUs.")
+    def test_multiprofile(self):
+        # Two profiles make the same pipeline as create_transform().
+        tr = cmm.create_multiprofile_transform(
+            [self.srgb, self.hp], self.fmt, self.fmt,
+            cmm.INTENT_RELATIVE_COLORIMETRIC, cmm.cmsFLAGS_BLACKPOINTCOMPENSATION)
+        cmm.do_transform_8_8(tr, self.src_img, self.trg_img, self.src_img.size // 3)
+        self.assert_image('test_8_8.png')
+        cmm.delete_transform(tr)
+
+        # sRGB -> working space -> printer in one pass, against two passes with a 16-bit buffer.
+        ws = cmm.Profile.from_file(CURRENT_DIR / 'tests/resource/Linear P3D65.icc')
+        fmt16 = cmm.get_transform_formatter(0, cmm.PT_RGB, 3, 2, 0, 0)
+        tr1 = cmm.create_transform(self.srgb, self.fmt, ws, fmt16, cmm.INTENT_RELATIVE_COLORIMETRIC, 0)
+        tr2 = cmm.create_transform(ws, fmt16, self.hp, self.fmt, cmm.INTENT_RELATIVE_COLORIMETRIC, cmm.cmsFLAGS_BLACKPOINTCOMPENSATION)
+        ws_img = np.zeros(self.src_img.shape, dtype=np.uint16)
+        cmm.do_transform_image(tr1, self.src_img, ws_img)
+        oracle = np.zeros_like(self.trg_img)
+        cmm.do_transform_image(tr2, ws_img, oracle)
+        cmm.delete_transform(tr1)
+        cmm.delete_transform(tr2)
+
+        tr = cmm.create_extended_transform(
+            [self.srgb, ws, self.hp], self.fmt, self.fmt,
+            [cmm.INTENT_RELATIVE_COLORIMETRIC] * 3, bpc=[False, False, True], adaptation=[1.0] * 3)
+        self.assertIsNotNone(tr)
+        cmm.do_transform_8_8(tr, self.src_img, self.trg_img, self.src_img.size // 3)
+        self.assertLessEqual(np.abs(self.trg_img.astype(np.int16) - oracle).max(), 4)
+        cmm.delete_transform(tr)
+        self.assertIsNone(cmm.create_extended_transform(
+            [self.srgb, ws, self.hp], self.fmt, self.fmt, [cmm.INTENT_RELATIVE_COLORIMETRIC] * 2))
+
+        with cmm.Transform.create_multiprofile(
+                [cmm.Profile(cmm.create_srgb_profile()), ws, cmm.Profile.from_file(TEST_PROFILE)], self.fmt, self.fmt,
+                cmm.INTENT_RELATIVE_COLORIMETRIC, cmm.cmsFLAGS_BLACKPOINTCOMPENSATION) as tr:
+            self.assertEqual(len(tr.profiles), 3)
+            cmm.do_transform_8_8(tr, self.src_img, self.trg_img, self.src_img.size // 3)
+        ws.close()
+
+    def test_transform_async(self):
+        tr = cmm.create_transform(
+            self.srgb, self.fmt,
+            self.hp, self.fmt,
+            cmm.INTENT_RELATIVE_COLORIMETRIC,
+            cmm.cmsFLAGS_BLACKPOINTCOMPENSATION)
+        futures = [cmm.do_transform_async(tr, self.src_img, np.zeros_like(self.src_img)) for _ in range(3)]
+        future = cmm.do_transform_async(tr, self.src_img, self.trg_img)
+        self.assertEqual(future.result(), -1)
+        self.assert_image('test_8_8.png')
+        for f in futures:
+            self.assertEqual(f.result(), -1)
+        self.assertEqual(cmm.do_transform_async(tr, self.src_img, self.trg_img[:, :-1]).result(), 0)
+
+        # Many pending calls wait in the queue instead of adding threads.
+        if os.path.isdir('/proc/self/task'):
+            futures = [cmm.do_transform_async(tr, self.src_img, np.zeros_like(self.src_img)) for _ in range(256)]
+            for f in futures:
+                self.assertEqual(f.result(), -1)
+            self.assertLessEqual(len(os.listdir('/proc/self/task')), 2 * os.cpu_count() + 16)
+        cmm.delete_transform(tr)
+
+        # The handle outlives delete / close while the futures are pending.
+        for cache_size in (0, 2):
+            cmm.set_transform_cache_size(cache_size)
+            try:
+                tr = cmm.Transform(cmm.create_transform(
+                    self.srgb, self.fmt,
+                    self.hp, self.fmt,
+                    cmm.INTENT_RELATIVE_COLORIMETRIC,
+                    cmm.cmsFLAGS_BLACKPOINTCOMPENSATION))
+                trgs = [np.zeros_like(self.src_img) for _ in range(4)]
+                futures = [cmm.do_transform_async(tr, self.src_img, trg) for trg in trgs]
+                tr.close()
+                for f, trg in zip(futures, trgs):
+                    self.assertEqual(f.result(), -1)
+                    self.trg_img = trg
+                    self.assert_image('test_8_8.png')
+            finally:
+                cmm.set_transform_cache_size(0)
+
+    def test_transform_stream(self):
+        tr = cmm.create_transform(
+            self.srgb, self.fmt,
+            self.hp, self.fmt,
+            cmm.INTENT_RELATIVE_COLORIMETRIC,
+            cmm.cmsFLAGS_BLACKPOINTCOMPENSATION)
+        self.assertEqual(cmm.do_transform_stream(tr, self.src_img, self.trg_img, rows_per_strip=7), -1)
+        self.assert_image('test_8_8.png')
+
+        strips = []
+        rows = (self.src_img[i:i + 10] for i in range(0, self.src_img.shape[0], 10))
+        self.assertEqual(cmm.do_transform_stream(tr, rows, strips.append, max_in_flight=3), -1)
+        self.assertTrue(all(s.dtype == np.uint8 and s.shape[1:] == self.src_img.shape[1:] for s in strips))
+        self.trg_img = np.concatenate(strips)
+        self.assert_image('test_8_8.png')
+
+        with tempfile.TemporaryDirectory() as d:
+            mm = np.lib.format.open_memmap(Path(d) / 'trg.npy', mode='w+', dtype=np.uint8, shape=self.src_img.shape)
+            self.assertEqual(cmm.do_transform_stream(tr, self.src_img, mm), -1)
+            self.trg_img = np.array(mm)
+            del mm
+        self.assert_image('test_8_8.png')
+
+        self.assertEqual(cmm.do_transform_stream(tr, [self.src_img[:, :-1]], self.trg_img), 0)
+        strips = []
+        with self.assertRaisesRegex(ValueError, 'row 10 '):
+            cmm.do_transform_stream(tr, [self.src_img[:10], self.src_img[10:20, :-1]], strips.append)
+        self.assertEqual([s.shape[0] for s in strips], [10])
+
+        # Strips referenced only by the stream, dropped right after delivery.
+        sums = []
+        rows = (self.src_img[i:i + 1].copy() for i in range(self.src_img.shape[0]))
+        self.assertEqual(cmm.do_transform_stream(tr, rows, lambda s: sums.append(int(s.sum())), max_in_flight=8), -1)
+        self.trg_img[:] = 0
+        self.assertEqual(cmm.do_transform_image(tr, self.src_img, self.trg_img), -1)
+        self.assertEqual(sums, [int(r.sum()) for r in self.trg_img])
+        cmm.delete_transform(tr)
+
+    def test_stats(self):
+        cmm.reset_stats()
+        cmm.enable_stats()
+        try:
+            tr = cmm.create_transform(
+                self.srgb, self.fmt,
+                self.hp, self.fmt,
+                cmm.INTENT_RELATIVE_COLORIMETRIC,
+                cmm.cmsFLAGS_BLACKPOINTCOMPENSATION)
+            n = self.src_img.size // 3
+            cmm.do_transform_8_8(tr, self.src_img, self.trg_img, n)
+            cmm.do_transform_8_8(tr, self.src_img, self.trg_img, n)
+            stats = cmm.get_stats()
+            self.assertEqual(stats['create_transform']['calls'], 1)
+            self.assertEqual(stats['do_transform']['calls'], 2)
+            self.assertEqual(stats['do_transform']['pixels'], 2 * n)
+            self.assertEqual(cmm.get_transform_stats(tr)['pixels'], 2 * n)
+            cmm.delete_transform(tr)
+            cmm.reset_stats()
+            self.assertEqual(cmm.get_stats()['do_transform']['calls'], 0)
+        finally:
+            cmm.enable_stats(False)
+        tr = cmm.create_transform(
+            self.srgb, self.fmt,
+            self.hp, self.fmt,
+            cmm.INTENT_RELATIVE_COLORIMETRIC,
+            cmm.cmsFLAGS_BLACKPOINTCOMPENSATION)
+        cmm.do_transform_8_8(tr, self.src_img, self.trg_img, self.src_img.size // 3)
+        self.assertIsNone(cmm.get_transform_stats(tr))
+        cmm.delete_transform(tr)
+
+    def test_8_8_threads(self):
+        tr = cmm.create_transform(
+            self.srgb, self.fmt,
+            self.hp, self.fmt,
+            cmm.INTENT_RELATIVE_COLORIMETRIC,
+            cmm.cmsFLAGS_BLACKPOINTCOMPENSATION)
+        cmm.do_transform_8_8(tr, self.src_img, self.trg_img, self.src_img.size // 3)
+        serial_img = self.trg_img.copy()
+        self.trg_img[:] = 0
+        cmm.set_num_threads(4)
+        try:
+            self.assertEqual(cmm.get_num_threads(), 4)
+            cmm.do_transform_8_8(tr, self.src_img, self.trg_img, self.src_img.size // 3)
+        finally:
+            cmm.set_num_threads(1)
+        self.assertTrue(np.array_equal(self.trg_img, serial_img))
+        cmm.delete_transform(tr)
+
+    def test_8_8_context(self):
+        tr = cmm.create_transform(
+            self.srgb, self.fmt,
+            self.hp, self.fmt,
+            cmm.INTENT_RELATIVE_COLORIMETRIC,
+            cmm.cmsFLAGS_BLACKPOINTCOMPENSATION)
+        cmm.do_transform_8_8(tr, self.src_img, self.trg_img, self.src_img.size // 3)
+        serial_img = self.trg_img.copy()
+        cmm.delete_transform(tr)
+
+        ctx = cmm.create_context(4, 1024)
+        self.assertIsNotNone(ctx)
+        tr = cmm.create_transform(
+            self.srgb, self.fmt,
+            self.hp, self.fmt,
+            cmm.INTENT_RELATIVE_COLORIMETRIC,
+            cmm.cmsFLAGS_BLACKPOINTCOMPENSATION,
+            context=ctx)
+        self.trg_img[:] = 0
+        cmm.do_transform_8_8(tr, self.src_img, self.trg_img, self.src_img.size // 3)
+        self.assertTrue(np.array_equal(self.trg_img, serial_img))
+        cmm.delete_transform(tr)
+        cmm.delete_context(ctx)
+
     @unittest.skipIf(sys.platform == 'emscripten',
                      "Emscripten float seems different from other CPUs.")
     def test_patch(self):
@@ -189,3 +855,123 @@ class TestConversion(unittest.TestCase):
         cmm.do_transform_16_8(tr, ws_img[:, :, ::-1].copy(), self.trg_img, ws_img.size // 3)
         self.assert_image('test_patch.png')
         cmm.delete_transform(tr)
+
+    @unittest.skipIf(sys.platform == 'emscripten',
+                     "Emscripten float seems different from other CPUs.")
+    def test_patch_image(self):
+        with open(CURRENT_DIR / 'tests/resource/Linear P3D65.icc', 'rb') as f:
+            WS_HP = cmm.open_profile_from_mem(f.read())
+
+        with open(CURRENT_DIR / 'tests/resource/sublinova-epson4pigment-PBT-20231121_srgb.icc', 'rb') as f:
+            SUBLINOVA_HP = cmm.open_profile_from_mem(f.read())
+
+        # BGR order of ws_img is given by swap, not by a channel-reversed copy.
+        fmt = cmm.get_transform_formatter(0, cmm.PT_RGB, 3, 2, 1, 0)
+
+        tr = cmm.create_transform(
+            WS_HP, fmt,
+            SUBLINOVA_HP, self.fmt,
+            cmm.INTENT_RELATIVE_COLORIMETRIC,
+            cmm.cmsFLAGS_BLACKPOINTCOMPENSATION)
+
+        ws_img = np.load(CURRENT_DIR / 'tests/resource/ws_img.npy')
+        padded = np.zeros((ws_img.shape[0], ws_img.shape[1] + 5, 3), dtype=np.uint8)
+        self.trg_img = padded[:, 2:-3]
+        self.assertNotEqual(cmm.do_transform_image(tr, ws_img, self.trg_img), 0)
+        self.assert_image('test_patch.png')
+        self.assertTrue(np.all(padded[:, :2] == 0) and np.all(padded[:, -3:] == 0))
+        # Pixels with a gap between them are not supported.
+        gapped = np.zeros((ws_img.shape[0], ws_img.shape[1], 4), dtype=np.uint8)
+        self.assertEqual(cmm.do_transform_image(tr, ws_img, gapped[:, :, :3]), 0)
+
+        self.assertEqual(cmm.do_transform_image(tr, ws_img[:, :, ::-1], self.trg_img), 0)
+        self.assertEqual(cmm.do_transform_image(tr, ws_img.astype(np.uint8), self.trg_img), 0)
+        # Rows overlapping by a pixel
+        overlapped = np.lib.stride_tricks.as_strided(
+            padded, shape=self.trg_img.shape, strides=((ws_img.shape[1] - 1) * 3, 3, 1))
+        self.assertEqual(cmm.do_transform_image(tr, ws_img, overlapped), 0)
+        cmm.delete_transform(tr)
+        cmm.close_profile(WS_HP)
+        cmm.close_profile(SUBLINOVA_HP)
+
+    def test_clut_engine(self):
+        isa = cmm.get_clut_engine_isa()
+        self.assertNotEqual(isa, 'off')
+        fmt16 = cmm.get_transform_formatter(0, cmm.PT_RGB, 3, 2, 0, 0)
+        tr = cmm.create_transform(
+            self.srgb, fmt16,
+            self.hp, fmt16,
+            cmm.INTENT_RELATIVE_COLORIMETRIC,
+            cmm.cmsFLAGS_BLACKPOINTCOMPENSATION)
+        src = np.random.default_rng(0).integers(0, 65536, (256, 256, 3), dtype=np.uint16)
+        src[0, :8] = 65535
+        trg = np.zeros_like(src)
+        cmm.do_transform_16_16(tr, src, trg, src.size // 3)
+        lut_in = src.reshape((-1, 3))
+        lut_out = np.zeros_like(lut_in)
+        cmm.eval_lut16(self.hp, 'A2B0', lut_in, lut_out)
+        try:
+            self.assertEqual(cmm.set_clut_engine_isa('off'), -1)
+            oracle = np.zeros_like(src)
+            cmm.do_transform_16_16(tr, src, oracle, src.size // 3)
+            lut_oracle = np.zeros_like(lut_in)
+            cmm.eval_lut16(self.hp, 'A2B0', lut_in, lut_oracle)
+        finally:
+            cmm.set_clut_engine_isa(isa)
+        self.assertTrue(np.array_equal(trg, oracle))
+        self.assertTrue(np.array_equal(lut_out, lut_oracle))
+        self.assertEqual(cmm.set_clut_engine_isa('mmx'), 0)
+        cmm.delete_transform(tr)
+
+    def test_alpha(self):
+        fmt_rgba = cmm.get_transform_formatter(0, cmm.PT_RGB, 3, 1, 0, 1)
+        tr = cmm.create_transform(
+            self.srgb, fmt_rgba,
+            self.hp, fmt_rgba,
+            cmm.INTENT_RELATIVE_COLORIMETRIC,
+            cmm.cmsFLAGS_BLACKPOINTCOMPENSATION | cmm.cmsFLAGS_COPY_ALPHA)
+        alpha = np.random.default_rng(0).integers(0, 256, self.src_img.shape[:2], dtype=np.uint8)
+        src = np.dstack([self.src_img, alpha])
+        trg = np.zeros_like(src)
+        self.assertEqual(cmm.do_transform_image(tr, src, trg), -1)
+        self.assertTrue(np.array_equal(trg[:, :, 3], alpha))
+        rgb = np.ascontiguousarray(trg[:, :, :3])
+        self.trg_img = rgb
+        self.assert_image('test_8_8.png')
+        cmm.delete_transform(tr)
+
+        # ARGB, premultiplied. Opaque pixels are almost the same as RGB.
+        fmt_argb = cmm.get_transform_formatter(0, cmm.PT_RGB, 3, 1, 0, 1, swap_first=1, premul=1)
+        tr = cmm.create_transform(
+            self.srgb, fmt_argb,
+            self.hp, fmt_argb,
+            cmm.INTENT_RELATIVE_COLORIMETRIC,
+            cmm.cmsFLAGS_BLACKPOINTCOMPENSATION | cmm.cmsFLAGS_COPY_ALPHA)
+        src = np.dstack([np.full(self.src_img.shape[:2], 255, dtype=np.uint8), self.src_img])
+        trg = np.zeros_like(src)
+        self.assertEqual(cmm.do_transform_image(tr, src, trg), -1)
+        self.assertTrue(np.all(trg[:, :, 0] == 255))
+        self.assertLessEqual(np.abs(trg[:, :, 1:].astype(int) - rgb).max(), 1)
+        cmm.delete_transform(tr)
+
+        # 16-bit RGBA goes through the CLUT engine, and 16-bit alpha is copied to 8-bit.
+        fmt16 = cmm.get_transform_formatter(0, cmm.PT_RGB, 3, 2, 0, 1)
+        fmt8 = cmm.get_transform_formatter(0, cmm.PT_RGB, 3, 1, 0, 1)
+        tr = cmm.create_transform(
+            self.srgb, fmt16,
+            self.hp, fmt8,
+            cmm.INTENT_RELATIVE_COLORIMETRIC,
+            cmm.cmsFLAGS_BLACKPOINTCOMPENSATION | cmm.cmsFLAGS_COPY_ALPHA)
+        src = np.random.default_rng(0).integers(0, 65536, (256, 256, 4), dtype=np.uint16)
+        trg = np.zeros(src.shape, dtype=np.uint8)
+        cmm.do_transform_16_8(tr, src, trg, src.size // 4)
+        isa = cmm.get_clut_engine_isa()
+        try:
+            cmm.set_clut_engine_isa('off')
+            oracle = np.zeros_like(trg)
+            cmm.do_transform_16_8(tr, src, oracle, src.size // 4)
+        finally:
+            cmm.set_clut_engine_isa(isa)
+        self.assertTrue(np.array_equal(trg, oracle))
+        self.assertTrue(np.any(trg[:, :, 3] != 0))
+        cmm.delete_transform(tr)